@@ -1,757 +1,6668 @@
-#define _POSIX_C_SOURCE 200809L        // enable POSIX stuff like getline on some libc
-
-#include <ctype.h>                     // isprint, isspace, etc.
-#include <errno.h>                     // errno, strerror
-#include <fcntl.h>                     // open, O_* flags
-#include <stdarg.h>                    // va_list for formatted status messages
-#include <stdbool.h>                   // bool type
-#include <stdio.h>                    // printf-like, FILE, getline
-#include <stdlib.h>                   // malloc, realloc, free, exit
-#include <string.h>                   // memcpy, memmove, strlen, strcmp
-#include <termios.h>                  // terminal raw mode
-#include <time.h>                     // time for status message timeout
-#include <unistd.h>                   // read, write, close, fsync
-#include <sys/ioctl.h>                // ioctl for window size
-
-/* ----------------------- Config / Macros ----------------------- */
-
-#define CTRL_KEY(k) ((k) & 0x1f)       // turn uppercase letter into control-code (e.g. 'Q' -> Ctrl-Q)
-#define EDITOR_VERSION "0.3-linux-fixed" // version shown in status bar
-#define STATUS_MSG_SEC 5               // how long status message stays visible
-
-/* ----------------------- Safe write helper ----------------------- */
-/* We use a wrapper so we never partially write to stdout and leave garbage. */
-
-static void xwrite(int fd, const void *buf, size_t n) {
-    const char *p = (const char*)buf;  // pointer to current position in buffer
-    size_t off = 0;                    // number of bytes already written
-    while (off < n) {                  // loop until all bytes are written
-        ssize_t r = write(fd, p + off, n - off); // try to write remaining bytes
-        if (r < 0) {                   // if write failed
-            if (errno == EINTR)        // if it was interrupted by signal
-                continue;              // try again
-            perror("write");           // otherwise print error
-            _exit(1);                  // and exit immediately (can't recover)
-        }
-        off += (size_t)r;              // advance by number of bytes written
-    }
-}
-
-/* ----------------------- Data structures ----------------------- */
-/* We model the file as a dynamic array of lines; each line is a NUL-terminated string. */
-
-typedef struct {
-    char **lines;                      // array of pointers to lines
-    int  *len;                         // array of lengths for each line (excluding NUL)
-    int   count;                       // how many lines are currently used
-    int   cap;                         // how many lines we can store without realloc
-} Buffer;
-
-typedef struct {
-    int cx, cy;                        // cursor position in text coordinates (col, row)
-    int rowoff;                        // vertical scroll: first row currently shown
-    int coloff;                        // horizontal scroll: first column currently shown (not fully used here)
-    int screenrows;                    // how many rows of text we can show
-    int screencols;                    // how many columns we can show
-    int pref_cx;                       // preferred column when moving up/down (to keep column when lines differ)
-} View;
-
-/* ----------------------- Globals ----------------------- */
-
-static struct termios orig_termios;    // original terminal settings to restore on exit
-static Buffer buf = {0};               // the text buffer
-static View   view = {0};              // the view (scroll + cursor)
-static bool   dirty = false;           // whether buffer has unsaved changes
-static char   filename[256] = "untitled.txt"; // current filename
-
-static char   statusmsg[256] = "";     // current status message
-static time_t statusmsg_time = 0;      // when we set the status message
-
-/* search state */
-static char last_query[256] = "";      // last search query (for Ctrl-N)
-static int  last_match_row = -1;       // row of last match
-static int  last_match_col = -1;       // column of last match
-
-/* temporary highlight for search result */
-static int hl_row = -1, hl_col = -1, hl_len = 0; // highlight location and length
-
-/* ask for Ctrl-Q twice if dirty */
-static int quit_times_needed = 1;      // if dirty, require 2 Ctrl-Q
-
-/* ----------------------- Terminal handling ----------------------- */
-
-static void disable_raw_mode(void) {
-    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios); // restore old terminal settings
-}
-
-static void die(const char *msg) {
-    xwrite(STDOUT_FILENO, "\x1b[2J\x1b[H", 7); // clear screen and go home
-    disable_raw_mode();               // restore terminal
-    perror(msg);                      // print reason
-    exit(1);                          // terminate
-}
-
-static void enable_raw_mode(void) {
-    if (tcgetattr(STDIN_FILENO, &orig_termios) == -1) // get current terminal attrs
-        die("tcgetattr");                              // abort on failure
-    struct termios raw = orig_termios;                 // start from current settings
-
-    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON); // turn off misc input flags
-    raw.c_oflag &= ~(OPOST);                                 // turn off all output post-processing
-    raw.c_cflag |= (CS8);                                    // 8-bit chars
-    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);         // turn off echo, canonical mode, signals
-
-    raw.c_cc[VMIN]  = 0;                                     // read returns as soon as there is input
-    raw.c_cc[VTIME] = 1;                                     // ...or after 0.1s
-
-    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)      // set new settings
-        die("tcsetattr");                                    // abort on failure
-}
-
-/*
- * Read a key from stdin and return an integer representing it.
- * We try to decode escape sequences like arrows and PageUp/Down
- * in a tolerant way (WSL / slow terminal can split bytes).
- */
-static int editor_read_key(void) {
-    char c;                                      // char read
-    while (1) {                                  // loop until we get something
-        ssize_t n = read(STDIN_FILENO, &c, 1);   // read 1 byte
-        if (n == 1) break;                       // got it
-        if (n == -1 && errno != EAGAIN)          // real error (not EAGAIN)
-            die("read");                         // abort
-        /* if n == 0 or EAGAIN we just loop, terminal is non-blocking-ish */
-    }
-
-    if (c != '\x1b')                             // if it's not ESC, it's a regular key
-        return c;                                // return it as-is
-
-    /* we saw ESC, so let's try to read the rest of the sequence */
-    char seq[16];                                // buffer for escape sequence
-    int n = 0;                                   // length read
-
-    while (n < (int)sizeof(seq)) {               // read until buffer is full
-        ssize_t r = read(STDIN_FILENO, &seq[n], 1); // try to read next byte
-        if (r != 1)                              // if no more bytes right now
-            break;                               // stop collecting
-        n++;                                     // we got one more
-        if ((seq[n-1] >= 'A' && seq[n-1] <= 'Z') // many CSI sequences end with letter
-            || seq[n-1] == '~')                  // or with tilde
-            break;                               // stop collecting
-    }
-
-    if (n == 0)                                  // lone ESC: no sequence
-        return '\x1b';                           // return ESC
-
-    if (seq[0] == '[') {                         // CSI sequence starting with '['
-        if (n == 2) {                            // typical arrow form: ESC [ A
-            switch (seq[1]) {                    // check final char
-                case 'A': return 1001;           // Up
-                case 'B': return 1002;           // Down
-                case 'C': return 1003;           // Right
-                case 'D': return 1004;           // Left
-                case 'H': return 'H';            // Home
-                case 'F': return 'E';            // End
-            }
-        } else if (n >= 3 && seq[1] >= '0' && seq[1] <= '9') { // ESC [ 1 ~ kind
-            int num = 0;                         // numeric part
-            for (int i = 1; i < n-1; i++) {      // parse digits
-                if (seq[i] >= '0' && seq[i] <= '9')
-                    num = num*10 + (seq[i]-'0'); // accumulate
-            }
-            switch (num) {                       // map numeric code
-                case 1:
-                case 7: return 'H';              // Home
-                case 4:
-                case 8: return 'E';              // End
-                case 3: return 127;              // Delete
-                case 5: return 1005;             // PageUp
-                case 6: return 1006;             // PageDown
-            }
-        }
-    } else if (seq[0] == 'O') {                  // ESC O ... alternative arrow set
-        if (n == 2) {
-            switch (seq[1]) {
-                case 'A': return 1001;           // Up
-                case 'B': return 1002;           // Down
-                case 'C': return 1003;           // Right
-                case 'D': return 1004;           // Left
-                case 'H': return 'H';            // Home
-                case 'F': return 'E';            // End
-            }
-        }
-    }
-
-    return '\x1b';                               // fallback: return ESC
-}
-
-/* Get terminal window size using ioctl */
-static int get_window_size(int *rows, int *cols) {
-    struct winsize ws;                           // structure to hold size
-    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0 || ws.ws_row == 0)
-        return -1;                               // failed
-    *cols = ws.ws_col;                           // set columns
-    *rows = ws.ws_row;                           // set rows
-    return 0;                                    // success
-}
-
-/* ----------------------- Status & messages ----------------------- */
-
-static void editor_set_status(const char *fmt, ...) {
-    va_list ap;                                  // variadic args
-    va_start(ap, fmt);                           // start collecting
-    vsnprintf(statusmsg, sizeof(statusmsg), fmt, ap); // write formatted message
-    va_end(ap);                                  // stop
-    statusmsg_time = time(NULL);                 // remember when we set it
-}
-
-/* ----------------------- Buffer management ----------------------- */
-
-/* Initialize buffer with 1 empty line so editor always has at least one line */
-static void buffer_init(Buffer *b) {
-    b->cap = 64;                                 // initial capacity
-    b->count = 1;                                // start with 1 line
-    b->lines = (char**)calloc(b->cap, sizeof(char*)); // allocate line array
-    b->len   = (int*)calloc(b->cap, sizeof(int));     // allocate length array
-    b->lines[0] = strdup("");                    // first line is empty string
-    b->len[0] = 0;                               // length is 0
-}
-
-/* Free buffer content */
-static void buffer_free(Buffer *b) {
-    if (!b || !b->lines) return;                 // nothing to free
-    for (int i = 0; i < b->count; i++)           // free each line
-        free(b->lines[i]);
-    free(b->lines);                              // free array of line pointers
-    free(b->len);                                // free array of lengths
-    memset(b, 0, sizeof(*b));                    // clear structure
-}
-
-/* Ensure we have space for at least 'need' lines */
-static void buffer_ensure_capacity(Buffer *b, int need) {
-    if (need <= b->cap) return;                  // capacity is enough
-    while (b->cap < need)                        // grow exponentially
-        b->cap *= 2;
-    b->lines = (char**)realloc(b->lines, b->cap * sizeof(char*)); // grow line array
-    b->len   = (int*)realloc(b->len,   b->cap * sizeof(int));     // grow len array
-}
-
-/* Insert a line at position 'at' with content 's' of length 'n' */
-static void buffer_insert_line(Buffer *b, int at, const char *s, int n) {
-    if (at < 0 || at > b->count) return;         // out of range
-    buffer_ensure_capacity(b, b->count + 1);     // make space for new line
-    memmove(&b->lines[at+1], &b->lines[at], (b->count - at) * sizeof(char*)); // shift lines down
-    memmove(&b->len[at+1],   &b->len[at],   (b->count - at) * sizeof(int));   // shift lengths down
-    b->lines[at] = (char*)malloc(n + 1);         // allocate new line
-    memcpy(b->lines[at], s, n);                  // copy content
-    b->lines[at][n] = '\0';                      // terminate string
-    b->len[at] = n;                              // set length
-    b->count++;                                  // one more line
-}
-
-/* Helper: append an empty line at the bottom (used for Arrow Down create-line) */
-static void buffer_append_empty(Buffer *b) {
-    buffer_insert_line(b, b->count, "", 0);      // insert empty string at end
-}
-
-/* Insert a single character into a line at (row, col) */
-static void buffer_insert_char(Buffer *b, int row, int col, char c) {
-    int L = b->len[row];                         // current line length
-    if (col < 0) col = 0;                        // clamp column
-    if (col > L) col = L;                        // clamp to end
-    b->lines[row] = (char*)realloc(b->lines[row], L + 2); // +1 char +1 NUL
-    memmove(&b->lines[row][col+1], &b->lines[row][col], L - col + 1); // shift right incl. NUL
-    b->lines[row][col] = c;                      // insert char
-    b->len[row] = L + 1;                         // update length
-    dirty = true;                                // mark buffer dirty
-}
-
-/* Delete char at (row, col-1) -> typical backspace behavior */
-static void buffer_delete_char(Buffer *b, int row, int col) {
-    int L = b->len[row];                         // line length
-    if (col <= 0 || col > L) return;             // nothing to delete
-    memmove(&b->lines[row][col-1], &b->lines[row][col], L - col + 1); // shift left
-    b->len[row] = L - 1;                         // update length
-    dirty = true;                                // mark dirty
-}
-
-/* Split a line into two at column 'col' (used for Enter) */
-static void buffer_split_line(Buffer *b, int row, int col) {
-    int L = b->len[row];                         // line length
-    if (col < 0) col = 0;                        // clamp
-    if (col > L) col = L;                        // clamp
-    const char *right = &b->lines[row][col];     // pointer to right part
-    buffer_insert_line(b, row + 1, right, L - col); // insert right part as new line
-    b->lines[row][col] = '\0';                   // truncate original line
-    b->len[row] = col;                           // update length
-    dirty = true;                                // mark dirty
-}
-
-/* Join current line with previous one (used for backspace at col 0) */
-static void buffer_join_with_prev(Buffer *b, int row) {
-    if (row <= 0 || row >= b->count) return;     // can't join
-    int Lp = b->len[row - 1];                    // length of previous line
-    int Lc = b->len[row];                        // length of current line
-    b->lines[row - 1] = (char*)realloc(b->lines[row - 1], Lp + Lc + 1); // extend prev
-    memcpy(&b->lines[row - 1][Lp], b->lines[row], Lc + 1); // copy current + NUL
-    b->len[row - 1] = Lp + Lc;                   // update length
-
-    free(b->lines[row]);                         // free current line
-    memmove(&b->lines[row], &b->lines[row + 1], (b->count - row - 1) * sizeof(char*)); // shift up
-    memmove(&b->len[row],   &b->len[row + 1],   (b->count - row - 1) * sizeof(int));   // shift lengths
-    b->count--;                                  // one line less
-    dirty = true;                                // mark dirty
-}
-
-/* ----------------------- File I/O ----------------------- */
-/* Load file into buffer as lines */
-static void editor_open(const char *path) {
-    FILE *f = fopen(path, "rb");                 // open file for binary read
-    if (!f) {                                    // if file doesn't exist
-        snprintf(filename, sizeof(filename), "%s", path); // just remember name
-        return;                                  // start with empty buffer
-    }
-
-    buffer_free(&buf);                           // clear existing buffer
-    buffer_init(&buf);                           // start fresh
-
-    char *line = NULL;                           // getline buffer
-    size_t cap = 0;                              // getline capacity
-    ssize_t n;                                   // read length
-    bool first = true;                           // special-case first line
-
-    while ((n = getline(&line, &cap, f)) != -1) { // read each line
-        while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r')) // strip newlines
-            n--;
-        if (first) {                             // first line replaces the initial empty line
-            free(buf.lines[0]);                  // free empty line
-            buf.lines[0] = (char*)malloc(n + 1); // allocate exactly
-            memcpy(buf.lines[0], line, n);       // copy data
-            buf.lines[0][n] = '\0';              // terminate
-            buf.len[0] = (int)n;                 // set length
-            first = false;                       // no longer first
-        } else {
-            buffer_insert_line(&buf, buf.count, line, (int)n); // append line
-        }
-    }
-    free(line);                                  // free getline buffer
-    fclose(f);                                   // close file
-    snprintf(filename, sizeof(filename), "%s", path); // remember file name
-    dirty = false;                               // clean state
-}
-
-/* Atomic save: write to tmp + fsync + rename */
-static bool editor_save_atomic(void) {
-    char tmpname[300];                           // buffer for tmp filename
-    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename); // tmp = filename.tmp
-
-    int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644); // open tmp
-    if (fd == -1) return false;                  // failed to open tmp
-
-    bool ok = true;                              // track success
-    for (int i = 0; i < buf.count; i++) {        // write each line
-        if (write(fd, buf.lines[i], buf.len[i]) == -1) { ok = false; break; } // write line
-        if (write(fd, "\n", 1) == -1) { ok = false; break; }                  // newline
-    }
-    if (ok && fsync(fd) == -1) ok = false;       // flush to disk
-    if (close(fd) == -1) ok = false;             // close file
-    if (!ok) { unlink(tmpname); return false; }  // cleanup on failure
-
-    if (rename(tmpname, filename) == -1) {       // atomically replace real file
-        unlink(tmpname);                         // remove tmp
-        return false;                            // report failure
-    }
-
-    dirty = false;                               // buffer is clean now
-    return true;                                 // success
-}
-
-/* ----------------------- View / Rendering ----------------------- */
-
-/* Update view dimensions from terminal */
-static bool editor_update_dimensions(void) {
-    int rows = 24;                               // default rows if ioctl fails
-    int cols = 80;                               // default cols
-    if (get_window_size(&rows, &cols) == -1) {   // try to get real size
-        if (view.screenrows > 0)                 // if we already have previous size
-            rows = view.screenrows + 2;          // approximate
-        if (view.screencols > 0)                 // same for cols
-            cols = view.screencols;
-    }
-    int textrows = rows - 2;                     // leave 2 lines: status + message
-    if (textrows < 1) textrows = 1;              // clamp
-    bool changed = (textrows != view.screenrows) || (cols != view.screencols); // did it change?
-    view.screenrows = textrows;                  // store rows
-    view.screencols = cols;                      // store cols
-    return changed;                              // return whether it changed
-}
-
-/* Return how far we are in file as percent (for status bar) */
-static int percent_through(void) {
-    if (buf.count <= 1) return 100;              // single-line file: show 100%
-    int p = (view.cy + 1) * 100 / buf.count;     // simple proportion
-    if (p < 1) p = 1;                            // clamp low
-    if (p > 100) p = 100;                        // clamp high
-    return p;                                    // return percentage
-}
-
-/* Adjust scroll so cursor is visible */
-static void editor_scroll(void) {
-    if (view.cy < view.rowoff)                   // if cursor above top
-        view.rowoff = view.cy;                   // scroll up
-    if (view.cy >= view.rowoff + view.screenrows) // if cursor below bottom
-        view.rowoff = view.cy - view.screenrows + 1; // scroll down
-
-    if (view.cx < view.coloff)                   // if cursor left of left edge
-        view.coloff = view.cx;                   // scroll left
-    if (view.cx >= view.coloff + view.screencols) // if cursor right of right edge
-        view.coloff = view.cx - view.screencols + 1; // scroll right
-}
-
-/* Draw a single line considering highlight and horizontal offset */
-static void draw_line_with_highlight(int filerow) {
-    int left = view.coloff;                      // starting column
-    int maxw = view.screencols;                  // max width we can draw
-    int len = buf.len[filerow] - left;           // visible part length
-    if (len < 0) len = 0;                        // nothing to show
-    if (len > maxw) len = maxw;                  // clamp to screen
-
-    if (len == 0) return;                        // empty line: nothing to draw
-
-    if (filerow == hl_row && hl_len > 0 && hl_col >= 0) { // if this line has highlight
-        int hstart = hl_col - left;              // highlight start in screen coords
-        int hend   = hl_col + hl_len - left;     // highlight end in screen coords
-
-        if (hend <= 0 || hstart >= maxw) {       // highlight is outside screen
-            xwrite(STDOUT_FILENO, &buf.lines[filerow][left], len); // draw normal
-            return;                              // done
-        }
-        if (hstart < 0) hstart = 0;              // clamp start
-        if (hend > len) hend = len;              // clamp end
-
-        if (hstart > 0)                          // draw text before highlight
-            xwrite(STDOUT_FILENO, &buf.lines[filerow][left], hstart);
-        xwrite(STDOUT_FILENO, "\x1b[7m", 4);      // turn on inverse video
-        xwrite(STDOUT_FILENO, &buf.lines[filerow][left + hstart], hend - hstart); // draw highlighted part
-        xwrite(STDOUT_FILENO, "\x1b[m", 3);       // reset attributes
-        if (hend < len)                          // draw text after highlight
-            xwrite(STDOUT_FILENO, &buf.lines[filerow][left + hend], len - hend);
-    } else {
-        xwrite(STDOUT_FILENO, &buf.lines[filerow][left], len); // normal draw
-    }
-}
-
-/* Draw whole screen (text area + status + message) */
-static void editor_draw_screen(void) {
-    xwrite(STDOUT_FILENO, "\x1b[?25l\x1b[H", 8);  // hide cursor and move to top-left
-    editor_scroll();                             // make sure cursor is in viewport
-
-    for (int y = 0; y < view.screenrows; y++) {  // draw every visible text row
-        int filerow = view.rowoff + y;           // actual file row index
-        xwrite(STDOUT_FILENO, "\x1b[2K\r", 5);   // clear current line
-        if (filerow < buf.count)                 // if there is a file line
-            draw_line_with_highlight(filerow);   // draw that line
-        else
-            xwrite(STDOUT_FILENO, "", 0);        // no '~', just leave it empty
-        xwrite(STDOUT_FILENO, "\r\n", 2);        // go to next terminal line
-    }
-
-    xwrite(STDOUT_FILENO, "\x1b[7m", 4);         // start inverted for status bar
-    char left[160], right[80];                   // buffers for status parts
-    snprintf(left,  sizeof(left),  " %.40s %s", filename, dirty ? "(modified)" : ""); // left side: filename + dirty
-    snprintf(right, sizeof(right), " %d:%d %3d%% v%s ",
-             view.cy + 1, view.cx + 1, percent_through(), EDITOR_VERSION); // right side: pos + percent + version
-
-    int len = (int)strlen(left);                 // length of left part
-    if (len > view.screencols) len = view.screencols; // clamp
-    xwrite(STDOUT_FILENO, left, len);            // write left part
-
-    int right_len = (int)strlen(right);          // length of right part
-    while (len < view.screencols - right_len) {  // pad with spaces between left and right
-        xwrite(STDOUT_FILENO, " ", 1);
-        len++;
-    }
-    if (right_len > view.screencols) right_len = view.screencols; // clamp right part
-    xwrite(STDOUT_FILENO, right, right_len);    // write right part
-    xwrite(STDOUT_FILENO, "\x1b[m", 3);         // end inverted
-    xwrite(STDOUT_FILENO, "\r\n", 2);           // move to message line
-
-    xwrite(STDOUT_FILENO, "\x1b[2K\r", 5);      // clear message line
-    if (statusmsg[0] && (time(NULL) - statusmsg_time) < STATUS_MSG_SEC) { // if message is fresh
-        int msglen = (int)strlen(statusmsg);     // length of message
-        if (msglen > view.screencols) msglen = view.screencols; // clamp
-        xwrite(STDOUT_FILENO, statusmsg, msglen); // write message
-    }
-
-    int scr_y = view.cy - view.rowoff;           // cursor y on screen
-    int scr_x = view.cx - view.coloff;           // cursor x on screen
-    if (scr_y < 0) scr_y = 0;                    // clamp
-    if (scr_y >= view.screenrows) scr_y = view.screenrows - 1;
-    if (scr_x < 0) scr_x = 0;
-    if (scr_x >= view.screencols) scr_x = view.screencols - 1;
-
-    dprintf(STDOUT_FILENO, "\x1b[%d;%dH", scr_y + 1, scr_x + 1); // move cursor to text area
-    xwrite(STDOUT_FILENO, "\x1b[?25h", 6);        // show cursor again
-}
-
-/* ----------------------- Movement & Editing ----------------------- */
-
-/* Move by page (PageUp/PageDown) */
-static void editor_move_cursor_vert(int key) {
-    int page = view.screenrows - 2;              // how many lines to move
-    if (page < 1) page = 1;                      // at least 1
-
-    if (key == 1005) {                           // PageUp
-        view.cy -= page;                         // move up
-        if (view.cy < 0) view.cy = 0;            // clamp to top
-    } else {                                     // PageDown
-        view.cy += page;                         // move down
-        if (view.cy >= buf.count) view.cy = buf.count - 1; // clamp to last line
-    }
-
-    int L = buf.len[view.cy];                    // length of new line
-    view.cx = (view.pref_cx <= L) ? view.pref_cx : L; // restore preferred col
-}
-
-/* Move cursor for arrows/Home/End; create new line on Down at EOF */
-static void editor_move_cursor(int key) {
-    switch (key) {
-        case 1004: {                             // Left
-            if (view.cx > 0) {                   // if not at start of line
-                view.cx--;                       // move left
-                view.pref_cx = view.cx;          // update preferred col
-            } else if (view.cy > 0) {            // if at start but not first line
-                view.cy--;                       // go to previous line
-                view.cx = buf.len[view.cy];      // to its end
-                view.pref_cx = view.cx;          // update preferred col
-            }
-        } break;
-        case 1003: {                             // Right
-            if (view.cy < buf.count) {           // if there is a line
-                int L = buf.len[view.cy];        // current line length
-                if (view.cx < L) {               // if not at end
-                    view.cx++;                   // move right
-                    view.pref_cx = view.cx;      // update
-                } else if (view.cy + 1 < buf.count) { // if at end but there is next line
-                    view.cy++;                   // go to next line
-                    view.cx = 0;                 // at its start
-                    view.pref_cx = 0;            // update
-                }
-            }
-        } break;
-        case 1001: {                             // Up
-            if (view.cy > 0)                     // if not top line
-                view.cy--;                       // move up
-            int L = buf.len[view.cy];            // new line length
-            view.cx = (view.pref_cx <= L) ? view.pref_cx : L; // clamp to line end
-        } break;
-        case 1002: {                             // Down
-            if (view.cy + 1 < buf.count) {       // if there is a line below
-                view.cy++;                       // go down
-            } else {                             // we are on last line
-                buffer_append_empty(&buf);       // create a new empty line
-                view.cy++;                       // move to it
-            }
-            int L = buf.len[view.cy];            // length of new line
-            view.cx = (view.pref_cx <= L) ? view.pref_cx : L; // restore preferred col
-        } break;
-        case 'H': {                              // Home
-            view.cx = 0;                         // go to start of line
-            view.pref_cx = 0;                    // update preferred col
-        } break;
-        case 'E': {                              // End
-            view.cx = buf.len[view.cy];          // go to end of line
-            view.pref_cx = view.cx;              // update preferred col
-        } break;
-    }
-}
-
-/* Insert printable char at cursor */
-static void editor_insert_char(int c) {
-    buffer_insert_char(&buf, view.cy, view.cx, (char)c); // insert char into buffer
-    view.cx++;                              // move cursor right
-    view.pref_cx = view.cx;                // update preferred col
-    hl_row = hl_col = hl_len = -1;         // clear search highlight
-}
-
-/* Insert newline at cursor */
-static void editor_insert_newline(void) {
-    buffer_split_line(&buf, view.cy, view.cx); // split line at cursor
-    view.cy++;                                 // move cursor to new line
-    view.cx = 0;                               // at start of new line
-    view.pref_cx = 0;                          // update preferred col
-    hl_row = hl_col = hl_len = -1;             // clear highlight
-}
-
-/* Delete char before cursor or join lines */
-static void editor_backspace(void) {
-    if (view.cx > 0) {                         // if not at start of line
-        buffer_delete_char(&buf, view.cy, view.cx); // delete char
-        view.cx--;                              // move cursor left
-        view.pref_cx = view.cx;                 // update
-    } else if (view.cy > 0) {                   // at start but not first line
-        int prev_len = buf.len[view.cy - 1];    // length of previous line
-        buffer_join_with_prev(&buf, view.cy);   // merge current into previous
-        view.cy--;                              // move cursor to previous line
-        view.cx = prev_len;                     // at the join point
-        view.pref_cx = view.cx;                 // update
-    }
-    hl_row = hl_col = hl_len = -1;             // clear highlight
-}
-
-/* ----------------------- Prompt & Search ----------------------- */
-
-/* Simple prompt at bottom that returns a string (like "/" in vim) */
-static bool editor_prompt(const char *prompt, char *out, size_t outlen) {
-    size_t n = 0;                              // current length of user input
-    out[0] = '\0';                             // start empty
-    while (1) {                                // loop until user confirms or cancels
-        editor_set_status("%s%s", prompt, out); // show prompt + current input
-        editor_draw_screen();                  // redraw
-        int c = editor_read_key();             // read key
-        if (c == '\x1b') {                     // ESC -> cancel
-            editor_set_status("Canceled");     // say canceled
-            return false;                      // signal cancel
-        }
-        if (c == '\r' || c == '\n') {          // Enter
-            if (n > 0) {                       // only accept if user typed something
-                editor_set_status("");         // clear status
-                return true;                   // success
-            }
-        } else if (c == 127) {                 // Backspace inside prompt
-            if (n > 0) {                       // if we have chars
-                out[--n] = '\0';               // drop last char
-            }
-        } else if (isprint(c)) {               // printable
-            if (n + 1 < outlen) {              // if we have room
-                out[n++] = (char)c;            // append char
-                out[n] = '\0';                 // keep NUL
-            }
-        }
-    }
-}
-
-/* Find next occurrence of last_query; from_current = search from current cursor */
-static bool editor_find_next(bool from_current) {
-    if (last_query[0] == '\0') return false;   // nothing to search
-
-    int r = from_current ? view.cy : last_match_row;             // start row
-    int c = from_current ? view.cx : (last_match_col + 1);       // start col
-
-    for (int round = 0; round < 2; round++) { // 2 rounds to wrap around
-        for (; r < buf.count; r++, c = 0) {    // scan rows
-            const char *hay = buf.lines[r];    // line text
-            if (buf.len[r] == 0) continue;     // skip empty lines
-            const char *p = strstr(hay + (c < buf.len[r] ? c : buf.len[r]), last_query); // find substring
-            if (p) {                           // found
-                last_match_row = r;            // remember match row
-                last_match_col = (int)(p - hay); // remember match col
-                hl_row = r; hl_col = last_match_col; hl_len = (int)strlen(last_query); // set highlight
-                view.cy = r;                   // move cursor to match
-                view.pref_cx = view.cx = last_match_col; // set col
-                return true;                   // success
-            }
-        }
-        r = 0; c = 0;                          // wrap to top
-    }
-    return false;                              // not found
-}
-
-/* Ask user for query and search first occurrence */
-static void editor_find(void) {
-    char query[256] = "";                      // buffer for query
-    if (!editor_prompt("/", query, sizeof(query))) { // if user cancels
-        hl_row = hl_col = hl_len = -1;         // clear highlight
-        return;                                // done
-    }
-    snprintf(last_query, sizeof(last_query), "%s", query); // store last query
-    last_match_row = view.cy;                  // start from current
-    last_match_col = view.cx - 1;              // will be incremented by search
-    if (!editor_find_next(true)) {             // try to find
-        editor_set_status("Not found: %s", last_query); // message
-        hl_row = hl_col = hl_len = -1;         // clear highlight
-    } else {
-        editor_set_status("Found: %s  (Ctrl-N for next)", last_query); // message
-    }
-}
-
-/* ----------------------- Main loop ----------------------- */
-
-int main(int argc, char **argv) {
-    atexit(disable_raw_mode);                  // make sure raw mode is off at exit
-    enable_raw_mode();                         // enter raw mode
-
-    buffer_init(&buf);                         // initialize buffer with 1 empty line
-    if (argc >= 2) {                           // if file provided
-        snprintf(filename, sizeof(filename), "%s", argv[1]); // remember name
-        editor_open(argv[1]);                  // load file
-    }
-
-    view.cx = view.cy = 0;                     // cursor at start
-    view.pref_cx = 0;                          // preferred col 0
-    view.rowoff = view.coloff = 0;             // no scroll yet
-    editor_update_dimensions();                // get terminal size
-    editor_set_status("HELP: type | Enter | Backspace | Ctrl-S save | Ctrl-F find | Ctrl-N next | Ctrl-Q quit"); // initial help
-    editor_draw_screen();                      // first draw
-
-    while (1) {                                // main loop
-        int c = editor_read_key();             // read key
-
-        bool request_redraw = true;            // by default we redraw
-        bool exit_editor = false;              // track exit
-
-        if (c == CTRL_KEY('q')) {              // Ctrl-Q
-            if (dirty && quit_times_needed > 0) { // if unsaved changes and still need confirmation
-                editor_set_status("Unsaved changes — press Ctrl-Q again to quit"); // warn
-                quit_times_needed--;           // decrease counter
-            } else {
-                xwrite(STDOUT_FILENO, "\x1b[2J\x1b[H", 7); // clear screen on exit
-                exit_editor = true;            // exit loop
-                request_redraw = false;        // no need to redraw
-            }
-        } else if (c == CTRL_KEY('s')) {       // Ctrl-S save
-            if (editor_save_atomic())          // try to save
-                editor_set_status("Saved: %s", filename); // success
-            else
-                editor_set_status("Save failed: %s", strerror(errno)); // error
-            quit_times_needed = 1;             // reset quit counter
-        } else if (c == CTRL_KEY('f')) {       // Ctrl-F search
-            editor_find();                     // run search
-            quit_times_needed = 1;             // reset quit counter
-        } else if (c == CTRL_KEY('n')) {       // Ctrl-N next match
-            if (!editor_find_next(false))      // find next after last match
-                editor_set_status("No more matches for: %s", last_query); // message
-            quit_times_needed = 1;             // reset
-        } else if (c == 1005 || c == 1006) {   // PageUp / PageDown
-            editor_move_cursor_vert(c);        // move by page
-            quit_times_needed = 1;             // reset
-            hl_row = hl_col = hl_len = -1;     // clear highlight
-        } else if (c == 1001 || c == 1002 || c == 1003 || c == 1004 || c == 'H' || c == 'E') {
-            editor_move_cursor(c);             // move cursor
-            quit_times_needed = 1;             // reset
-            hl_row = hl_col = hl_len = -1;     // clear highlight
-        } else if (c == '\r' || c == '\n') {   // Enter
-            editor_insert_newline();           // split line
-            quit_times_needed = 1;             // reset
-        } else if (c == 127) {                 // Backspace / Delete
-            editor_backspace();                // delete char
-            quit_times_needed = 1;             // reset
-        } else if (isprint(c)) {               // printable char
-            editor_insert_char(c);             // insert
-            quit_times_needed = 1;             // reset
-        } else {
-            request_redraw = false;            // unknown key: no need to redraw
-        }
-
-        if (exit_editor)                       // if we decided to exit
-            break;                             // break main loop
-
-        if (editor_update_dimensions())        // if window size changed
-            request_redraw = true;             // force redraw
-        if (request_redraw)                    // if we decided to redraw
-            editor_draw_screen();              // draw full screen
-    }
-
-    buffer_free(&buf);                         // free buffer
-    return 0;                                  // done
-}
+#define _POSIX_C_SOURCE 200809L        // enable POSIX stuff like getline on some libc
+#define _DEFAULT_SOURCE                // d_type in directory entries
+
+#include <ctype.h>                     // isprint, isspace, etc.
+#include <dirent.h>                    // readdir for the project search walk
+#include <errno.h>                     // errno, strerror
+#include <limits.h>                    // INT_MAX
+#include <fcntl.h>                     // open, O_* flags
+#include <poll.h>                      // poll to check for pending input
+#include <pthread.h>                   // search worker pool
+#include <regex.h>                     // POSIX regexec, the --bench-regex baseline
+#include <stdarg.h>                    // va_list for formatted status messages
+#include <stdatomic.h>                 // chunk counter and best match shared by search workers
+#include <stdbool.h>                   // bool type
+#include <stdint.h>                    // uint64_t for timerfd reads
+#include <stdio.h>                    // printf-like, FILE, getline
+#include <stdlib.h>                   // malloc, realloc, free, exit
+#include <string.h>                   // memcpy, memmove, strlen, strcmp
+#include <termios.h>                  // terminal raw mode
+#include <time.h>                     // time for status message timeout
+#include <unistd.h>                   // read, write, close, fsync
+#include <signal.h>                   // sigset_t, SIGWINCH
+#include <sys/epoll.h>                // epoll event loop
+#include <sys/ioctl.h>                // ioctl for window size
+#include <sys/mman.h>                 // mmap of big files the project search reads
+#include <sys/signalfd.h>             // SIGWINCH as a readable fd
+#include <sys/stat.h>                 // fstat, file types
+#include <sys/timerfd.h>              // status message expiry as a readable fd
+
+/* ----------------------- Config / Macros ----------------------- */
+
+#define CTRL_KEY(k) ((k) & 0x1f)       // turn uppercase letter into control-code (e.g. 'Q' -> Ctrl-Q)
+#define EDITOR_VERSION "0.3-linux-fixed" // version shown in status bar
+#define STATUS_MSG_SEC 5               // how long status message stays visible
+#define FRAME_RATE_CAP 0               // max frames per second, 0 = no cap (AURIGA_FPS overrides)
+#define MAX_FRAME_GAP_MS 100           // while input keeps streaming in, still draw this often
+#define ESC_TIMEOUT_MS 30              // a lone ESC is the Escape key if nothing follows within this
+#define ESC_SEQ_TIMEOUT_MS 500         // a sequence cut off for this long is dropped
+#define KEY_QUEUE 4096                 // decoded keys waiting to be processed
+#define KEY_MAX_PARAMS 4               // numeric parameters kept per escape sequence
+#define KEY_SHIFT 0x10000              // modifier bits ORed onto a key code
+#define KEY_ALT   0x20000
+#define KEY_CTRL  0x40000
+#define PASTE_CHUNK 65536              // bytes read per read() while a bracketed paste streams in
+#define HORSPOOL_MIN 128               // queries this long use Horspool skipping instead of the vector filter
+#define RX_MAX_REPEAT 1000             // largest count allowed in a regex {n,m}
+#define RX_MAX_NFA 20000               // NFA states a regex may compile to
+#define RX_DFA_STATES 2048             // cached DFA states per direction before the cache is flushed
+#define SEARCH_CHUNK (1 << 20)         // bytes per parallel search task (extended to a line end)
+#define SEARCH_PAR_MIN (4 << 20)       // smaller texts are searched on the calling thread
+#define SEARCH_MAX_THREADS 16          // search threads at most (AURIGA_THREADS overrides the CPU count)
+#define MCOUNT_NOTE_MS 100             // the match counter reports progress at most this often
+#define TRI_MIN_MB 64                  // buffers this big get a trigram index (AURIGA_INDEX_MB overrides, 0 = never)
+#define TRI_BLOCK_BYTES (256 << 10)    // the index groups lines into blocks of about this many bytes
+#define TRI_SIG_LOG2 15                // 2^15 hashed trigram bits per block
+#define TRI_SLICE_BYTES (4 << 20)      // bytes indexed per idle slice before input is looked at again
+#define GREP_MAX_HITS 100000           // project search stops after this many matching lines
+#define GREP_BINARY_PROBE 8192         // a NUL byte in this many leading bytes marks a file as binary
+#define GREP_MMAP_MIN (64 << 10)       // files this big are mapped; smaller ones are read (cheaper)
+#define GREP_TEXT_MAX 200              // bytes of each matching line kept for the results list
+#define GREP_NOTE_MS 50                // the project search reports new results at most this often
+#define PICK_SHOW 1000                 // the file picker ranks this many best candidates for its list
+#define PICK_CHUNK 65536               // candidates the picker scores between looks at the keyboard
+#define PICK_NOTE_MS 100               // the picker's walk reports new files at most this often
+#define UNDO_NONE ((size_t)-1)        // no record (undo log offsets)
+#define EV_MAX_SOURCES 16              // fds the event loop can watch
+#define SYNC_PROBE_MS 200              // how long to wait for the terminal to answer the startup query
+#define CKPT_BYTES 256                 // long lines keep one width checkpoint per this many bytes
+#define TAB_STOP 8                     // tabs expand to the next multiple of this column
+#define RENDER_MAX_BYTES 65536         // longer lines are rendered window by window instead of cached
+
+/* ----------------------- Safe write helper ----------------------- */
+/* We use a wrapper so we never partially write to stdout and leave garbage. */
+
+static void xwrite(int fd, const void *buf, size_t n) {
+    const char *p = (const char*)buf;  // pointer to current position in buffer
+    size_t off = 0;                    // number of bytes already written
+    while (off < n) {                  // loop until all bytes are written
+        ssize_t r = write(fd, p + off, n - off); // try to write remaining bytes
+        if (r < 0) {                   // if write failed
+            if (errno == EINTR)        // if it was interrupted by signal
+                continue;              // try again
+            perror("write");           // otherwise print error
+            _exit(1);                  // and exit immediately (can't recover)
+        }
+        off += (size_t)r;              // advance by number of bytes written
+    }
+}
+
+/* ----------------------- Output buffer ----------------------- */
+/* A frame is assembled in memory and sent with one write, so the terminal never shows half a frame. */
+
+typedef struct {
+    char  *b;                          // bytes waiting to be written
+    size_t len;                        // how many bytes are used
+    size_t cap;                        // how many bytes are allocated
+} OutBuf;
+
+static OutBuf ob = {0};                // the frame being built
+
+static void ob_append(const void *s, size_t n) {
+    if (ob.len + n > ob.cap) {         // not enough room
+        size_t ncap = ob.cap ? ob.cap : 4096; // start with one page
+        while (ncap < ob.len + n)      // grow exponentially
+            ncap *= 2;
+        ob.b = (char*)realloc(ob.b, ncap); // grow storage
+        ob.cap = ncap;                 // remember new capacity
+    }
+    memcpy(ob.b + ob.len, s, n);       // copy bytes at the end
+    ob.len += n;                       // account for them
+}
+
+static void ob_printf(const char *fmt, ...) {
+    char tmp[64];                      // escape sequences are short
+    va_list ap;                        // variadic args
+    va_start(ap, fmt);                 // start collecting
+    int n = vsnprintf(tmp, sizeof(tmp), fmt, ap); // format into tmp
+    va_end(ap);                        // stop
+    if (n < 0) return;                 // formatting error: drop it
+    if (n >= (int)sizeof(tmp)) n = (int)sizeof(tmp) - 1; // keep what fit
+    ob_append(tmp, (size_t)n);         // queue formatted bytes
+}
+
+static void ob_flush(void) {
+    if (ob.len == 0) return;           // nothing queued
+    xwrite(STDOUT_FILENO, ob.b, ob.len); // one write for the whole frame
+    ob.len = 0;                        // buffer is empty again (keep storage)
+}
+
+/* ----------------------- Data structures ----------------------- */
+/* We model the file as a dynamic array of lines; each line is a NUL-terminated string. */
+
+/* A glyph boundary inside a line: byte offset and the display column it starts at. */
+typedef struct {
+    int byte;                          // offset in the line's bytes
+    int col;                           // display column (wide chars count 2, combining marks 0)
+    int ren;                           // offset in the line's render representation
+} LinePos;
+
+/*
+ * Per-line display index. Bytes are not columns once UTF-8 is involved, so we
+ * keep sparse checkpoints (about one per CKPT_BYTES bytes) and only decode from
+ * the nearest one. Checkpoints are added lazily as far as someone looked, and an
+ * edit only drops the ones at or after the edited byte.
+ */
+typedef struct {
+    LinePos *ck;                       // checkpoints after {0,0,0}; NULL for short lines
+    int      nck;                      // how many checkpoints are valid
+    int      width;                    // display width of the whole line, -1 = not measured yet
+    char    *render;                   // what the terminal gets: tabs expanded, controls as ^X (NULL = not built)
+    int      rlen;                     // length of render
+    bool     flat;                     // render has exactly one byte per column (plain ASCII + tabs)
+    int     *hits;                     // matches of the highlighted query: byte ranges [start, end) in pairs
+    int      nhits, hits_cap;          // ranges stored / allocated
+    unsigned long hits_gen;            // hl_query_gen the hits are for (0 = not computed)
+    int     *brk;                      // soft wrap: column where each screen row after the first starts
+    int      nbrk;                     // breaks in brk
+    int      brk_width;                // wrap width brk is for; -1 = no wide glyph, rows are W columns; 0 = unknown
+} LineCache;
+
+typedef struct {
+    char **lines;                      // array of pointers to lines
+    int  *len;                         // array of lengths for each line (excluding NUL)
+    LineCache *cache;                  // array of display indexes, one per line
+    int   count;                       // how many lines are currently used
+    int   cap;                         // how many lines we can store without realloc
+} Buffer;
+
+typedef struct {
+    int cx, cy;                        // cursor position in text coordinates (byte in line, row)
+    int rx;                            // display column of the cursor (computed by editor_scroll)
+    int rowoff;                        // vertical scroll: first row currently shown
+    int coloff;                        // horizontal scroll: first display column currently shown
+    int screenrows;                    // how many rows of text we can show
+    int screencols;                    // how many columns we can show
+    int pref_cx;                       // preferred display column when moving up/down (to keep column when lines differ)
+} View;
+
+/* Visual-row map for soft wrap: how many screen rows each line takes, with prefix sums. */
+typedef struct {
+    bool valid;                        // prefix sums match segs
+    int  width;                        // wrap width the counts were computed for
+    int  n;                            // how many lines segs covers
+    int  cap;                          // allocated entries
+    int *segs;                         // screen rows per line (0 = unknown)
+    int *tree;                         // Fenwick tree over segs (1-based)
+} WrapMap;
+
+/* Input side: raw bytes from the terminal and the keys decoded from them. */
+typedef enum { KS_GROUND, KS_ESC, KS_CSI, KS_SS3 } KeyState;
+
+typedef struct {
+    unsigned char raw[4096];           // one read() worth of terminal input
+    int keys[KEY_QUEUE];               // decoded keys
+    int khead, nkeys;                  // next key to hand out, keys queued
+    KeyState state;                    // decoder position inside an escape sequence
+    int param[KEY_MAX_PARAMS];         // numeric parameters of the current sequence
+    int nparam;                        // how many parameters were started
+    bool private_marker;               // sequence had < = > or ? (a report, not a key)
+    bool pasting;                      // inside a bracketed paste: bytes are text, not keys
+    char *paste;                       // paste being collected
+    size_t paste_len, paste_cap;       // its length and allocation
+    char *pasted;                      // finished paste waiting for key 1011 to be applied
+    size_t pasted_len;                 // its length
+} KeyInput;
+
+/* Flat copy of the buffer for searching: lines joined with '\n'. */
+typedef struct {
+    bool valid;                        // text was built at least once
+    unsigned long gen;                 // text_gen it was built from
+    char *text;                        // joined lines
+    size_t len, cap;                   // bytes used / allocated
+    size_t *line_start;                // offset of each line, plus an end sentinel
+    int lines_cap;                     // allocated entries in line_start
+} SearchText;
+
+/* A query compiled for searching. */
+typedef enum { PLAN_PAIR, PLAN_HORSPOOL, PLAN_SCAN } PlanKind;
+
+/* How a search treats case: the user's mode, and what it means for one query. */
+typedef enum { CASE_SENSITIVE, CASE_IGNORE, CASE_SMART } CaseMode;
+typedef enum { FOLD_NONE, FOLD_ASCII, FOLD_UTF8 } FoldKind;
+
+typedef struct {
+    bool valid;                        // compiled at least once
+    char query[256];                   // query as given
+    char needle[256];                  // query bytes (folded to lower case unless fold is FOLD_NONE)
+    size_t m;                          // query length
+    FoldKind fold;                     // case folding: none, ASCII letters, or UTF-8 letters too
+    PlanKind kind;                     // how to search (PLAN_SCAN: FOLD_UTF8 without ASCII bytes to filter on)
+    char lead[4][2]; int nlead;        // PLAN_SCAN: first two bytes of each case of one character...
+    size_t lead_at;                    // ...the needle's first multi-byte one, at this offset
+    size_t i1, i2;                     // PLAN_PAIR: needle bytes the vector filter compares (i1 <= i2)
+    uint8_t shift[4096];               // PLAN_HORSPOOL: jump for the (hashed) 4 bytes under the needle's end
+    uint8_t rshift[4096];              // PLAN_HORSPOOL backwards: jump for the 4 bytes under the needle's start
+} SearchPlan;
+
+/* Regex: parse tree, Thompson NFA per direction and the DFA built lazily from it. */
+typedef enum { RX_SET, RX_BOL, RX_EOL, RX_EMPTY, RX_CAT, RX_ALT, RX_REPEAT } RxKind;
+
+typedef struct {
+    RxKind kind;                       // what the node matches
+    int a, b;                          // children (CAT, ALT; REPEAT uses a)
+    int min, max;                      // REPEAT bounds, max -1 = unbounded
+    int set;                           // RX_SET: index into Regex.set
+} RxNode;
+
+typedef enum { N_SET, N_BOL, N_EOL, N_ANY, N_SPLIT, N_MATCH } NOp;
+
+typedef struct {
+    NOp op;                            // N_SET reads a byte in set, N_BOL/N_EOL a line start/end, N_ANY anything
+    int set;                           // N_SET: index into Regex.set
+    int out, out1;                     // next state (N_SPLIT: both)
+} NState;
+
+typedef struct {
+    int n;                             // DFA states cached
+    int *sets;                         // NFA state sets of all DFA states, back to back
+    int arena_len, arena_cap;          // ints used / allocated in sets
+    int *set_off, *set_len;            // where each DFA state's set is
+    int *trans;                        // [state * ncls + class] -> next state, -1 = not built yet
+    bool *match;                       // state contains N_MATCH
+    int *hash;                         // set -> state (index + 1, 0 = free), 2 * RX_DFA_STATES slots
+    int start[2];                      // start states (anchored, with leading .*), -1 = not built
+    unsigned long flushes;             // times the cache filled up
+} Dfa;
+
+typedef struct {
+    bool valid;                        // compiled without error
+    const char *err;                   // syntax error message
+    char src[256];                     // pattern text
+    bool icase;                        // letters match either case
+    RxNode *node; int nnode, node_cap; // parse tree
+    uint32_t (*set)[8]; int nset, set_cap; // 256-bit byte sets
+    NState *st[2]; int nst[2], st_cap[2]; // NFA: [0] reads forward, [1] backward
+    int start_anch[2], start_unanch[2]; // NFA entry states, without / with leading .*
+    uint8_t cls[256];                  // byte -> byte class
+    int cls_off[256];                  // byte -> its class's offset in a transition row, in bytes
+    int cls_rep[256];                  // a byte of each class
+    int nbyte_cls, ncls;               // byte classes; all symbols (+ line start, line end)
+    Dfa dfa[2];                        // lazy DFA per direction
+    unsigned *mark; unsigned stamp;    // closure scratch: visited marks
+    int *stack, *seeds, *tmp;          // closure scratch
+    int (*cr)[2]; int ncr, cr_cap;     // parse scratch: a class's non-ASCII members as code point ranges
+} Regex;
+
+/* Parallel search: the scan order (cursor to end, then top to cursor) cut into line-aligned chunks. */
+typedef struct {
+    size_t from, to;                   // flat text range; 'to' is a line end
+    size_t before;                     // matches must start before this (the wrapped part stops at the cursor)
+    size_t off, len;                   // match found in the chunk
+} SearchChunk;
+
+typedef struct {
+    int nthreads;                      // threads searching, the caller included (0 = pool not started)
+    pthread_t tid[SEARCH_MAX_THREADS]; // workers
+    pthread_mutex_t lock;              // guards job and busy
+    pthread_cond_t wake, done;         // a job was posted / the last worker finished it
+    unsigned long job;                 // job number; each worker runs each job once
+    int busy;                          // workers still on the current job
+    const char *query;                 // job: what to find
+    bool regex;                        // job: query is a regex, else the plan below
+    const SearchPlan *plan;            // job: compiled literal query
+    SearchChunk *chunks;               // job: chunks in scan order
+    int nchunks, chunks_cap;           // used / allocated
+    atomic_int next;                   // next chunk to hand out
+    atomic_int best;                   // earliest chunk with a match (nchunks = none yet)
+    atomic_bool cancel;                // input arrived: drop the job
+    Regex rx[SEARCH_MAX_THREADS];      // a regex per thread: the lazy DFA is not shared
+} SearchPool;
+
+/* Highlighting while one line is drawn: the current match plus every other match. */
+typedef struct {
+    int cur_start, cur_end;            // current match in display columns (inverse video), -1 = none
+    const int *spans;                  // other matches: column ranges [start, end) in pairs, ascending
+    int nspans;                        // how many ranges
+    int k;                             // first range not yet left behind while drawing
+} LineHl;
+
+/*
+ * "Match N of M": matches of last_query per line, counted by a background
+ * thread over a snapshot of the text, then kept current by recounting the
+ * lines that edits touch.
+ */
+typedef struct {
+    bool active;                       // counting the query below
+    bool stale;                        // lines were inserted or removed mid-count: start over when asked
+    char query[256];                   // what is counted
+    bool regex;                        // query is a regex
+    FoldKind fold;                     // and the case folding it is counted with
+    SearchPlan plan;                   // literal query, shared with the worker (read-only)
+    Regex re, wre;                     // regex query: for the main thread / the worker
+    int *cnt;                          // matches starting in each line, -1 = worker result not in yet
+    int *tree;                         // Fenwick tree over cnt (1-based, -1 counts as 0)
+    int n, cap;                        // lines covered / allocated
+    bool tree_valid;                   // false after lines moved: rebuilt on next use
+    long total;                        // sum of known counts
+    int merged;                        // lines [0, merged) have the worker's result applied
+    bool running;                      // worker thread started and not joined
+    pthread_t tid;                     // the worker
+    char *text; size_t text_cap;       // snapshot: flat text as in SearchText
+    size_t *line_start; int lines_cap; // its line offsets plus an end sentinel
+    int rows;                          // lines in the snapshot
+    int *wcnt; int wcnt_cap;           // worker's per-line counts for the snapshot
+    atomic_int done;                   // wcnt[0, done) are written
+    atomic_bool cancel;                // stop the worker
+    int note[2];                       // pipe: worker -> event loop, "progress"
+    char msg[256];                     // status text last shown (refreshed while it is still up)
+} MatchCount;
+
+/* Trigram index of a big buffer: which line blocks may contain a literal query. */
+typedef struct {
+    int first, count;                  // lines [first, first + count)
+    bool dirty;                        // signature out of date: searched in full until rebuilt
+} TriBlock;
+
+typedef struct {
+    bool on;                           // the buffer is indexed
+    TriBlock *blk; int nblk, blk_cap;  // blocks in line order, covering every line
+    uint64_t *sig;                     // per block 2^TRI_SIG_LOG2 bits: bit h = a trigram hashing to h occurs
+    int ndirty;                        // blocks waiting for the idle builder
+    int next;                          // where the builder looks first
+    int lines;                         // lines covered (buf.count while in step)
+} TriIndex;
+
+/* Tree walks (project search, file picker): .gitignore rules of one directory, on top of those above it. */
+typedef struct {
+    char *pat;                         // glob, without the markers below
+    bool neg;                          // "!pat": un-ignores
+    bool dir_only;                     // "pat/": directories only
+    bool anchored;                     // has a '/': matched against the path below base, else the name
+} WalkRule;
+
+typedef struct WalkIgnore {
+    struct WalkIgnore *parent;         // rules of an enclosing directory (NULL: none)
+    struct WalkIgnore *next;           // owner's list of rule sets, freed together
+    char *base; int base_len;          // directory holding the .gitignore ("" = the walk's root)
+    WalkRule *rule; int n;             // in file order (the last match wins)
+} WalkIgnore;
+
+typedef struct {
+    char *path;                        // directory to read ("" = the working directory)
+    WalkIgnore *ign;                   // rules in force there
+    void *data;                        // the walk's own (file picker: its cache node)
+} WalkDir;
+
+/*
+ * A parallel walk of the tree under the working directory: worker threads
+ * take directories from a shared stack and hand each to 'visit', which
+ * queues the subdirectories it wants walked.
+ */
+typedef struct {
+    bool init;                         // lock and wake are set up
+    pthread_t tid[SEARCH_MAX_THREADS]; // workers
+    int nthreads;                      // started and not joined
+    pthread_mutex_t lock;              // guards the queue and the counts
+    pthread_cond_t wake;               // a directory was queued, or the walk ended
+    WalkDir *dirs; int ndirs, dirs_cap; // directories waiting to be read
+    int pending;                       // directories queued or being visited (0 = walk over)
+    int running;                       // workers still going
+    atomic_bool cancel;                // stop the walk
+    void (*visit)(const WalkDir *d, char **rbuf, size_t *rcap); // one directory ('rbuf': the thread's buffer)
+    void (*finished)(void);            // run by the last worker out
+} Walk;
+
+/* Project search (Ctrl-G): one matching line; the list shows "file:line: text". */
+typedef struct {
+    int file;                          // index into GrepRun.files
+    int line;                          // 1-based line number
+    int col;                           // byte offset of the first match in the line
+    int skip;                          // bytes of the line left out before text (long lines)
+    size_t text; int text_len;         // the line (clipped) in GrepRun.text
+} GrepHit;
+
+/* Project search: a walk that searches every file it meets, and the matching lines found so far. */
+typedef struct {
+    bool active;                       // results exist (Ctrl-G, Enter on empty input shows them again)
+    char query[256];                   // what was searched for
+    SearchPlan plan;                   // compiled query, shared by the workers (read-only)
+    Walk walk;                         // the tree walk
+    pthread_mutex_t lock;              // guards the fields below, up to last_note
+    WalkIgnore *ignores;               // every rule set read
+    char **files; int nfiles, files_cap; // files with a match
+    GrepHit *hits; int nhits, hits_cap; // matching lines in the order found
+    char *text; size_t text_len, text_cap; // their text
+    bool truncated;                    // stopped at GREP_MAX_HITS
+    long last_note;                    // when the event loop was last told
+    atomic_long scanned;               // files searched
+    int note[2];                       // pipe: workers -> event loop, "new results"
+    int sel, top;                      // list: selected hit, first hit shown
+} GrepRun;
+
+/* File picker (Ctrl-O): one directory as last listed; reused while its mtime says it did not change. */
+typedef struct PickDir {
+    char *path;                        // from the working directory ("" = itself)
+    bool listed;                       // names hold its entries as of mtime
+    bool racy;                         // changed in the second it was listed: list it again next time
+    struct timespec mtime;             // the directory's mtime when listed
+    char *names; size_t names_len;     // entries back to back: type byte ('f' or 'd'), name, NUL
+    struct PickDir **sub; int nsub;    // nodes of the 'd' entries, in the same order
+    bool has_ignore;                   // there is a .gitignore among the entries
+    WalkIgnore *ign;                   // its rules (NULL: none)
+    struct timespec ign_mtime;         // the .gitignore's mtime and size when read
+    off_t ign_size;
+} PickDir;
+
+/* A file the picker offers. */
+typedef struct {
+    size_t off;                        // path in PickRun.text (NUL-terminated)
+    uint16_t len;                      // its length
+    uint16_t base;                     // where the file name starts in it
+} PickCand;
+
+/*
+ * File picker: a walk over the cached tree lists the candidate paths; the
+ * picker keeps those matching the typed query, scored, and ranks the best.
+ */
+typedef struct {
+    PickDir *root;                     // cache of the tree (NULL before first use)
+    Walk walk;                         // walk refreshing the candidates
+    pthread_mutex_t lock;              // guards the candidate arrays and last_note
+    PickCand *cand; int ncand, cand_cap; // paths in the order found
+    uint64_t *mask;                    // per candidate: character classes it contains (see pick_class)
+    char *text; size_t text_len, text_cap; // the paths' bytes (16 spare bytes at the end for vector loads)
+    long last_note;                    // when the event loop was last told
+    int note[2];                       // pipe: workers -> event loop, "more files"
+    char query[256];                   // what the survivors are for (the UI thread's state from here on)
+    bool fold;                         // query has no capitals: letters match either case
+    bool valid;                        // survivors are for query
+    int *surv, *score; int nsurv, surv_cap; // candidates [0, upto) matching query, with their scores
+    int upto;                          // candidates looked at
+    bool ranked;                       // best is up to date
+    int best[PICK_SHOW]; int nbest;    // best survivors, best first (indexes into surv)
+    int sel, top;                      // list: selected row, first row shown
+} PickRun;
+
+/* Incremental search: what the open search prompt has found so far. */
+typedef struct {
+    bool regex;                        // Ctrl-R prompt
+    size_t origin;                     // flat offset of the cursor when the prompt opened
+    View saved;                        // view to go back to on Escape or while nothing matches
+    char query[256];                   // query the entries below belong to
+    bool known[256];                   // known[k]: at[k] holds the result for the query's first k bytes
+    size_t at[256];                    // first match of that prefix in scan order (SIZE_MAX = none)
+    size_t len[256];                   // and its length
+    bool stale;                        // the last search was interrupted by input: run it again
+} ISearch;
+
+/* Event loop: every fd the editor waits on, with what to do when it is readable. */
+typedef struct {
+    int fd;                            // watched descriptor
+    void (*on_ready)(void *arg);       // called when fd is readable
+    void *arg;                         // passed to on_ready
+} EventSource;
+
+typedef struct {
+    int epfd;                          // epoll instance
+    EventSource src[EV_MAX_SOURCES];   // registered sources (epoll data = index)
+    int n;                             // how many are registered
+    bool (*idle)(void);                // background work, one slice per call while nothing is ready (true: more left)
+} EventLoop;
+
+/* Frame statistics shown by the profiling overlay (Ctrl-P). */
+typedef struct {
+    bool on;                           // overlay visible
+    unsigned long frames;              // frames drawn
+    unsigned long skipped;             // redraws folded into a later frame (typeahead or frame cap)
+    long last_us;                      // time spent building and writing the last frame
+    size_t last_bytes;                 // bytes the last frame sent
+} FrameStats;
+
+/* What the terminal is currently showing, so a frame can reuse it instead of repainting everything. */
+typedef struct {
+    bool valid;                        // false = terminal content unknown, next frame repaints all
+    unsigned long text_gen;            // buffer generation the text rows were drawn from
+    unsigned long hl_gen;              // highlighted query the text rows were drawn with
+    int rowoff, coloff;                // scroll offsets of the drawn frame
+    int rows, cols;                    // text area size of the drawn frame
+    int hl_row, hl_col, hl_len;        // search highlight of the drawn frame
+    char status_left[160];             // left part of the drawn status bar
+    char status_right[80];             // right part of the drawn status bar
+    char message[256];                 // text on the drawn message line
+} Screen;
+
+/* Undo log: what one record did; its text follows it in the arena. */
+typedef enum { UNDO_INS, UNDO_DEL, UNDO_DEL_REV } UndoKind; // inserted, deleted, erased (text stored backwards)
+typedef enum { UNDO_CMD_NONE, UNDO_CMD_TYPE, UNDO_CMD_ERASE } UndoCmd; // edit command going on
+
+typedef struct {
+    size_t prev;                       // arena offset of the record before (UNDO_NONE: none)
+    size_t len;                        // bytes of text after this header
+    int row, col;                      // where the text starts in the buffer
+    int cy, cx;                        // cursor before the edit
+    unsigned char kind;                // UndoKind
+    bool chained;                      // same step as the record before
+} UndoRec;
+
+/*
+ * Undo history: records back to back in one growing arena. Those before
+ * 'top' are done (undo takes them back from 'last' on); those after it were
+ * undone and can be redone until the next edit drops them.
+ */
+typedef struct {
+    char *a; size_t len, cap;          // the arena
+    size_t top;                        // end of the done records
+    size_t last;                       // the last done record (UNDO_NONE: none)
+    size_t saved;                      // top when the file was last read or written (UNDO_NONE: gone)
+    UndoCmd cmd;                       // edit command going on
+    bool open;                         // the last record is still growing with cmd
+    int group;                         // undo_group_begin nesting: records chain into one step
+    bool grouped;                      // the group has its first record
+    bool replaying;                    // undo or redo at work: the hooks record nothing
+} UndoLog;
+
+/* ----------------------- Globals ----------------------- */
+
+static struct termios orig_termios;    // original terminal settings to restore on exit
+static Buffer buf = {0};               // the text buffer
+static View   view = {0};              // the view (scroll + cursor)
+static bool   dirty = false;           // whether buffer has unsaved changes
+static char   filename[256] = "untitled.txt"; // current filename
+static unsigned long text_gen = 0;     // bumped on every buffer change (renderer compares it)
+static Screen screen = {0};            // what is on the terminal right now
+static bool   soft_wrap = false;       // wrap long lines instead of scrolling sideways
+static WrapMap wrap = {0};             // visual rows of each line when wrapping
+static bool   sync_output = false;     // terminal supports synchronized updates (DEC mode 2026)
+static FrameStats prof = {0};          // frame counters for the profiling overlay
+static KeyInput kin = {0};             // input bytes and decoded keys
+static EventLoop ev = { .epfd = -1 };  // the fds main and the prompt wait on
+static int    status_timer_fd = -1;    // fires when the status message expires
+static SearchText stext = {0};         // what searches scan
+static SearchPlan qplan = {0};         // compiled last_query
+static Regex  qregex = {0};            // compiled last_query in regex mode
+static SearchPool spool = {0};         // threads for searching big buffers
+static ISearch isearch = {0};          // search-as-you-type state of the open prompt
+static MatchCount mcount = { .note = { -1, -1 } }; // matches of last_query, for "match N of M"
+static TriIndex tindex = {0};          // trigram index of buf (big buffers only)
+static GrepRun grep = { .note = { -1, -1 } }; // project search (Ctrl-G) and its results
+static PickRun pick = { .note = { -1, -1 } }; // file picker (Ctrl-O) and its cache of the tree
+static UndoLog undo = { .last = UNDO_NONE };  // undo / redo history of buf
+
+static char   statusmsg[256] = "";     // current status message
+static time_t statusmsg_time = 0;      // when we set the status message
+
+/* search state */
+static char last_query[256] = "";      // last search query (for Ctrl-N)
+static bool last_query_regex = false;  // last_query is a regex (Ctrl-R)
+static CaseMode search_case = CASE_SENSITIVE; // how searches treat case (Alt-C cycles)
+static int  last_match_row = -1;       // row of last match
+static int  last_match_col = -1;       // column of last match
+
+/* temporary highlight for search result */
+static int hl_row = -1, hl_col = -1, hl_len = 0; // highlight location and length
+
+/* every match of the search query is highlighted too (visible rows only) */
+static char hl_query[256] = "";        // query whose matches are marked ("" = none)
+static bool hl_query_regex = false;    // hl_query is a regex
+static FoldKind hl_query_fold = FOLD_NONE; // case folding hl_query was compiled with
+static unsigned long hl_query_gen = 1; // bumped when hl_query changes (LineCache.hits_gen compares)
+static SearchPlan hl_plan = {0};       // hl_query compiled as a literal
+static Regex hl_regex = {0};           // hl_query compiled as a regex
+
+/* ask for Ctrl-Q twice if dirty */
+static int quit_times_needed = 1;      // if dirty, require 2 Ctrl-Q
+
+/* ----------------------- Terminal handling ----------------------- */
+
+static void disable_raw_mode(void) {
+    xwrite(STDOUT_FILENO, "\x1b[?2004l", 8);    // bracketed paste off
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig_termios); // restore old terminal settings
+}
+
+static void die(const char *msg) {
+    xwrite(STDOUT_FILENO, "\x1b[2J\x1b[H", 7); // clear screen and go home
+    disable_raw_mode();               // restore terminal
+    perror(msg);                      // print reason
+    exit(1);                          // terminate
+}
+
+static void enable_raw_mode(void) {
+    if (tcgetattr(STDIN_FILENO, &orig_termios) == -1) // get current terminal attrs
+        die("tcgetattr");                              // abort on failure
+    struct termios raw = orig_termios;                 // start from current settings
+
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON); // turn off misc input flags
+    raw.c_oflag &= ~(OPOST);                                 // turn off all output post-processing
+    raw.c_cflag |= (CS8);                                    // 8-bit chars
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);         // turn off echo, canonical mode, signals
+
+    raw.c_cc[VMIN]  = 0;                                     // read never blocks: poll() does the waiting
+    raw.c_cc[VTIME] = 0;                                     // ...and never waits for more bytes
+
+    if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)      // set new settings
+        die("tcsetattr");                                    // abort on failure
+    xwrite(STDOUT_FILENO, "\x1b[?2004h", 8);                // pastes arrive wrapped in ESC[200~ .. ESC[201~
+}
+
+/* Wait up to 'ms' milliseconds (-1 = forever) for bytes on stdin; true if some arrived */
+static bool input_wait(long ms) {
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN }; // watch stdin
+    int r;                                       // poll result
+    do {
+        r = poll(&pfd, 1, (int)ms);              // sleep until input or timeout
+    } while (r < 0 && errno == EINTR);           // retry if a signal interrupted us
+    return r > 0;                                // input is ready
+}
+
+/* Microseconds from a monotonic clock (for frame timing) */
+static long monotonic_us(void) {
+    struct timespec ts;                          // clock value
+    clock_gettime(CLOCK_MONOTONIC, &ts);         // immune to wall-clock changes
+    return (long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000; // seconds + nanoseconds -> us
+}
+
+/* Milliseconds from a monotonic clock (for frame pacing) */
+static long monotonic_ms(void) {
+    return monotonic_us() / 1000;                // same clock, coarser unit
+}
+
+/* ----------------------- Key input ----------------------- */
+/*
+ * Everything the terminal has sent is pulled in with one read() into kin.raw,
+ * then a small state machine turns the bytes into key events in kin.keys. It
+ * keeps its state between reads, so a sequence split across reads still
+ * decodes. Escape sequences are looked up in tables; CSI parameters carry
+ * modifiers (ESC [ 1 ; 5 C = Ctrl-Right). Only a lone ESC waits, for
+ * ESC_TIMEOUT_MS, to tell it apart from the start of a sequence.
+ */
+
+typedef struct { int code; int key; } KeyMap; // sequence code -> key
+
+static const KeyMap csi_final_keys[] = {        // ESC [ <final> and ESC O <final>
+    { 'A', 1001 }, { 'B', 1002 }, { 'C', 1003 }, { 'D', 1004 }, // arrows
+    { 'H', 1007 }, { 'F', 1008 },               // Home, End
+};
+
+static const KeyMap csi_tilde_keys[] = {        // ESC [ <number> ~
+    { 1, 1007 }, { 7, 1007 },                   // Home
+    { 4, 1008 }, { 8, 1008 },                   // End
+    { 3, 127 },                                 // Delete (acts as Backspace)
+    { 5, 1005 }, { 6, 1006 },                   // PageUp, PageDown
+};
+
+static int keymap_find(const KeyMap *map, size_t n, int code) {
+    for (size_t i = 0; i < n; i++)               // tables are tiny: linear scan
+        if (map[i].code == code) return map[i].key;
+    return 0;                                    // unknown sequence
+}
+
+/* Queue a decoded key (dropped if the queue is full, which needs KEY_QUEUE keys of typeahead) */
+static void key_push(int key) {
+    if (kin.nkeys - kin.khead >= KEY_QUEUE) return; // no room
+    if (kin.nkeys == KEY_QUEUE) {                // slide unread keys to the front
+        memmove(kin.keys, kin.keys + kin.khead, (kin.nkeys - kin.khead) * sizeof(int));
+        kin.nkeys -= kin.khead;
+        kin.khead = 0;
+    }
+    kin.keys[kin.nkeys++] = key;
+}
+
+/* Turn a finished escape sequence into a key */
+static void key_finish_seq(unsigned char final) {
+    int key = 0;                                 // decoded key, 0 = ignore
+    int mod = kin.nparam >= 2 ? kin.param[1] : 0; // xterm modifier parameter: 1 + bits
+    if (kin.private_marker)                      // ESC [ ? ..., ESC [ < ... (reports, mouse)
+        key = 0;                                 // not a key
+    else if (final == '~' && kin.param[0] == 200) { // bracketed paste starts
+        kin.pasting = true;                      // following bytes are text
+        kin.paste_len = 0;
+        return;
+    }
+    else if (final == '~')
+        key = keymap_find(csi_tilde_keys, sizeof(csi_tilde_keys) / sizeof(csi_tilde_keys[0]), kin.param[0]);
+    else
+        key = keymap_find(csi_final_keys, sizeof(csi_final_keys) / sizeof(csi_final_keys[0]), final);
+    if (key == 0) return;                        // unknown: swallow the whole sequence
+    if (mod > 1) {                               // 2 = Shift, 3 = Alt, 5 = Ctrl, ... (bits of mod - 1)
+        if ((mod - 1) & 1) key |= KEY_SHIFT;
+        if ((mod - 1) & 2) key |= KEY_ALT;
+        if ((mod - 1) & 4) key |= KEY_CTRL;
+    }
+    key_push(key);
+}
+
+/* Feed one byte to the decoder */
+static void key_decode_byte(unsigned char c) {
+    switch (kin.state) {
+        case KS_GROUND:
+            if (c == '\x1b') kin.state = KS_ESC; // maybe a sequence, maybe a lone ESC
+            else key_push(c);                    // plain key or UTF-8 byte
+            break;
+        case KS_ESC:
+            if (c == '[' || c == 'O') {          // CSI or SS3 introducer
+                kin.state = c == '[' ? KS_CSI : KS_SS3;
+                kin.nparam = 0;
+                kin.param[0] = 0;
+                kin.private_marker = false;
+            } else if (c == '\x1b') {            // ESC ESC: the first one was a lone ESC
+                key_push('\x1b');
+            } else {                             // ESC + key = Alt + key
+                key_push(KEY_ALT | c);
+                kin.state = KS_GROUND;
+            }
+            break;
+        case KS_SS3:
+            kin.nparam = 0;                      // SS3 carries no parameters
+            key_finish_seq(c);
+            kin.state = KS_GROUND;
+            break;
+        case KS_CSI:
+            if (c >= '0' && c <= '9') {          // parameter digit
+                if (kin.nparam == 0) kin.nparam = 1; // first parameter started
+                if (kin.param[kin.nparam - 1] < 100000)
+                    kin.param[kin.nparam - 1] = kin.param[kin.nparam - 1] * 10 + (c - '0');
+            } else if (c == ';') {               // next parameter
+                if (kin.nparam == 0) kin.nparam = 1; // empty first parameter
+                if (kin.nparam < KEY_MAX_PARAMS) kin.param[kin.nparam++] = 0;
+            } else if (c >= 0x3C && c <= 0x3F) { // private marker < = > ?
+                kin.private_marker = true;
+            } else if (c >= 0x20 && c <= 0x2F) { // intermediate byte: ignored
+            } else if (c >= 0x40 && c <= 0x7E) { // final byte ends the sequence
+                key_finish_seq(c);
+                kin.state = KS_GROUND;
+            } else {                             // garbage inside a sequence: drop it
+                kin.state = KS_GROUND;
+            }
+            break;
+    }
+}
+
+/* Make room for 'extra' more paste bytes */
+static void paste_reserve(size_t extra) {
+    if (kin.paste_len + extra <= kin.paste_cap) return;
+    size_t ncap = kin.paste_cap ? kin.paste_cap : PASTE_CHUNK; // start with one chunk
+    while (ncap < kin.paste_len + extra) ncap *= 2; // grow exponentially
+    kin.paste = (char*)realloc(kin.paste, ncap);
+    if (!kin.paste) die("realloc");
+    kin.paste_cap = ncap;
+}
+
+/*
+ * 'added' bytes were just appended to the paste. If the end marker is among them
+ * (it may straddle two reads), close the paste and queue key 1011. Returns how
+ * many of the added bytes belong to the paste and its marker.
+ */
+static size_t paste_scan_end(size_t added) {
+    static const char end[] = "\x1b[201~";       // bracketed paste end marker
+    size_t old = kin.paste_len - added;          // length before this batch
+    size_t i = old >= 5 ? old - 5 : 0;           // marker may have started in the last batch
+    while (i + 6 <= kin.paste_len) {
+        char *e = (char*)memchr(kin.paste + i, '\x1b', kin.paste_len - i); // next ESC
+        if (!e) break;
+        i = (size_t)(e - kin.paste);
+        if (i + 6 <= kin.paste_len && memcmp(e, end, 6) == 0) { // found the marker
+            kin.paste_len = i;                   // payload ends before it
+            kin.pasting = false;
+            if (kin.pasted) {                    // previous paste not applied yet: join them
+                kin.pasted = (char*)realloc(kin.pasted, kin.pasted_len + i + 1);
+                memcpy(kin.pasted + kin.pasted_len, kin.paste, i);
+                kin.pasted_len += i;
+            } else {                             // hand the buffer over, start a new one next time
+                kin.pasted = kin.paste;
+                kin.pasted_len = i;
+                kin.paste = NULL;
+                kin.paste_cap = 0;
+            }
+            key_push(1011);                      // paste ready (each time: a dropped 1011 must not hide later ones)
+            kin.paste_len = 0;
+            return i + 6 - old;
+        }
+        i++;
+    }
+    return added;                                // all of it is paste
+}
+
+/* Decode a batch of bytes; bytes inside a bracketed paste are collected, not decoded */
+static void input_decode(const unsigned char *s, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+        if (kin.pasting) {                       // text until the end marker
+            paste_reserve(n - i);
+            memcpy(kin.paste + kin.paste_len, s + i, n - i);
+            kin.paste_len += n - i;
+            i += paste_scan_end(n - i);
+        } else {
+            key_decode_byte(s[i++]);             // keys and escape sequences
+        }
+    }
+}
+
+/* Take the finished paste (key 1011, NULL if an earlier one took it); caller frees it. Line breaks are normalized to '\n'. */
+static char *paste_take(size_t *len) {
+    char *p = kin.pasted;                        // payload
+    size_t n = kin.pasted_len, o = 0;            // its length, bytes kept
+    kin.pasted = NULL;
+    kin.pasted_len = 0;
+    for (size_t i = 0; i < n; i++) {             // terminals send Enter as '\r': "\r\n" and "\r" -> "\n"
+        if (p[i] == '\r') {
+            p[o++] = '\n';
+            if (i + 1 < n && p[i + 1] == '\n') i++;
+        } else {
+            p[o++] = p[i];
+        }
+    }
+    *len = o;
+    return p;
+}
+
+/* Pull whatever stdin has and decode it (one read() per call) */
+static bool input_fill(void) {
+    ssize_t n;                                   // bytes read
+    if (kin.pasting) {                           // paste streaming in: read straight into it
+        paste_reserve(PASTE_CHUNK);
+        do {
+            n = read(STDIN_FILENO, kin.paste + kin.paste_len, PASTE_CHUNK);
+        } while (n < 0 && errno == EINTR);       // retry if a signal interrupted us
+        if (n < 0 && errno != EAGAIN)            // real error
+            die("read");
+        if (n <= 0) return false;
+        char *base = kin.paste;                  // paste_scan_end may hand this buffer off
+        size_t start = kin.paste_len;            // where this batch begins in it
+        kin.paste_len += (size_t)n;
+        size_t used = paste_scan_end((size_t)n); // bytes up to and including the end marker
+        if (used < (size_t)n) {                  // keys typed after the paste: decode them
+            size_t rest = (size_t)n - used;
+            unsigned char *tail = (unsigned char*)malloc(rest); // own copy: decoding may start another paste
+            memcpy(tail, base + start + used, rest);
+            input_decode(tail, rest);
+            free(tail);
+        }
+        return true;
+    }
+    do {
+        n = read(STDIN_FILENO, kin.raw, sizeof(kin.raw)); // everything available, up to the buffer
+    } while (n < 0 && errno == EINTR);           // retry if a signal interrupted us
+    if (n < 0 && errno != EAGAIN)                // real error
+        die("read");
+    if (n > 0)
+        input_decode(kin.raw, (size_t)n);        // decode the whole batch
+    return n > 0;                                // got something
+}
+
+/* ----------------------- Event loop ----------------------- */
+/*
+ * All waiting happens in epoll on a set of fds: stdin, a signalfd for SIGWINCH,
+ * a timerfd for status message expiry, and whatever later features register
+ * (inotify, worker completion pipes). Handlers turn events into keys, so code
+ * that loops on editor_read_key (main, the prompt) also sees resizes (key
+ * 1009) and expired messages (key 1010). Nothing wakes up while idle, except
+ * that background work (ev.idle) runs in short slices until it is done,
+ * looking for input between them.
+ */
+
+/* Watch 'fd'; on_ready(arg) runs from ev_dispatch whenever it is readable */
+static void ev_add(int fd, void (*on_ready)(void *arg), void *arg) {
+    if (ev.epfd < 0) ev.epfd = epoll_create1(EPOLL_CLOEXEC); // first source creates the set
+    if (ev.epfd < 0 || ev.n == EV_MAX_SOURCES) die("epoll");
+    struct epoll_event e = { .events = EPOLLIN, .data.u32 = (uint32_t)ev.n };
+    if (epoll_ctl(ev.epfd, EPOLL_CTL_ADD, fd, &e) == -1) die("epoll_ctl");
+    ev.src[ev.n++] = (EventSource){ fd, on_ready, arg };
+}
+
+/* Wait up to 'ms' (-1 = forever) and run the handlers of ready fds; returns how many ran */
+static int ev_dispatch(long ms) {
+    struct epoll_event evs[EV_MAX_SOURCES];      // ready sources
+    int n;
+    do {
+        n = epoll_wait(ev.epfd, evs, EV_MAX_SOURCES, (int)ms);
+    } while (n < 0 && errno == EINTR);           // retry if a signal interrupted us
+    for (int i = 0; i < n; i++) {
+        EventSource *s = &ev.src[evs[i].data.u32];
+        s->on_ready(s->arg);                     // handler reads the fd
+    }
+    return n > 0 ? n : 0;
+}
+
+/* Wait up to 'ms' for any source to become ready, without handling it */
+static bool ev_ready(long ms) {
+    struct pollfd pfd = { .fd = ev.epfd, .events = POLLIN }; // an epoll fd is readable when a source is
+    int r;
+    do {
+        r = poll(&pfd, 1, (int)ms);
+    } while (r < 0 && errno == EINTR);
+    return r > 0;
+}
+
+/* Open a pipe for worker threads to wake the event loop; on_ready(NULL) runs when it has bytes */
+static void note_pipe_open(int fd[2], void (*on_ready)(void *arg)) {
+    if (pipe(fd) == -1) die("pipe");
+    for (int i = 0; i < 2; i++) {                // neither end may block the UI or a worker
+        fcntl(fd[i], F_SETFL, O_NONBLOCK);
+        fcntl(fd[i], F_SETFD, FD_CLOEXEC);
+    }
+    ev_add(fd[0], on_ready, NULL);
+}
+
+/* Write a note to 'fd' if the last one (*last, guarded by 'lock' unless NULL) is 'min_ms' old, or 'now' */
+static void note_send(int fd, pthread_mutex_t *lock, long *last, long min_ms, bool now) {
+    long t = monotonic_ms();
+    if (lock) pthread_mutex_lock(lock);
+    bool tell = now || t - *last >= min_ms;
+    if (tell) *last = t;
+    if (lock) pthread_mutex_unlock(lock);
+    if (tell && write(fd, "", 1) < 0) {}         // a full pipe is fine
+}
+
+/* Empty a note pipe's read end (its notes only mean "look again") */
+static void note_drain(int fd) {
+    char drain[64];
+    while (read(fd, drain, sizeof(drain)) > 0) {}
+}
+
+static void on_stdin(void *arg) {
+    (void)arg;
+    input_fill();                                // read and decode the batch
+}
+
+static void on_status_timer(void *arg) {
+    (void)arg;
+    uint64_t expirations;                        // must be read to re-arm readiness
+    if (read(status_timer_fd, &expirations, sizeof(expirations)) > 0)
+        key_push(1010);                          // status message expired: redraw
+}
+
+/* Is a key ready, or is any source (input, resize, timer) waiting to be handled? (never blocks) */
+static bool input_pending(void) {
+    return kin.khead < kin.nkeys || ev_ready(0); // decoded keys, or an event to turn into keys
+}
+
+/* Return the next key, waiting for one if needed */
+static int editor_read_key(void) {
+    while (kin.khead == kin.nkeys) {             // nothing decoded yet
+        if (kin.state != KS_GROUND) {            // inside ESC or a sequence: is the rest coming?
+            long wait = kin.state == KS_ESC ? ESC_TIMEOUT_MS : ESC_SEQ_TIMEOUT_MS; // lone ESC decides fast
+            if (!input_wait(wait)) {             // no
+                if (kin.state == KS_ESC)         // it was the Escape key
+                    key_push('\x1b');
+                kin.state = KS_GROUND;           // a cut-off sequence is dropped
+                continue;
+            }
+            input_fill();                        // rest of the sequence
+        } else if (ev.idle && !ev_ready(0) && ev.idle()) {
+            continue;                            // did a slice of background work: look again
+        } else {
+            ev_dispatch(-1);                     // sleep until input or another event
+        }
+    }
+    int key = kin.keys[kin.khead++];             // oldest key first
+    if (kin.khead == kin.nkeys)                  // queue drained: start over at the front
+        kin.khead = kin.nkeys = 0;
+    return key;
+}
+
+/* Get terminal window size using ioctl */
+static int get_window_size(int *rows, int *cols) {
+    struct winsize ws;                           // structure to hold size
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0 || ws.ws_row == 0)
+        return -1;                               // failed
+    *cols = ws.ws_col;                           // set columns
+    *rows = ws.ws_row;                           // set rows
+    return 0;                                    // success
+}
+
+/*
+ * Ask the terminal whether it knows synchronized output (DEC private mode 2026).
+ * DECRQM "CSI ? 2026 $ p" is answered with "CSI ? 2026 ; Ps $ y" where Ps 1 or 2
+ * means the mode exists. Terminals that don't know DECRQM stay silent, so a
+ * primary device attributes query (answered by everyone) follows it: once that
+ * reply is in, there is nothing more to wait for.
+ */
+static void terminal_probe_sync(void) {
+    xwrite(STDOUT_FILENO, "\x1b[?2026$p\x1b[c", 12); // DECRQM, then DA1 as an end marker
+    char reply[128];                             // collected answer bytes
+    int n = 0;                                   // how many we have
+    long deadline = monotonic_ms() + SYNC_PROBE_MS; // don't hang on a silent terminal
+    while (n < (int)sizeof(reply) - 1) {
+        long left = deadline - monotonic_ms();   // time still allowed
+        if (left <= 0 || !input_wait(left)) break; // no (more) answer
+        ssize_t r = read(STDIN_FILENO, reply + n, sizeof(reply) - 1 - n);
+        if (r <= 0) break;
+        n += (int)r;
+        reply[n] = '\0';
+        char *da = strstr(reply, "\x1b[?");      // look for the DA1 reply: CSI ? ... c
+        while (da && strstr(da, "\x1b[?2026;") == da) // skip the DECRQM reply itself
+            da = strstr(da + 1, "\x1b[?");
+        if (da && strchr(da, 'c')) break;        // DA1 answered: DECRQM reply (if any) came first
+    }
+    reply[n] = '\0';
+    char *rq = strstr(reply, "\x1b[?2026;");     // DECRQM reply
+    sync_output = rq && (rq[8] == '1' || rq[8] == '2') && rq[9] == '$'; // set or reset: supported
+}
+
+/* ----------------------- Status & messages ----------------------- */
+
+static void editor_set_status(const char *fmt, ...) {
+    va_list ap;                                  // variadic args
+    va_start(ap, fmt);                           // start collecting
+    vsnprintf(statusmsg, sizeof(statusmsg), fmt, ap); // write formatted message
+    va_end(ap);                                  // stop
+    statusmsg_time = time(NULL);                 // remember when we set it
+    if (status_timer_fd >= 0 && statusmsg[0]) {  // wake up when it expires, even without keys
+        struct itimerspec its = { .it_value = { .tv_sec = STATUS_MSG_SEC } }; // one-shot
+        timerfd_settime(status_timer_fd, 0, &its, NULL); // re-arming replaces the old expiry
+    }
+}
+
+/* ----------------------- UTF-8 & display width ----------------------- */
+/* Lines are raw bytes; the screen is made of columns. These helpers translate. */
+
+typedef struct { int lo, hi; } CpRange;          // inclusive range of code points
+
+/* Code points that take no column (combining marks, zero-width joiners, BOM, ...) */
+static const CpRange zero_width[] = {
+    {0x0300,0x036F},{0x0483,0x0489},{0x0591,0x05BD},{0x05BF,0x05BF},{0x05C1,0x05C2},
+    {0x05C4,0x05C5},{0x05C7,0x05C7},{0x0610,0x061A},{0x064B,0x065F},{0x0670,0x0670},
+    {0x06D6,0x06DC},{0x06DF,0x06E4},{0x06E7,0x06E8},{0x06EA,0x06ED},{0x0711,0x0711},
+    {0x0730,0x074A},{0x07A6,0x07B0},{0x0900,0x0902},{0x093A,0x093A},{0x093C,0x093C},
+    {0x0941,0x0948},{0x094D,0x094D},{0x0951,0x0957},{0x0962,0x0963},{0x0E31,0x0E31},
+    {0x0E34,0x0E3A},{0x0E47,0x0E4E},{0x1AB0,0x1AFF},{0x1DC0,0x1DFF},{0x200B,0x200F},
+    {0x202A,0x202E},{0x2060,0x2064},{0x20D0,0x20FF},{0xFE00,0xFE0F},{0xFE20,0xFE2F},
+    {0xFEFF,0xFEFF},{0xE0100,0xE01EF},
+};
+
+/* Code points that take two columns (CJK, Hangul, fullwidth forms, most emoji) */
+static const CpRange double_width[] = {
+    {0x1100,0x115F},{0x231A,0x231B},{0x2329,0x232A},{0x23E9,0x23EC},{0x23F0,0x23F0},
+    {0x23F3,0x23F3},{0x25FD,0x25FE},{0x2614,0x2615},{0x2648,0x2653},{0x267F,0x267F},
+    {0x2693,0x2693},{0x26A1,0x26A1},{0x26AA,0x26AB},{0x26BD,0x26BE},{0x26C4,0x26C5},
+    {0x26CE,0x26CE},{0x26D4,0x26D4},{0x26EA,0x26EA},{0x26F2,0x26F3},{0x26F5,0x26F5},
+    {0x26FA,0x26FA},{0x26FD,0x26FD},{0x2705,0x2705},{0x270A,0x270B},{0x2728,0x2728},
+    {0x274C,0x274C},{0x274E,0x274E},{0x2753,0x2755},{0x2757,0x2757},{0x2795,0x2797},
+    {0x27B0,0x27B0},{0x27BF,0x27BF},{0x2B1B,0x2B1C},{0x2B50,0x2B50},{0x2B55,0x2B55},
+    {0x2E80,0x303E},{0x3041,0x33FF},{0x3400,0x4DBF},{0x4E00,0x9FFF},{0xA000,0xA4CF},
+    {0xA960,0xA97F},{0xAC00,0xD7A3},{0xF900,0xFAFF},{0xFE10,0xFE19},{0xFE30,0xFE6F},
+    {0xFF00,0xFF60},{0xFFE0,0xFFE6},{0x16FE0,0x16FE4},{0x17000,0x18CFF},{0x1B000,0x1B2FF},
+    {0x1F004,0x1F004},{0x1F0CF,0x1F0CF},{0x1F18E,0x1F18E},{0x1F191,0x1F19A},{0x1F200,0x1F251},
+    {0x1F300,0x1F320},{0x1F32D,0x1F335},{0x1F337,0x1F37C},{0x1F37E,0x1F393},{0x1F3A0,0x1F3CA},
+    {0x1F3CF,0x1F3D3},{0x1F3E0,0x1F3F0},{0x1F3F4,0x1F3F4},{0x1F3F8,0x1F43E},{0x1F440,0x1F440},
+    {0x1F442,0x1F4FC},{0x1F4FF,0x1F53D},{0x1F54B,0x1F54E},{0x1F550,0x1F567},{0x1F57A,0x1F57A},
+    {0x1F595,0x1F596},{0x1F5A4,0x1F5A4},{0x1F5FB,0x1F64F},{0x1F680,0x1F6C5},{0x1F6CC,0x1F6CC},
+    {0x1F6D0,0x1F6D2},{0x1F6D5,0x1F6D7},{0x1F6EB,0x1F6EC},{0x1F6F4,0x1F6FC},{0x1F7E0,0x1F7EB},
+    {0x1F90C,0x1F93A},{0x1F93C,0x1F945},{0x1F947,0x1F9FF},{0x1FA70,0x1FAFF},{0x20000,0x2FFFD},
+    {0x30000,0x3FFFD},
+};
+
+/* Binary search a sorted range table */
+static bool cp_in_table(int cp, const CpRange *t, int n) {
+    int lo = 0, hi = n - 1;                      // search window
+    while (lo <= hi) {                           // classic binary search
+        int mid = (lo + hi) / 2;                 // middle entry
+        if (cp < t[mid].lo) hi = mid - 1;        // go left
+        else if (cp > t[mid].hi) lo = mid + 1;   // go right
+        else return true;                        // inside this range
+    }
+    return false;                                // not in any range
+}
+
+/* How many columns a code point takes on screen (wcwidth-style) */
+static int cp_width(int cp) {
+    if (cp < 0x300) return 1;                    // fast path: ASCII and Latin-1
+    if (cp_in_table(cp, zero_width, (int)(sizeof(zero_width) / sizeof(zero_width[0]))))
+        return 0;                                // combining / invisible
+    if (cp_in_table(cp, double_width, (int)(sizeof(double_width) / sizeof(double_width[0]))))
+        return 2;                                // wide
+    return 1;                                    // everything else
+}
+
+/*
+ * Decode one UTF-8 sequence from s (n bytes available).
+ * Returns how many bytes it used; malformed input yields U+FFFD for one byte,
+ * so every byte of a line always belongs to exactly one glyph.
+ */
+static int utf8_decode(const char *s, int n, int *cp) {
+    const unsigned char *u = (const unsigned char*)s; // work on unsigned bytes
+    if (u[0] < 0x80) { *cp = u[0]; return 1; }  // ASCII
+    int need, min;                               // continuation bytes, smallest legal value
+    if ((u[0] & 0xE0) == 0xC0)      { *cp = u[0] & 0x1F; need = 1; min = 0x80; }
+    else if ((u[0] & 0xF0) == 0xE0) { *cp = u[0] & 0x0F; need = 2; min = 0x800; }
+    else if ((u[0] & 0xF8) == 0xF0) { *cp = u[0] & 0x07; need = 3; min = 0x10000; }
+    else { *cp = 0xFFFD; return 1; }             // stray continuation or invalid lead byte
+    if (need >= n) { *cp = 0xFFFD; return 1; }   // truncated at end of line
+    for (int i = 1; i <= need; i++) {            // gather continuation bytes
+        if ((u[i] & 0xC0) != 0x80) { *cp = 0xFFFD; return 1; } // not a continuation
+        *cp = (*cp << 6) | (u[i] & 0x3F);        // append 6 bits
+    }
+    if (*cp < min || *cp > 0x10FFFF || (*cp >= 0xD800 && *cp <= 0xDFFF)) {
+        *cp = 0xFFFD;                            // overlong, out of range or surrogate
+        return 1;
+    }
+    return need + 1;                             // bytes consumed
+}
+
+/*
+ * Simple case folding (to lower case) for searches that ignore case. Only
+ * letters whose two cases have the same UTF-8 length are folded, so a match
+ * is always as long as the query: ASCII, Latin-1, Latin Extended-A, Greek,
+ * Cyrillic, Armenian and the fullwidth Latin letters. Dotless i, long s,
+ * sharp s and the like keep their case.
+ */
+typedef struct { int lo, hi, delta, step; } CaseRange; // upper case lo..hi (every 'step'th) -> + delta
+
+static const CaseRange case_ranges[] = {
+    {0x41,0x5A,32,1},{0xB5,0xB5,775,1},{0xC0,0xD6,32,1},{0xD8,0xDE,32,1},{0x100,0x12F,1,2},
+    {0x132,0x137,1,2},{0x139,0x148,1,2},{0x14A,0x177,1,2},{0x178,0x178,-121,1},{0x179,0x17E,1,2},
+    {0x386,0x386,38,1},{0x388,0x38A,37,1},{0x38C,0x38C,64,1},{0x38E,0x38F,63,1},{0x391,0x3A1,32,1},
+    {0x3A3,0x3AB,32,1},{0x3C2,0x3C2,1,1},{0x400,0x40F,80,1},{0x410,0x42F,32,1},{0x460,0x481,1,2},
+    {0x48A,0x4BF,1,2},{0x531,0x556,48,1},{0xFF21,0xFF3A,32,1},
+};
+
+/* Lower-case form of code point cp (itself if it has none) */
+static int cp_fold(int cp) {
+    if (cp < 0x80) return cp >= 'A' && cp <= 'Z' ? cp + 32 : cp; // fast path: ASCII
+    for (int i = 1; i < (int)(sizeof(case_ranges) / sizeof(case_ranges[0])); i++) { // ASCII (range 0) is done
+        const CaseRange *r = &case_ranges[i];
+        if (cp >= r->lo && cp <= r->hi && (cp - r->lo) % r->step == 0)
+            return cp + r->delta;
+    }
+    return cp;
+}
+
+/* Every code point that folds to 'f' (itself included) into out[]; returns how many (at most 4) */
+static int cp_case_variants(int f, int *out) {
+    int n = 0;
+    out[n++] = f;
+    for (int i = 0; i < (int)(sizeof(case_ranges) / sizeof(case_ranges[0])) && n < 4; i++) {
+        const CaseRange *r = &case_ranges[i];
+        int u = f - r->delta;                    // the upper case this range would map to f
+        if (u >= r->lo && u <= r->hi && (u - r->lo) % r->step == 0 && u != f)
+            out[n++] = u;
+    }
+    return n;
+}
+
+/* Encode code point cp as UTF-8 into out (room for 4 bytes); returns the length */
+static int utf8_encode(int cp, char *out) {
+    unsigned char *u = (unsigned char*)out;
+    if (cp < 0x80)    { u[0] = (unsigned char)cp; return 1; }
+    if (cp < 0x800)   { u[0] = (unsigned char)(0xC0 | cp >> 6); u[1] = (unsigned char)(0x80 | (cp & 0x3F)); return 2; }
+    if (cp < 0x10000) { u[0] = (unsigned char)(0xE0 | cp >> 12); u[1] = (unsigned char)(0x80 | (cp >> 6 & 0x3F));
+                        u[2] = (unsigned char)(0x80 | (cp & 0x3F)); return 3; }
+    u[0] = (unsigned char)(0xF0 | cp >> 18); u[1] = (unsigned char)(0x80 | (cp >> 12 & 0x3F));
+    u[2] = (unsigned char)(0x80 | (cp >> 6 & 0x3F)); u[3] = (unsigned char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+/* One glyph of a line: what it costs in the line, on screen and in the render */
+typedef struct {
+    int len;                                     // bytes in the line
+    int width;                                   // columns on screen
+    int rlen;                                    // bytes in the render representation
+} Glyph;
+
+/*
+ * Measure the glyph at s (n bytes available) when it starts at display column 'col'.
+ * Tabs reach the next tab stop, control bytes show as ^X, and malformed bytes or
+ * C1 controls show as U+FFFD so nothing we draw can be taken as a terminal command.
+ */
+static Glyph glyph_at(const char *s, int n, int col) {
+    Glyph g;                                     // result
+    unsigned char c = (unsigned char)s[0];       // first byte
+    if (c == '\t') {                             // tab: spaces up to the next stop
+        g.len = 1;
+        g.width = g.rlen = TAB_STOP - col % TAB_STOP;
+        return g;
+    }
+    if (c < 0x20 || c == 0x7f) {                 // C0 control or DEL: caret notation
+        g.len = 1;
+        g.width = g.rlen = 2;
+        return g;
+    }
+    int cp;                                      // decoded code point
+    g.len = utf8_decode(s, n, &cp);              // bytes used
+    if ((c >= 0x80 && g.len == 1) || (cp >= 0x80 && cp < 0xA0)) { // malformed or C1 control
+        g.width = 1;                             // replacement char is one column
+        g.rlen = 3;                              // U+FFFD is 3 bytes of UTF-8
+        return g;
+    }
+    g.width = cp_width(cp);                      // columns used
+    g.rlen = g.len;                              // drawn as-is
+    return g;
+}
+
+/* Write the render bytes of glyph g (found at s) into out (g.rlen bytes) */
+static void glyph_render(const char *s, Glyph g, char *out) {
+    unsigned char c = (unsigned char)s[0];       // first byte
+    if (c == '\t')
+        memset(out, ' ', g.rlen);                // expanded tab
+    else if (c < 0x20 || c == 0x7f) {
+        out[0] = '^';                            // caret notation
+        out[1] = c == 0x7f ? '?' : (char)(c + '@'); // ^@..^_ and ^?
+    } else if (g.rlen != g.len)
+        memcpy(out, "\xEF\xBF\xBD", 3);          // U+FFFD replacement character
+    else
+        memcpy(out, s, g.len);                   // normal text
+}
+
+/* Display width of s[0..n) */
+static int text_width(const char *s, int n) {
+    int w = 0, cp;
+    for (int i = 0; i < n; ) {
+        i += utf8_decode(s + i, n - i, &cp);
+        w += cp_width(cp);
+    }
+    return w;
+}
+
+/* ----------------------- Buffer management ----------------------- */
+
+/* Views derived from the text (soft-wrap map, ...) are told about changes; defined further down */
+static void views_line_changed(Buffer *b, int row);
+static void views_lines_shifted(Buffer *b, int at, int delta);
+
+/* Matches of the highlighted query in a line; defined with the search code */
+static LineCache *line_hits(Buffer *b, int row);
+
+/* Keep the match counts of edited lines current; defined with the search code */
+static void mcount_line_changed(int row);
+static void mcount_lines_shifted(int at, int delta);
+
+/* Keep the trigram index of big buffers current; defined with the search code */
+static void tindex_open(void);
+static void tindex_line_changed(int row);
+static void tindex_lines_shifted(int at, int delta);
+
+/* Record edits for undo; defined with the undo code */
+static void undo_inserted(Buffer *b, int row, int col, const char *s, size_t n);
+static void undo_deleting(Buffer *b, int r1, int c1, int r2, int c2);
+static void undo_line_set(Buffer *b, int row, const char *s, int n);
+
+/* Forget what the display index knows about 'row' from byte 'from' onwards */
+static void line_cache_invalidate(Buffer *b, int row, int from) {
+    LineCache *lc = &b->cache[row];              // that line's index
+    while (lc->nck > 0 && lc->ck[lc->nck - 1].byte + 4 > from) // a glyph ending before
+        lc->nck--;                               // the edit may still read into it (UTF-8 <= 4 bytes)
+    lc->width = -1;                              // total width must be measured again
+    free(lc->render);                            // render is rebuilt when the line is drawn
+    lc->render = NULL;
+    lc->hits_gen = 0;                            // matches are found again when the line is drawn
+    lc->brk_width = 0;                           // wrap breaks are found again (before the views ask)
+    views_line_changed(b, row);                  // let derived views catch up
+}
+
+/* Initialize buffer with 1 empty line so editor always has at least one line */
+static void buffer_init(Buffer *b) {
+    b->cap = 64;                                 // initial capacity
+    b->count = 1;                                // start with 1 line
+    b->lines = (char**)calloc(b->cap, sizeof(char*)); // allocate line array
+    b->len   = (int*)calloc(b->cap, sizeof(int));     // allocate length array
+    b->cache = (LineCache*)calloc(b->cap, sizeof(LineCache)); // allocate display indexes
+    b->cache[0].width = -1;                      // not measured yet
+    b->lines[0] = strdup("");                    // first line is empty string
+    b->len[0] = 0;                               // length is 0
+    text_gen++;                                  // content changed
+    views_lines_shifted(b, 0, 1);                // one line appeared
+}
+
+/* Free buffer content */
+static void buffer_free(Buffer *b) {
+    if (!b || !b->lines) return;                 // nothing to free
+    for (int i = 0; i < b->count; i++) {         // free each line
+        free(b->lines[i]);
+        free(b->cache[i].ck);                    // and its checkpoints
+        free(b->cache[i].render);                // and its render
+        free(b->cache[i].hits);                  // and its match ranges
+        free(b->cache[i].brk);                   // and its wrap breaks
+    }
+    free(b->lines);                              // free array of line pointers
+    free(b->len);                                // free array of lengths
+    free(b->cache);                              // free array of display indexes
+    int count = b->count;                        // lines that disappear
+    memset(b, 0, sizeof(*b));                    // clear structure
+    views_lines_shifted(b, 0, -count);           // derived views drop them too
+}
+
+/* Ensure we have space for at least 'need' lines */
+static void buffer_ensure_capacity(Buffer *b, int need) {
+    if (need <= b->cap) return;                  // capacity is enough
+    while (b->cap < need)                        // grow exponentially
+        b->cap *= 2;
+    b->lines = (char**)realloc(b->lines, b->cap * sizeof(char*)); // grow line array
+    b->len   = (int*)realloc(b->len,   b->cap * sizeof(int));     // grow len array
+    b->cache = (LineCache*)realloc(b->cache, b->cap * sizeof(LineCache)); // grow index array
+}
+
+/* Insert a line at position 'at' with content 's' of length 'n' */
+static void buffer_insert_line(Buffer *b, int at, const char *s, int n) {
+    if (at < 0 || at > b->count) return;         // out of range
+    buffer_ensure_capacity(b, b->count + 1);     // make space for new line
+    memmove(&b->lines[at+1], &b->lines[at], (b->count - at) * sizeof(char*)); // shift lines down
+    memmove(&b->len[at+1],   &b->len[at],   (b->count - at) * sizeof(int));   // shift lengths down
+    memmove(&b->cache[at+1], &b->cache[at], (b->count - at) * sizeof(LineCache)); // shift indexes down
+    b->cache[at] = (LineCache){ NULL, 0, -1, NULL, 0, false, NULL, 0, 0, 0, NULL, 0, 0 }; // new line: nothing indexed yet
+    b->lines[at] = (char*)malloc(n + 1);         // allocate new line
+    memcpy(b->lines[at], s, n);                  // copy content
+    b->lines[at][n] = '\0';                      // terminate string
+    b->len[at] = n;                              // set length
+    b->count++;                                  // one more line
+    text_gen++;                                  // content changed
+    views_lines_shifted(b, at, 1);               // later lines moved down
+}
+
+/* Helper: append an empty line at the bottom (used for Arrow Down create-line) */
+static void buffer_append_empty(Buffer *b) {
+    buffer_insert_line(b, b->count, "", 0);      // insert empty string at end
+}
+
+/*
+ * Insert 'n' bytes of text at (row, col) in one pass: '\n' starts a new line.
+ * All new lines are made room for with a single shift of the line arrays.
+ * The position right after the inserted text is stored in (*end_row, *end_col).
+ */
+static void buffer_insert_text(Buffer *b, int row, int col, const char *s, size_t n, int *end_row, int *end_col) {
+    int L = b->len[row];                         // current line length
+    if (col < 0) col = 0;                        // clamp column
+    if (col > L) col = L;                        // clamp to end
+    undo_inserted(b, row, col, s, n);            // before *end_row / *end_col move (they may be the cursor)
+    const char *end = s + n;                     // one past the text
+    int nl = 0;                                  // line breaks in the text
+    const char *last = s;                        // start of the last piece (after the last break)
+    for (const char *p = s; (p = (const char*)memchr(p, '\n', end - p)) != NULL; p++) {
+        nl++;
+        last = p + 1;
+    }
+
+    if (nl == 0) {                               // stays on one line
+        b->lines[row] = (char*)realloc(b->lines[row], L + n + 1); // room for the text
+        memmove(&b->lines[row][col + n], &b->lines[row][col], L - col + 1); // shift tail incl. NUL
+        memcpy(&b->lines[row][col], s, n);       // drop the text in
+        b->len[row] = L + (int)n;                // update length
+        line_cache_invalidate(b, row, col);      // columns after 'col' moved
+        *end_row = row;
+        *end_col = col + (int)n;
+    } else {
+        buffer_ensure_capacity(b, b->count + nl); // room for every new line at once
+        memmove(&b->lines[row + 1 + nl], &b->lines[row + 1], (b->count - row - 1) * sizeof(char*));
+        memmove(&b->len[row + 1 + nl],   &b->len[row + 1],   (b->count - row - 1) * sizeof(int));
+        memmove(&b->cache[row + 1 + nl], &b->cache[row + 1], (b->count - row - 1) * sizeof(LineCache));
+
+        const char *first_end = (const char*)memchr(s, '\n', n); // end of the first piece
+        int last_len = (int)(end - last);        // its length
+        int tail_len = L - col;                  // text after the cursor moves to the last line
+
+        char *last_line = (char*)malloc(last_len + tail_len + 1); // last piece + old tail
+        memcpy(last_line, last, last_len);
+        memcpy(last_line + last_len, &b->lines[row][col], tail_len + 1); // tail incl. NUL
+
+        int first_len = (int)(first_end - s);    // first piece joins the head of 'row'
+        b->lines[row] = (char*)realloc(b->lines[row], col + first_len + 1);
+        memcpy(&b->lines[row][col], s, first_len);
+        b->lines[row][col + first_len] = '\0';
+        b->len[row] = col + first_len;
+
+        int r = row + 1;                         // next new line
+        for (const char *p = first_end + 1; p < last; r++) { // whole lines in between
+            const char *q = (const char*)memchr(p, '\n', last - p); // their end
+            int len = (int)(q - p);
+            b->lines[r] = (char*)malloc(len + 1);
+            memcpy(b->lines[r], p, len);
+            b->lines[r][len] = '\0';
+            b->len[r] = len;
+            b->cache[r] = (LineCache){ NULL, 0, -1, NULL, 0, false, NULL, 0, 0, 0, NULL, 0, 0 }; // nothing indexed yet
+            p = q + 1;
+        }
+        b->lines[r] = last_line;                 // r == row + nl
+        b->len[r] = last_len + tail_len;
+        b->cache[r] = (LineCache){ NULL, 0, -1, NULL, 0, false, NULL, 0, 0, 0, NULL, 0, 0 };
+        b->count += nl;                          // all new lines are in
+        views_lines_shifted(b, row + 1, nl);     // later lines moved down
+        line_cache_invalidate(b, row, col);      // first line now ends with the first piece
+        *end_row = r;
+        *end_col = last_len;
+    }
+    dirty = true;                                // mark buffer dirty
+    text_gen++;                                  // content changed
+}
+
+/*
+ * Delete the text from (r1, c1) up to (r2, c2), line breaks included, in one
+ * pass: the head of r1 and the tail of r2 become one line and the lines in
+ * between leave the array with a single shift.
+ */
+static void buffer_delete_range(Buffer *b, int r1, int c1, int r2, int c2) {
+    if (r1 < 0 || r2 >= b->count || r1 > r2) return; // out of range
+    if (c1 < 0) c1 = 0;                          // clamp columns
+    if (c1 > b->len[r1]) c1 = b->len[r1];
+    if (c2 < 0) c2 = 0;
+    if (c2 > b->len[r2]) c2 = b->len[r2];
+    if (r1 == r2 && c1 >= c2) return;            // empty range
+    undo_deleting(b, r1, c1, r2, c2);            // while the text is still there
+
+    if (r1 == r2) {                              // inside one line
+        int L = b->len[r1];                      // line length
+        memmove(&b->lines[r1][c1], &b->lines[r1][c2], L - c2 + 1); // shift left incl. NUL
+        b->len[r1] = L - (c2 - c1);              // update length
+        line_cache_invalidate(b, r1, c1);        // columns after 'c1' moved
+    } else {
+        int tail = b->len[r2] - c2;              // what survives of the last line
+        b->lines[r1] = (char*)realloc(b->lines[r1], c1 + tail + 1); // head + tail
+        memcpy(&b->lines[r1][c1], &b->lines[r2][c2], tail + 1); // tail incl. NUL
+        b->len[r1] = c1 + tail;                  // update length
+        for (int r = r1 + 1; r <= r2; r++) {     // lines that disappear
+            free(b->lines[r]);
+            free(b->cache[r].ck);                // and their checkpoints
+            free(b->cache[r].render);            // and their renders
+            free(b->cache[r].hits);              // and their match ranges
+            free(b->cache[r].brk);               // and their wrap breaks
+        }
+        int gone = r2 - r1;                      // how many lines the array loses
+        memmove(&b->lines[r1 + 1], &b->lines[r2 + 1], (b->count - r2 - 1) * sizeof(char*)); // shift up
+        memmove(&b->len[r1 + 1],   &b->len[r2 + 1],   (b->count - r2 - 1) * sizeof(int));   // shift lengths
+        memmove(&b->cache[r1 + 1], &b->cache[r2 + 1], (b->count - r2 - 1) * sizeof(LineCache)); // shift indexes
+        b->count -= gone;                        // fewer lines
+        views_lines_shifted(b, r1 + 1, -gone);   // later lines moved up
+        line_cache_invalidate(b, r1, c1);        // r1 changed from 'c1' on
+    }
+    dirty = true;                                // mark dirty
+    text_gen++;                                  // content changed
+}
+
+/* Replace the whole of line 'row' with s[0..n) (malloc'ed, NUL-terminated); the buffer takes it over */
+static void buffer_set_line(Buffer *b, int row, char *s, int n) {
+    if (row < 0 || row >= b->count) { free(s); return; } // out of range
+    undo_line_set(b, row, s, n);
+    free(b->lines[row]);                         // old content
+    b->lines[row] = s;
+    b->len[row] = n;
+    line_cache_invalidate(b, row, 0);            // every column may have moved
+    dirty = true;                                // mark dirty
+    text_gen++;                                  // content changed
+}
+
+/* Single-character edits are one-byte ranges */
+
+/* Insert a single character into a line at (row, col) */
+static void buffer_insert_char(Buffer *b, int row, int col, char c) {
+    int er, ec;                                  // end position (unused)
+    buffer_insert_text(b, row, col, &c, 1, &er, &ec);
+}
+
+/* Split a line into two at column 'col' (used for Enter) */
+static void buffer_split_line(Buffer *b, int row, int col) {
+    int er, ec;                                  // end position (unused)
+    buffer_insert_text(b, row, col, "\n", 1, &er, &ec);
+}
+
+/* Join current line with previous one (used for backspace at col 0) */
+static void buffer_join_with_prev(Buffer *b, int row) {
+    if (row <= 0 || row >= b->count) return;     // can't join
+    buffer_delete_range(b, row - 1, b->len[row - 1], row, 0); // remove the line break
+}
+
+/* ----------------------- Line display index ----------------------- */
+
+/* Append a checkpoint to a line's index, growing its storage in powers of two */
+static void line_cache_push(LineCache *lc, LinePos p) {
+    if (lc->nck == 0 || (lc->nck >= 4 && (lc->nck & (lc->nck - 1)) == 0)) { // storage may be full
+        int ncap = lc->nck < 4 ? 4 : lc->nck * 2; // next size
+        lc->ck = (LinePos*)realloc(lc->ck, ncap * sizeof(LinePos)); // grow
+    }
+    lc->ck[lc->nck++] = p;                       // store checkpoint
+}
+
+/*
+ * Walk line 'row' to a target and return the glyph boundary found there.
+ * by_col = false: the boundary at 'target' byte, or the start of the glyph containing it.
+ * by_col = true : the first boundary at column 'target', or the start of the glyph
+ *                 covering that column (so a wide char is never split).
+ * We start from the nearest checkpoint, so the cost is O(CKPT_BYTES + distance
+ * walked past the last checkpoint); walking past it records new checkpoints.
+ */
+static LinePos line_seek(Buffer *b, int row, int target, bool by_col) {
+    LineCache *lc = &b->cache[row];              // that line's index
+    const char *s = b->lines[row];               // line bytes
+    int n = b->len[row];                         // line length
+
+    int lo = 0, hi = lc->nck - 1, best = -1;     // binary search for the last checkpoint before target
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;                 // middle checkpoint
+        bool before = by_col ? lc->ck[mid].col < target : lc->ck[mid].byte <= target;
+        if (before) { best = mid; lo = mid + 1; } // usable, look for a later one
+        else hi = mid - 1;                       // too far
+    }
+    LinePos p = best >= 0 ? lc->ck[best] : (LinePos){0, 0, 0}; // start of the walk
+    bool frontier = best == lc->nck - 1;         // walking into the unindexed part
+    int next_ck = p.byte + CKPT_BYTES;           // where the next checkpoint goes
+
+    while (p.byte < n) {                         // walk glyph by glyph
+        if (by_col ? p.col >= target : p.byte >= target)
+            break;                               // reached the target boundary
+        Glyph g = glyph_at(s + p.byte, n - p.byte, p.col); // glyph size
+        if (by_col ? p.col + g.width > target : p.byte + g.len > target)
+            break;                               // target is inside this glyph
+        p.byte += g.len;                         // step over it
+        p.col += g.width;
+        p.ren += g.rlen;
+        if (frontier && p.byte >= next_ck) {     // far enough from the last checkpoint
+            line_cache_push(lc, p);              // remember this boundary
+            next_ck = p.byte + CKPT_BYTES;
+        }
+    }
+    if (frontier && p.byte == n)                 // walked the whole line
+        lc->width = p.col;                       // so we know its width now
+    return p;                                    // boundary found
+}
+
+/* Display column where byte 'byte' of line 'row' starts */
+static int line_col_of(Buffer *b, int row, int byte) {
+    return line_seek(b, row, byte, false).col;   // walk by bytes
+}
+
+/* Byte offset of the glyph at display column 'col' of line 'row' */
+static int line_byte_at(Buffer *b, int row, int col) {
+    return line_seek(b, row, col, true).byte;    // walk by columns
+}
+
+/* Start of the glyph before byte 'byte' (skipping zero-width marks so they stay with their base) */
+static int line_prev_glyph(Buffer *b, int row, int byte) {
+    while (byte > 0) {                           // not at line start yet
+        byte = line_seek(b, row, byte - 1, false).byte; // glyph containing the previous byte
+        if (glyph_at(b->lines[row] + byte, b->len[row] - byte, 0).width > 0)
+            break;                               // a visible glyph: stop here
+    }
+    return byte;                                 // new position
+}
+
+/* Start of the glyph after byte 'byte' (combining marks travel with their base) */
+static int line_next_glyph(Buffer *b, int row, int byte) {
+    int n = b->len[row];                         // line length
+    if (byte < n)                                // step over the current glyph
+        byte += glyph_at(b->lines[row] + byte, n - byte, 0).len;
+    while (byte < n) {                           // and over marks attached to it
+        Glyph g = glyph_at(b->lines[row] + byte, n - byte, 0);
+        if (g.width > 0) break;                  // next visible glyph starts here
+        byte += g.len;
+    }
+    return byte;                                 // new position
+}
+
+/*
+ * Build (once) the render representation of line 'row': tabs expanded, controls
+ * and malformed bytes made printable. It is kept until the line is edited or
+ * scrolls off screen. Lines longer than RENDER_MAX_BYTES are not cached.
+ */
+static LineCache *line_render(Buffer *b, int row) {
+    LineCache *lc = &b->cache[row];              // that line's cache
+    if (lc->render) return lc;                   // already built
+    const char *s = b->lines[row];               // line bytes
+    int n = b->len[row];                         // line length
+    int cap = n + 16;                            // tabs and carets may grow it
+    char *r = (char*)malloc(cap);                // render storage
+    int rl = 0, col = 0;                         // render length, current column
+    bool flat = true;                            // one byte per column so far?
+    for (int i = 0; i < n; ) {                   // walk glyphs
+        Glyph g = glyph_at(s + i, n - i, col);   // measure glyph
+        if (rl + g.rlen > cap) {                 // out of room
+            cap = cap * 2 + g.rlen;              // grow
+            r = (char*)realloc(r, cap);
+        }
+        glyph_render(s + i, g, r + rl);          // append its render bytes
+        if (g.rlen != g.width) flat = false;     // multi-byte or zero-width glyph
+        rl += g.rlen;                            // advance
+        col += g.width;
+        i += g.len;
+    }
+    lc->render = r;                              // store result
+    lc->rlen = rl;
+    lc->flat = flat;
+    lc->width = col;                             // we measured the whole line on the way
+    return lc;
+}
+
+/* Free the render and match ranges of 'row' (rebuilt if the row is drawn again) */
+static void line_render_release(Buffer *b, int row) {
+    LineCache *lc = &b->cache[row];
+    free(lc->render);                            // drop render bytes
+    lc->render = NULL;
+    free(lc->hits);                              // and match ranges
+    lc->hits = NULL;
+    lc->nhits = lc->hits_cap = 0;
+    lc->hits_gen = 0;
+}
+
+/* Display width of the whole line 'row' (measured once, then cached until the line changes) */
+static int line_width(Buffer *b, int row) {
+    if (b->cache[row].width < 0)                 // not measured yet
+        line_seek(b, row, INT_MAX, false);       // walking to the end records it
+    return b->cache[row].width;
+}
+
+/* ----------------------- Soft wrap ----------------------- */
+/*
+ * With soft wrap on, a line is cut into screen rows of W columns (W = text
+ * width), except that a row ends early before a double-width glyph that would
+ * straddle its edge; the glyph starts the next row. A line with no such glyph
+ * (no byte that can lead one) of width w takes w / W + 1 rows, the extra row
+ * leaving room for the cursor after the last glyph; other lines keep the
+ * columns where their rows break. Screen rows are "visual rows". A Fenwick
+ * tree over the per-line row counts maps a line to its first visual row and
+ * back in O(log n). An edited line updates one count; inserting or removing
+ * lines only re-sums the cached counts; nothing is re-measured unless the
+ * width changes.
+ */
+
+/* Append a row break to a line's list, growing it in powers of two like line_cache_push */
+static void wrap_brk_push(LineCache *lc, int col) {
+    if (lc->nbrk == 0 || (lc->nbrk >= 4 && (lc->nbrk & (lc->nbrk - 1)) == 0)) // storage may be full
+        lc->brk = (int*)realloc(lc->brk, (lc->nbrk < 4 ? 4 : lc->nbrk * 2) * sizeof(int));
+    lc->brk[lc->nbrk++] = col;
+}
+
+/* Make sure line 'row' knows its row breaks at the current wrap width */
+static void wrap_breaks(int row) {
+    LineCache *lc = &buf.cache[row];
+    int W = wrap.width;
+    if (lc->brk_width < 0 || lc->brk_width == W) return; // known
+    const char *s = buf.lines[row];
+    int n = buf.len[row];
+    if (lc->brk_width == 0) {                    // first look: double-width glyphs start at U+1100 (lead 0xE1)
+        int i = 0;
+        while (i < n && (unsigned char)s[i] < 0xE1) i++;
+        if (i == n) { lc->brk_width = -1; return; } // rows are plain W-column slices, at any width
+    }
+    lc->nbrk = 0;
+    int start = 0, col = 0;                      // where the current row starts, column of the next glyph
+    for (int i = 0; ; ) {
+        while (col >= start + W)                 // the row is full (a tab or ^X may run over its edge)
+            wrap_brk_push(lc, start += W);
+        if (i == n) break;                       // the cursor after the last glyph gets a row too
+        Glyph g = glyph_at(s + i, n - i, col);
+        if (g.width > 1 && (unsigned char)s[i] >= 0x80 && col + g.width > start + W && col > start)
+            wrap_brk_push(lc, start = col);      // a wide glyph that does not fit starts the next row
+        col += g.width;
+        i += g.len;
+    }
+    lc->brk_width = W;
+}
+
+/* Screen rows line 'row' needs at the current wrap width */
+static int wrap_segs_for(int row) {
+    wrap_breaks(row);
+    if (buf.cache[row].brk_width < 0)
+        return line_width(&buf, row) / wrap.width + 1; // whole segments plus the cursor row
+    return buf.cache[row].nbrk + 1;
+}
+
+/* Display column where screen row 'seg' of line 'row' starts */
+static int wrap_seg_start(int row, int seg) {
+    if (seg == 0) return 0;
+    wrap_breaks(row);
+    LineCache *lc = &buf.cache[row];
+    return lc->brk_width < 0 ? seg * wrap.width : lc->brk[seg - 1];
+}
+
+/* Screen row of line 'row' that display column 'col' is on */
+static int wrap_seg_of_col(int row, int col) {
+    wrap_breaks(row);
+    LineCache *lc = &buf.cache[row];
+    if (lc->brk_width < 0) return col / wrap.width;
+    int lo = 0, hi = lc->nbrk;                   // count the breaks at or before col
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (lc->brk[mid] <= col) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Rebuild counts (where unknown, or all if the width changed) and prefix sums */
+static void wrap_rebuild(void) {
+    bool remeasure = wrap.width != view.screencols || wrap.n != buf.count; // counts are stale
+    if (buf.count + 1 > wrap.cap) {              // grow arrays
+        wrap.cap = buf.count + 1 > wrap.cap * 2 ? buf.count + 1 : wrap.cap * 2;
+        wrap.segs = (int*)realloc(wrap.segs, wrap.cap * sizeof(int));
+        wrap.tree = (int*)realloc(wrap.tree, wrap.cap * sizeof(int));
+    }
+    wrap.width = view.screencols;                // width the counts are for
+    wrap.n = buf.count;                          // lines covered
+    for (int i = 0; i < wrap.n; i++) {
+        if (remeasure || wrap.segs[i] <= 0)      // width changed or count unknown
+            wrap.segs[i] = wrap_segs_for(i);     // uses the cached line width when it has one
+        wrap.tree[i + 1] = wrap.segs[i];         // Fenwick leaves (1-based)
+    }
+    for (int i = 1; i <= wrap.n; i++) {          // linear-time Fenwick build
+        int parent = i + (i & -i);               // node that also covers i
+        if (parent <= wrap.n)
+            wrap.tree[parent] += wrap.tree[i];
+    }
+    wrap.valid = true;                           // map matches the buffer again
+}
+
+/* Make sure the map is usable before reading it */
+static void wrap_sync(void) {
+    if (!wrap.valid || wrap.width != view.screencols) // stale after line insert/remove or resize
+        wrap_rebuild();
+}
+
+/* Sum of screen rows of lines [0, line) */
+static int wrap_prefix(int line) {
+    int sum = 0;                                 // accumulated rows
+    for (int i = line; i > 0; i -= i & -i)       // Fenwick prefix query
+        sum += wrap.tree[i];
+    return sum;
+}
+
+/* Change the row count of one line by 'delta' */
+static void wrap_add(int line, int delta) {
+    for (int i = line + 1; i <= wrap.n; i += i & -i) // Fenwick point update
+        wrap.tree[i] += delta;
+}
+
+/* Find the line containing visual row v, and which of its segments v is */
+static void wrap_find(int v, int *line, int *seg) {
+    int pos = 0, rem = v;                        // lines skipped so far, rows left
+    int step = 1;                                // highest power of two <= n
+    while (step * 2 <= wrap.n) step *= 2;
+    for (; step > 0; step /= 2) {                // Fenwick descent
+        if (pos + step <= wrap.n && wrap.tree[pos + step] <= rem) {
+            pos += step;                         // whole block of lines lies before v
+            rem -= wrap.tree[pos];
+        }
+    }
+    if (pos >= wrap.n) {                         // past the end: clamp to last line
+        pos = wrap.n - 1;
+        rem = wrap.segs[pos] - 1;
+    }
+    *line = pos;                                 // line index
+    *seg = rem;                                  // segment inside it
+}
+
+/* Visual row where line 'line' starts (identity when not wrapping) */
+static int vrow_of_line(int line) {
+    if (!soft_wrap) return line;                 // one row per line
+    wrap_sync();                                 // map must be current
+    return wrap_prefix(line);
+}
+
+/* Line and segment shown at visual row v */
+static void vrow_locate(int v, int *line, int *seg) {
+    if (!soft_wrap) { *line = v; *seg = 0; return; } // one row per line
+    wrap_sync();                                 // map must be current
+    wrap_find(v, line, seg);
+}
+
+/* Total number of visual rows in the buffer */
+static int vrow_total(void) {
+    return vrow_of_line(buf.count);              // rows before the (virtual) line after the last
+}
+
+/* Visual row of the cursor */
+static int vrow_cursor(void) {
+    int v = vrow_of_line(view.cy);               // first row of cursor line
+    if (soft_wrap)                               // plus the segment the cursor is in
+        v += wrap_seg_of_col(view.cy, line_col_of(&buf, view.cy, view.cx));
+    return v;
+}
+
+/* ----------------------- Buffer change hooks ----------------------- */
+/* Called by the buffer layer so views derived from the text stay in sync. */
+
+static void views_line_changed(Buffer *b, int row) {
+    if (b == &buf) mcount_line_changed(row);     // "match N of M" counts
+    if (b == &buf) tindex_line_changed(row);     // trigram index
+    if (b != &buf || !soft_wrap || row >= wrap.n) return; // no wrap counts to maintain
+    if (!wrap.valid) {                           // prefix sums are rebuilt anyway
+        wrap.segs[row] = 0;                      // just mark this count unknown
+        return;
+    }
+    int segs = wrap_segs_for(row);               // re-measure only this line
+    if (segs != wrap.segs[row]) {                // it now takes a different number of rows
+        wrap_add(row, segs - wrap.segs[row]);    // O(log n) update
+        wrap.segs[row] = segs;
+    }
+}
+
+static void views_lines_shifted(Buffer *b, int at, int delta) {
+    if (b == &buf) mcount_lines_shifted(at, delta); // "match N of M" counts
+    if (b == &buf) tindex_lines_shifted(at, delta); // trigram index
+    if (b != &buf || !soft_wrap) return;         // no wrap counts to maintain
+    wrap.valid = false;                          // prefix sums of later lines moved
+    if (wrap.n + delta != b->count || b->count + 1 > wrap.cap) { // lost track (or no room)
+        wrap.n = 0;                              // recount everything on next use
+        return;
+    }
+    if (delta > 0) {                             // new lines: counts unknown
+        memmove(&wrap.segs[at + delta], &wrap.segs[at], (wrap.n - at) * sizeof(int));
+        for (int i = at; i < at + delta; i++) wrap.segs[i] = 0;
+    } else if (delta < 0) {                      // removed lines drop their counts
+        memmove(&wrap.segs[at], &wrap.segs[at - delta], (wrap.n - at + delta) * sizeof(int));
+    }
+    wrap.n = b->count;                           // counts follow their lines
+}
+
+/* ----------------------- Undo ----------------------- */
+
+/*
+ * Every change to the buffer is logged as a small record followed by the
+ * bytes it inserted or deleted, all appended to one arena. Typing and
+ * Backspace grow the record they started while those keys keep coming
+ * (erased bytes are stored backwards, so erasing appends too): a keystroke
+ * costs about a byte of history. Undoing a record is a single buffer
+ * operation, so taking back a paste is one range delete. Commands that edit
+ * many places chain their records into one step.
+ */
+
+/* Record at arena offset 'off' */
+static UndoRec *undo_rec(size_t off) {
+    return (UndoRec*)(undo.a + off);
+}
+
+/* Arena bytes taken by a record with n bytes of text (records stay 8-byte aligned) */
+static size_t undo_size(size_t n) {
+    return sizeof(UndoRec) + ((n + 7) & ~(size_t)7);
+}
+
+/* Forget the history: a file was read */
+static void undo_reset(void) {
+    undo.len = undo.top = undo.saved = 0;
+    undo.last = UNDO_NONE;
+    undo.cmd = UNDO_CMD_NONE;
+    undo.open = false;
+}
+
+/* The next edit starts a new record */
+static void undo_seal(void) {
+    undo.cmd = UNDO_CMD_NONE;
+    undo.open = false;
+}
+
+/* An edit command starts: typing (or erasing) right after typing (or erasing) grows the same record */
+static void undo_command(UndoCmd cmd) {
+    if (cmd != undo.cmd) undo_seal();
+    undo.cmd = cmd;
+}
+
+/* Records made until the matching undo_group_end are undone and redone as one step */
+static void undo_group_begin(void) {
+    if (undo.group++ == 0) {
+        undo_seal();
+        undo.grouped = false;
+    }
+}
+
+static void undo_group_end(void) {
+    if (--undo.group == 0) undo_seal();
+}
+
+/* The file on disk holds the buffer as it is now */
+static void undo_mark_saved(void) {
+    undo_seal();                                 // typing on does not reach back past this point
+    undo.saved = undo.top;
+}
+
+/* Make room for n more bytes at the end of the arena */
+static void undo_reserve(size_t n) {
+    if (undo.len + n <= undo.cap) return;
+    undo.cap = (undo.len + n) * 2 + 4096;
+    undo.a = (char*)realloc(undo.a, undo.cap);
+}
+
+/* Append a record with n bytes of text, which the caller fills in at the returned address */
+static char *undo_add(UndoKind kind, int row, int col, size_t n, bool chained) {
+    if (undo.saved != UNDO_NONE && undo.saved > undo.top) undo.saved = UNDO_NONE; // dropped with the undone records
+    undo.len = undo.top;                         // an edit drops what was undone
+    size_t need = undo_size(n);
+    undo_reserve(need);
+    UndoRec *r = undo_rec(undo.len);
+    *r = (UndoRec){ undo.last, n, row, col, view.cy, view.cx, (unsigned char)kind,
+                    chained || (undo.group > 0 && undo.grouped) };
+    if (undo.group > 0) undo.grouped = true;     // the rest of the group chains to this one
+    undo.last = undo.len;
+    undo.len = undo.top = undo.len + need;
+    undo.open = false;
+    return (char*)(r + 1);
+}
+
+/* Grow the last record by n bytes of text, which the caller fills in at the returned address */
+static char *undo_grow(size_t n) {
+    size_t end = undo.last + sizeof(UndoRec) + undo_rec(undo.last)->len; // where its text ends now
+    size_t need = undo.last + undo_size(undo_rec(undo.last)->len + n);
+    if (need > undo.len) undo_reserve(need - undo.len);
+    undo_rec(undo.last)->len += n;
+    undo.len = undo.top = need;
+    return undo.a + end;
+}
+
+/* Buffer hook: s[0..n) is about to be inserted at (row, col) */
+static void undo_inserted(Buffer *b, int row, int col, const char *s, size_t n) {
+    if (b != &buf || undo.replaying || n == 0) return;
+    bool typing = undo.cmd == UNDO_CMD_TYPE && !memchr(s, '\n', n);
+    if (typing && undo.open) {                   // the typed run goes on right after its end?
+        const UndoRec *r = undo_rec(undo.last);
+        if (r->kind == UNDO_INS && r->row == row && r->col + (int)r->len == col) {
+            memcpy(undo_grow(n), s, n);
+            return;
+        }
+    }
+    memcpy(undo_add(UNDO_INS, row, col, n, false), s, n);
+    undo.open = typing;
+}
+
+/* Buffer hook: the text from (r1, c1) to (r2, c2) is about to be deleted */
+static void undo_deleting(Buffer *b, int r1, int c1, int r2, int c2) {
+    if (b != &buf || undo.replaying) return;
+    size_t n = r1 == r2 ? (size_t)(c2 - c1) : (size_t)(b->len[r1] - c1) + 1 + (size_t)c2;
+    for (int row = r1 + 1; row < r2; row++) n += (size_t)b->len[row] + 1;
+    bool erasing = undo.cmd == UNDO_CMD_ERASE;
+    char *t;
+    UndoRec *r = undo.open ? undo_rec(undo.last) : NULL;
+    if (erasing && r && r->kind == UNDO_DEL_REV && r->row == r2 && r->col == c2) { // erasing on from where it stopped
+        t = undo_grow(n);
+        r = undo_rec(undo.last);
+        r->row = r1;                             // the erased run starts earlier now
+        r->col = c1;
+    } else {
+        t = undo_add(erasing ? UNDO_DEL_REV : UNDO_DEL, r1, c1, n, false);
+    }
+    size_t o = 0;
+    for (int row = r1; row <= r2; row++) {       // the text, line breaks included
+        int from = row == r1 ? c1 : 0, to = row == r2 ? c2 : b->len[row];
+        memcpy(t + o, b->lines[row] + from, to - from);
+        o += to - from;
+        if (row < r2) t[o++] = '\n';
+    }
+    if (erasing)                                 // backwards: the next erased bytes go after these
+        for (size_t i = 0; i < n / 2; i++) {
+            char c = t[i];
+            t[i] = t[n - 1 - i];
+            t[n - 1 - i] = c;
+        }
+    undo.open = erasing;
+}
+
+/* Buffer hook: line 'row' is about to be replaced with s[0..n) */
+static void undo_line_set(Buffer *b, int row, const char *s, int n) {
+    if (b != &buf || undo.replaying) return;
+    memcpy(undo_add(UNDO_DEL, row, 0, b->len[row], false), b->lines[row], b->len[row]); // old text
+    memcpy(undo_add(UNDO_INS, row, 0, n, true), s, n); // new text, the same step
+}
+
+/* Where the text of r ends when it is in the buffer */
+static void undo_text_end(const UndoRec *r, int *er, int *ec) {
+    const char *s = (const char*)(r + 1);
+    int lines = 0;                               // line breaks in it
+    size_t first = 0, last = 0;                  // offsets of the first and last
+    for (size_t i = 0; i < r->len; i++)
+        if (s[i] == '\n') {
+            if (lines++ == 0) first = i;
+            last = i;
+        }
+    *er = r->row + lines;
+    if (lines == 0) *ec = r->col + (int)r->len;
+    else *ec = (int)(r->kind == UNDO_DEL_REV ? first : r->len - last - 1); // bytes after the last break
+}
+
+/* Redo (forward) or undo record r with one buffer operation; the cursor goes to the end of the change */
+static void undo_apply(const UndoRec *r, bool forward) {
+    if ((r->kind == UNDO_INS) == forward) {      // the text goes (back) in
+        const char *s = (const char*)(r + 1);
+        char *rev = NULL;
+        if (r->kind == UNDO_DEL_REV) {           // stored backwards
+            rev = (char*)malloc(r->len + 1);
+            for (size_t i = 0; i < r->len; i++) rev[i] = s[r->len - 1 - i];
+            s = rev;
+        }
+        buffer_insert_text(&buf, r->row, r->col, s, r->len, &view.cy, &view.cx);
+        free(rev);
+    } else {                                     // the text goes (back) out
+        int er, ec;
+        undo_text_end(r, &er, &ec);
+        buffer_delete_range(&buf, r->row, r->col, er, ec);
+        view.cy = r->row;
+        view.cx = r->col;
+    }
+}
+
+/* After undo or redo: a valid cursor, and clean again at the saved state */
+static void undo_settle(void) {
+    if (view.cy >= buf.count) view.cy = buf.count - 1;
+    if (view.cx > buf.len[view.cy]) view.cx = buf.len[view.cy];
+    view.pref_cx = line_col_of(&buf, view.cy, view.cx);
+    hl_row = hl_col = hl_len = -1;               // the highlighted match may be gone
+    dirty = undo.top != undo.saved;
+}
+
+/* Ctrl-Z: take back the last step; the cursor returns to where it was before it */
+static void editor_undo(void) {
+    undo_seal();
+    if (undo.last == UNDO_NONE) {
+        editor_set_status("Nothing to undo");
+        return;
+    }
+    const UndoRec *r;
+    undo.replaying = true;                       // the buffer hooks record nothing
+    do {                                         // the step's records, last first
+        r = undo_rec(undo.last);
+        undo_apply(r, false);
+        undo.top = undo.last;
+        undo.last = r->prev;
+    } while (r->chained && undo.last != UNDO_NONE);
+    undo.replaying = false;
+    view.cy = r->cy;
+    view.cx = r->cx;
+    undo_settle();
+}
+
+/* Ctrl-Y: do again the step undone last */
+static void editor_redo(void) {
+    undo_seal();
+    if (undo.top == undo.len) {
+        editor_set_status("Nothing to redo");
+        return;
+    }
+    undo.replaying = true;
+    do {                                         // the step's records, first first
+        const UndoRec *r = undo_rec(undo.top);
+        undo_apply(r, true);
+        undo.last = undo.top;
+        undo.top += undo_size(r->len);
+    } while (undo.top < undo.len && undo_rec(undo.top)->chained);
+    undo.replaying = false;
+    undo_settle();
+}
+
+/* ----------------------- File I/O ----------------------- */
+/* Load file into buffer as lines */
+static void editor_open(const char *path) {
+    undo_reset();                                // history belongs to the text it was made on
+    FILE *f = fopen(path, "rb");                 // open file for binary read
+    if (!f) {                                    // if file doesn't exist
+        snprintf(filename, sizeof(filename), "%s", path); // just remember name
+        return;                                  // start with empty buffer
+    }
+
+    buffer_free(&buf);                           // clear existing buffer
+    buffer_init(&buf);                           // start fresh
+
+    char *line = NULL;                           // getline buffer
+    size_t cap = 0;                              // getline capacity
+    ssize_t n;                                   // read length
+    bool first = true;                           // special-case first line
+
+    while ((n = getline(&line, &cap, f)) != -1) { // read each line
+        while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r')) // strip newlines
+            n--;
+        if (first) {                             // first line replaces the initial empty line
+            free(buf.lines[0]);                  // free empty line
+            buf.lines[0] = (char*)malloc(n + 1); // allocate exactly
+            memcpy(buf.lines[0], line, n);       // copy data
+            buf.lines[0][n] = '\0';              // terminate
+            buf.len[0] = (int)n;                 // set length
+            line_cache_invalidate(&buf, 0, 0);   // nothing indexed for the new text
+            first = false;                       // no longer first
+        } else {
+            buffer_insert_line(&buf, buf.count, line, (int)n); // append line
+        }
+    }
+    free(line);                                  // free getline buffer
+    fclose(f);                                   // close file
+    snprintf(filename, sizeof(filename), "%s", path); // remember file name
+    dirty = false;                               // clean state
+    tindex_open();                               // big file: index it while idle
+}
+
+/* Switch to another file (unsaved changes must be dealt with first), cursor at the top; false if unreadable */
+static bool editor_open_other(const char *path) {
+    if (access(path, R_OK) != 0) {               // editor_open would keep the old buffer
+        editor_set_status("Cannot open %s: %s", path, strerror(errno));
+        return false;
+    }
+    editor_open(path);
+    view.cx = view.cy = view.pref_cx = 0;        // fresh view
+    view.rowoff = view.coloff = 0;
+    last_match_row = last_match_col = -1;        // matches were in the other file
+    hl_row = hl_col = hl_len = -1;
+    quit_times_needed = 1;
+    return true;
+}
+
+/* Atomic save: write to tmp + fsync + rename */
+static bool editor_save_atomic(void) {
+    char tmpname[300];                           // buffer for tmp filename
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename); // tmp = filename.tmp
+
+    int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644); // open tmp
+    if (fd == -1) return false;                  // failed to open tmp
+
+    bool ok = true;                              // track success
+    for (int i = 0; i < buf.count; i++) {        // write each line
+        if (write(fd, buf.lines[i], buf.len[i]) == -1) { ok = false; break; } // write line
+        if (write(fd, "\n", 1) == -1) { ok = false; break; }                  // newline
+    }
+    if (ok && fsync(fd) == -1) ok = false;       // flush to disk
+    if (close(fd) == -1) ok = false;             // close file
+    if (!ok) { unlink(tmpname); return false; }  // cleanup on failure
+
+    if (rename(tmpname, filename) == -1) {       // atomically replace real file
+        unlink(tmpname);                         // remove tmp
+        return false;                            // report failure
+    }
+
+    dirty = false;                               // buffer is clean now
+    undo_mark_saved();                           // undoing back to here makes it clean again
+    return true;                                 // success
+}
+
+/* ----------------------- View / Rendering ----------------------- */
+
+/* Update view dimensions from terminal */
+static bool editor_update_dimensions(void) {
+    int rows = 24;                               // default rows if ioctl fails
+    int cols = 80;                               // default cols
+    if (get_window_size(&rows, &cols) == -1) {   // try to get real size
+        if (view.screenrows > 0)                 // if we already have previous size
+            rows = view.screenrows + 2;          // approximate
+        if (view.screencols > 0)                 // same for cols
+            cols = view.screencols;
+    }
+    int textrows = rows - 2;                     // leave 2 lines: status + message
+    if (textrows < 1) textrows = 1;              // clamp
+    bool changed = (textrows != view.screenrows) || (cols != view.screencols); // did it change?
+    view.screenrows = textrows;                  // store rows
+    view.screencols = cols;                      // store cols
+    return changed;                              // return whether it changed
+}
+
+/* Return how far we are in file as percent (for status bar) */
+static int percent_through(void) {
+    int total = vrow_total();                    // rows the whole buffer takes
+    if (total <= 1) return 100;                  // single-row file: show 100%
+    int p = (int)((vrow_cursor() + 1) * 100LL / total); // simple proportion
+    if (p < 1) p = 1;                            // clamp low
+    if (p > 100) p = 100;                        // clamp high
+    return p;                                    // return percentage
+}
+
+/* Adjust scroll so cursor is visible */
+static void editor_scroll(void) {
+    int cv = vrow_cursor();                      // visual row of the cursor
+    if (cv < view.rowoff)                        // if cursor above top
+        view.rowoff = cv;                        // scroll up
+    if (cv >= view.rowoff + view.screenrows)     // if cursor below bottom
+        view.rowoff = cv - view.screenrows + 1;  // scroll down
+
+    view.rx = line_col_of(&buf, view.cy, view.cx); // cursor byte -> display column
+    if (soft_wrap) {                             // wrapped lines never scroll sideways
+        view.coloff = 0;
+        return;
+    }
+    if (view.rx < view.coloff)                   // if cursor left of left edge
+        view.coloff = view.rx;                   // scroll left
+    if (view.rx >= view.coloff + view.screencols) // if cursor right of right edge
+        view.coloff = view.rx - view.screencols + 1; // scroll right
+}
+
+/* Attribute of display column 'col' (asked in ascending order): 0 plain, 1 a match, 2 the current match */
+static int hl_style_at(LineHl *h, int col) {
+    if (col >= h->cur_start && col < h->cur_end) return 2;
+    while (h->k < h->nspans && h->spans[2 * h->k + 1] <= col)
+        h->k++;                                  // ranges already passed
+    return h->k < h->nspans && h->spans[2 * h->k] <= col ? 1 : 0;
+}
+
+static const char *const hl_sgr[3] = { "\x1b[m", "\x1b[0;30;43m", "\x1b[0;7m" }; // plain, match, current match
+
+/*
+ * Draw render bytes r[0..rn), whose first glyph starts at display column 'col',
+ * clipped to columns [left, right), with the columns in 'h' highlighted.
+ * 'flat' render (one byte per column) is simply sliced.
+ */
+static void draw_render(const char *r, int rn, int col, int left, int right, LineHl *h, bool flat) {
+    if (flat) {                                  // column c is byte c - col
+        int a = left - col, z = right - col;     // visible byte range
+        if (a < 0) a = 0;
+        if (z > rn) z = rn;
+        if (a >= z) return;                      // nothing visible
+        if (h->cur_start < 0 && h->nspans == 0) { // nothing highlighted: one slice
+            ob_append(r + a, z - a);
+            return;
+        }
+        int style = 0, run = a;                  // current attribute, start of bytes not yet queued
+        for (int i = a; i < z; i++) {
+            int want = hl_style_at(h, col + i);
+            if (want == style) continue;
+            ob_append(r + run, i - run);         // flush pending bytes
+            run = i;
+            ob_append(hl_sgr[want], strlen(hl_sgr[want])); // switch attribute
+            style = want;
+        }
+        ob_append(r + run, z - run);             // the rest
+        if (style)
+            ob_append("\x1b[m", 3);              // reset attributes
+        return;
+    }
+
+    int i = 0;                                   // walk position in r
+    int cp;                                      // decoded code point
+    while (i < rn && col < left) {               // skip glyphs left of the screen
+        int len = utf8_decode(r + i, rn - i, &cp); // next glyph
+        int w = cp_width(cp);
+        if (col + w > left) {                    // a wide glyph is cut by the left edge
+            for (int k = left; k < col + w && k < right; k++)
+                ob_append(" ", 1);               // show blanks for its visible half
+        }
+        i += len;
+        col += w;
+    }
+    while (left > 0 && i < rn) {                 // marks whose base is off-screen
+        int len = utf8_decode(r + i, rn - i, &cp);
+        if (cp_width(cp) > 0) break;             // visible: start drawing here
+        i += len;                                // orphan mark: skip it
+    }
+
+    int style = 0;                               // attribute in effect
+    int run = i;                                 // start of bytes not yet queued
+    while (i < rn) {                             // walk visible glyphs
+        int len = utf8_decode(r + i, rn - i, &cp); // next glyph
+        int w = cp_width(cp);
+        if (col + w > right) break;              // does not fit on screen
+        int want = w > 0 ? hl_style_at(h, col) : style; // marks keep their base's look
+        if (want != style) {                     // attribute change
+            ob_append(r + run, i - run);         // flush pending bytes
+            run = i;
+            ob_append(hl_sgr[want], strlen(hl_sgr[want])); // switch attribute
+            style = want;
+        }
+        i += len;                                // next glyph
+        col += w;
+    }
+    ob_append(r + run, i - run);                 // flush the rest
+    if (style)
+        ob_append("\x1b[m", 3);                  // reset attributes
+}
+
+/*
+ * Draw columns [left, left + screencols) of a line, with the current search
+ * match and every other match of the query highlighted (all in display columns).
+ */
+static void draw_line_with_highlight(int filerow, int left) {
+    int right = left + view.screencols;          // one past the last column shown
+
+    LineHl hl = { -1, -1, NULL, 0, 0 };          // what to highlight
+    if (filerow == hl_row && hl_len > 0 && hl_col >= 0) { // if this line has the current match
+        hl.cur_start = line_col_of(&buf, filerow, hl_col);
+        hl.cur_end = line_col_of(&buf, filerow, hl_col + hl_len);
+    }
+    LineCache *hc = line_hits(&buf, filerow);    // every match in the line (cached)
+    static int *cols = NULL;                     // their column ranges in the visible part (reused)
+    static int cols_cap = 0;
+    if (hc->nhits > 0) {
+        int lb = line_byte_at(&buf, filerow, left);  // bytes shown: matches outside are skipped
+        int rb = line_byte_at(&buf, filerow, right); // without measuring their columns
+        for (int k = 0; k < hc->nhits; k++) {
+            int bs = hc->hits[2 * k], be = hc->hits[2 * k + 1];
+            if (be <= lb) continue;              // left of the screen
+            if (bs > rb) break;                  // right of it (ranges ascend)
+            if (2 * hl.nspans + 2 > cols_cap) {  // grow column storage
+                cols_cap = cols_cap * 2 + 16;
+                cols = (int*)realloc(cols, cols_cap * sizeof(int));
+            }
+            cols[2 * hl.nspans] = line_col_of(&buf, filerow, bs);
+            cols[2 * hl.nspans + 1] = line_col_of(&buf, filerow, be);
+            hl.nspans++;
+        }
+        hl.spans = cols;
+    }
+
+    if (buf.len[filerow] <= RENDER_MAX_BYTES) {  // normal line: use the cached render
+        LineCache *lc = line_render(&buf, filerow);
+        if (lc->flat) {                          // no index needed: columns are bytes
+            draw_render(lc->render, lc->rlen, 0, left, right, &hl, true);
+            return;
+        }
+        LinePos p = line_seek(&buf, filerow, left, true); // glyph at the left edge
+        draw_render(lc->render + p.ren, lc->rlen - p.ren, p.col, left, right, &hl, false);
+        return;
+    }
+
+    /* very long line: render just the visible window, starting at the nearest checkpoint */
+    static char *win = NULL;                     // window render storage (reused)
+    static int wincap = 0;
+    const char *s = buf.lines[filerow];          // line bytes
+    int n = buf.len[filerow];                    // line length
+    LinePos p = line_seek(&buf, filerow, left, true); // glyph at the left edge
+    int wn = 0, col = p.col;                     // window length, current column
+    for (int i = p.byte; i < n && col < right; ) { // until the right edge
+        Glyph g = glyph_at(s + i, n - i, col);   // measure glyph
+        if (wn + g.rlen > wincap) {              // grow window storage
+            wincap = wincap * 2 + g.rlen + 256;
+            win = (char*)realloc(win, wincap);
+        }
+        glyph_render(s + i, g, win + wn);        // render it
+        wn += g.rlen;
+        col += g.width;
+        i += g.len;
+    }
+    draw_render(win, wn, p.col, left, right, &hl, false);
+}
+
+/* Repaint one text row of the screen (y is 0-based inside the text area) */
+static void draw_text_row(int y) {
+    int v = view.rowoff + y;                     // visual row index
+    ob_printf("\x1b[%d;1H\x1b[2K", y + 1);       // go to the row and clear it
+    if (v >= vrow_total()) return;               // past the end of the file
+    int filerow, seg;                            // line shown there, and which part of it
+    vrow_locate(v, &filerow, &seg);
+    int left = soft_wrap ? wrap_seg_start(filerow, seg) : view.coloff; // first column of that part
+    draw_line_with_highlight(filerow, left);     // draw that line
+}
+
+/*
+ * Shift the text area by 'delta' rows using a scroll region (DECSTBM) and
+ * SU/SD, so the terminal moves what it already shows and we only send the
+ * rows that scrolled into view. Positive delta = content moves up.
+ */
+static void scroll_text_area(int delta) {
+    int rows = view.screenrows;                  // size of the text area
+    ob_printf("\x1b[1;%dr", rows);               // restrict scrolling to the text rows
+    if (delta > 0)
+        ob_printf("\x1b[%dS", delta);            // scroll up: new rows appear at the bottom
+    else
+        ob_printf("\x1b[%dT", -delta);           // scroll down: new rows appear at the top
+    ob_append("\x1b[r", 3);                      // back to full-screen scroll region
+
+    int from = delta > 0 ? rows - delta : 0;     // first exposed row
+    int to   = delta > 0 ? rows : -delta;        // one past last exposed row
+    for (int y = from; y < to; y++)              // only the exposed rows need drawing
+        draw_text_row(y);
+}
+
+/* Repaint the screen rows showing 'filerow', if they are visible */
+static void repaint_file_row(int filerow) {
+    if (filerow < 0 || filerow >= buf.count) return; // no such line
+    int first = vrow_of_line(filerow) - view.rowoff; // screen row of its first part
+    int rows = soft_wrap ? wrap.segs[filerow] : 1; // how many rows it takes
+    for (int y = first; y < first + rows; y++)
+        if (y >= 0 && y < view.screenrows)       // on screen
+            draw_text_row(y);                    // redraw just that row
+}
+
+/* Fill the status bar row (inverted): 'left' from the first column, 'right' flush right, clipped to the width */
+static void draw_bar(const char *left, const char *right) {
+    int len = (int)strlen(left), rlen = (int)strlen(right);
+    if (len > view.screencols) len = view.screencols;
+    ob_printf("\x1b[%d;1H\x1b[7m", view.screenrows + 1); // status bar, inverted
+    ob_append(left, len);
+    for (; len < view.screencols - rlen; len++) ob_append(" ", 1);
+    if (len < view.screencols) ob_append(right, view.screencols - len < rlen ? view.screencols - len : rlen);
+    ob_append("\x1b[m", 3);
+}
+
+/*
+ * Draw status bar (inverted) on the row below the text area.
+ * When only the right part changed (cursor position, percent) and it keeps
+ * its length, we rewrite just the characters that differ.
+ */
+static void draw_status_bar(bool force) {
+    char left[160], right[80];                   // buffers for status parts
+    snprintf(left,  sizeof(left),  " %.40s %s", filename, dirty ? "(modified)" : ""); // left side: filename + dirty
+    if (prof.on)                                 // profiling overlay replaces the version
+        snprintf(right, sizeof(right), " %d:%d %3d%% | %ld.%02ldms %zuB f%lu skip%lu%s ",
+                 view.cy + 1, view.rx + 1, percent_through(),
+                 prof.last_us / 1000, prof.last_us % 1000 / 10, prof.last_bytes, // last frame cost
+                 prof.frames, prof.skipped, sync_output ? " sync" : ""); // counters
+    else
+        snprintf(right, sizeof(right), " %d:%d %3d%% v%s ",
+                 view.cy + 1, view.rx + 1, percent_through(), EDITOR_VERSION); // right side: pos + percent + version
+
+    int len = (int)strlen(left);                 // length of left part
+    int right_len = (int)strlen(right);          // length of right part
+
+    if (!force && strcmp(left, screen.status_left) == 0
+        && right_len == (int)strlen(screen.status_right) // same layout as on screen
+        && len + right_len <= view.screencols) { // right part sits at a known column
+        int i = 0, j = right_len;                // first and one-past-last differing char
+        while (i < j && right[i] == screen.status_right[i]) i++;
+        while (j > i && right[j-1] == screen.status_right[j-1]) j--;
+        if (i < j) {                             // something changed
+            ob_printf("\x1b[%d;%dH", view.screenrows + 1, view.screencols - right_len + i + 1);
+            ob_append("\x1b[7m", 4);             // inverted like the rest of the bar
+            ob_append(&right[i], j - i);         // only the changed characters
+            ob_append("\x1b[m", 3);              // end inverted
+            memcpy(screen.status_right, right, right_len + 1); // remember new content
+        }
+        return;                                  // bar is up to date
+    }
+
+    ob_printf("\x1b[%d;1H", view.screenrows + 1); // status bar row
+    ob_append("\x1b[7m", 4);                     // start inverted for status bar
+    if (len > view.screencols) len = view.screencols; // clamp
+    ob_append(left, len);                        // write left part
+
+    while (len < view.screencols - right_len) {  // pad with spaces between left and right
+        ob_append(" ", 1);
+        len++;
+    }
+    if (right_len > view.screencols) right_len = view.screencols; // clamp right part
+    ob_append(right, right_len);                 // write right part
+    ob_append("\x1b[m", 3);                      // end inverted
+
+    snprintf(screen.status_left, sizeof(screen.status_left), "%s", left);     // remember what we drew
+    snprintf(screen.status_right, sizeof(screen.status_right), "%s", right);
+}
+
+/* Draw the message line (last terminal row), only if its text changed */
+static void draw_message_line(bool force) {
+    const char *msg = "";                        // what the line should show
+    if (statusmsg[0] && (time(NULL) - statusmsg_time) < STATUS_MSG_SEC) // if message is fresh
+        msg = statusmsg;
+    if (!force && strcmp(msg, screen.message) == 0) return; // already on screen
+
+    ob_printf("\x1b[%d;1H\x1b[2K", view.screenrows + 2); // message row, cleared
+    int msglen = (int)strlen(msg);               // length of message
+    if (msglen > view.screencols) msglen = view.screencols; // clamp
+    ob_append(msg, msglen);                      // write message
+    snprintf(screen.message, sizeof(screen.message), "%s", msg); // remember it
+}
+
+/*
+ * Draw whole screen (text area + status + message), reusing what the terminal already shows.
+ * A pure cursor move ends up as a status-bar position update plus one cursor move.
+ */
+static void editor_draw_screen(void) {
+    long t0 = monotonic_us();                    // frame start (profiling overlay)
+    editor_scroll();                             // make sure cursor is in viewport
+
+    bool full = !screen.valid                    // terminal content unknown
+        || screen.text_gen != text_gen           // text changed since last frame
+        || screen.hl_gen != hl_query_gen         // other matches are marked on every row
+        || screen.rows != view.screenrows        // window resized
+        || screen.cols != view.screencols
+        || screen.coloff != view.coloff;         // horizontal scroll moves every row
+    bool hl_moved = screen.hl_row != hl_row      // highlight moved: its rows need repaint
+        || screen.hl_col != hl_col
+        || screen.hl_len != hl_len;
+
+    int delta = view.rowoff - screen.rowoff;     // how far we scrolled vertically
+    if (!full && (delta <= -view.screenrows || delta >= view.screenrows))
+        full = true;                             // jumped a whole page or more: repaint
+    bool rows_change = full || delta != 0 || hl_moved; // will any text row be drawn?
+    if (screen.valid && (delta != 0 || screen.rows != view.screenrows)) { // visible rows changed
+        int old_first, new_first, new_last, seg;  // lines at the edges of both frames
+        int total = vrow_total();                 // rows in the buffer
+        vrow_locate(screen.rowoff < total ? screen.rowoff : total - 1, &old_first, &seg);
+        vrow_locate(view.rowoff < total ? view.rowoff : total - 1, &new_first, &seg);
+        int last = view.rowoff + view.screenrows - 1; // last visual row on screen
+        vrow_locate(last < total ? last : total - 1, &new_last, &seg);
+        for (int r = old_first; r < old_first + screen.rows && r < buf.count; r++)
+            if (r < new_first || r > new_last)
+                line_render_release(&buf, r);    // keep renders for visible rows only
+    }
+
+    if (rows_change && sync_output)
+        ob_append("\x1b[?2026h", 8);             // terminal holds the frame until it is complete
+    if (rows_change)
+        ob_append("\x1b[?25l", 6);               // hide cursor while drawing rows
+    if (full) {
+        for (int y = 0; y < view.screenrows; y++) // draw every visible text row
+            draw_text_row(y);
+    } else {
+        if (delta != 0)                          // only the vertical offset changed
+            scroll_text_area(delta);             // shift and draw exposed rows
+        if (hl_moved) {                          // old and new highlight rows only
+            repaint_file_row(screen.hl_row);
+            if (hl_row != screen.hl_row)
+                repaint_file_row(hl_row);
+        }
+    }
+
+    draw_status_bar(full);                       // status bar always reflects the cursor
+    draw_message_line(full);                     // message may have expired
+
+    int scr_y = vrow_cursor() - view.rowoff;     // cursor y on screen
+    int scr_x = soft_wrap ? view.rx - wrap_seg_start(view.cy, wrap_seg_of_col(view.cy, view.rx)) // inside its part
+                          : view.rx - view.coloff;    // cursor x on screen
+    if (scr_y < 0) scr_y = 0;                    // clamp
+    if (scr_y >= view.screenrows) scr_y = view.screenrows - 1;
+    if (scr_x < 0) scr_x = 0;
+    if (scr_x >= view.screencols) scr_x = view.screencols - 1;
+
+    ob_printf("\x1b[%d;%dH", scr_y + 1, scr_x + 1); // move cursor to text area
+    if (rows_change)
+        ob_append("\x1b[?25h", 6);               // show cursor again
+    if (rows_change && sync_output)
+        ob_append("\x1b[?2026l", 8);             // frame complete: terminal shows it at once
+    prof.last_bytes = ob.len;                    // frame size, before the buffer is emptied
+    ob_flush();                                  // send the whole frame at once
+    prof.frames++;
+    prof.last_us = monotonic_us() - t0;          // build + write time
+
+    screen.valid = true;                         // remember what the terminal shows now
+    screen.text_gen = text_gen;
+    screen.hl_gen = hl_query_gen;
+    screen.rowoff = view.rowoff;
+    screen.coloff = view.coloff;
+    screen.rows = view.screenrows;
+    screen.cols = view.screencols;
+    screen.hl_row = hl_row;
+    screen.hl_col = hl_col;
+    screen.hl_len = hl_len;
+}
+
+/* ----------------------- Movement & Editing ----------------------- */
+
+/* Put the cursor on visual row v, as close to the preferred column as it gets */
+static void move_to_vrow(int v) {
+    int line, seg;                               // line and wrapped part at that row
+    vrow_locate(v, &line, &seg);
+    view.cy = line;
+    if (!soft_wrap) {                            // rows are lines
+        view.cx = line_byte_at(&buf, line, view.pref_cx); // restore preferred col (clamped to line end)
+        return;
+    }
+    int W = view.screencols;                     // wrap width
+    int start = wrap_seg_start(line, seg);       // the part's columns: [start, end)
+    int end = seg + 1 < wrap_segs_for(line) ? wrap_seg_start(line, seg + 1) : INT_MAX;
+    int col = start + view.pref_cx % W;          // same column inside the part
+    if (col >= end) col = end - 1;               // the part ends early (before a wide glyph): its last glyph
+    view.cx = line_byte_at(&buf, line, col);
+    if (view.cx < buf.len[line] && line_col_of(&buf, line, view.cx) < start) // tab or ^X straddles the edge
+        view.cx = line_next_glyph(&buf, line, view.cx);
+}
+
+/* Move by page (PageUp/PageDown) */
+static void editor_move_cursor_vert(int key) {
+    int page = view.screenrows - 2;              // how many rows to move
+    if (page < 1) page = 1;                      // at least 1
+
+    int v = vrow_cursor();                       // current visual row
+    if (key == 1005) {                           // PageUp
+        v -= page;                               // move up
+        if (v < 0) v = 0;                        // clamp to top
+    } else {                                     // PageDown
+        v += page;                               // move down
+        if (v >= vrow_total()) v = vrow_total() - 1; // clamp to last row
+    }
+
+    move_to_vrow(v);                             // land on that row
+}
+
+/* Move cursor for arrows/Home/End; create new line on Down at EOF */
+static void editor_move_cursor(int key) {
+    switch (key) {
+        case 1004: {                             // Left
+            if (view.cx > 0) {                   // if not at start of line
+                view.cx = line_prev_glyph(&buf, view.cy, view.cx); // move left one glyph
+            } else if (view.cy > 0) {            // if at start but not first line
+                view.cy--;                       // go to previous line
+                view.cx = buf.len[view.cy];      // to its end
+            }
+            view.pref_cx = line_col_of(&buf, view.cy, view.cx); // update preferred col
+        } break;
+        case 1003: {                             // Right
+            if (view.cy < buf.count) {           // if there is a line
+                int L = buf.len[view.cy];        // current line length
+                if (view.cx < L) {               // if not at end
+                    view.cx = line_next_glyph(&buf, view.cy, view.cx); // move right one glyph
+                    view.pref_cx = line_col_of(&buf, view.cy, view.cx); // update
+                } else if (view.cy + 1 < buf.count) { // if at end but there is next line
+                    view.cy++;                   // go to next line
+                    view.cx = 0;                 // at its start
+                    view.pref_cx = 0;            // update
+                }
+            }
+        } break;
+        case 1001: {                             // Up
+            int v = vrow_cursor();               // current visual row
+            move_to_vrow(v > 0 ? v - 1 : 0);     // row above, same column
+        } break;
+        case 1002: {                             // Down
+            int v = vrow_cursor() + 1;           // row below
+            if (v >= vrow_total())               // we are on the last row
+                buffer_append_empty(&buf);       // create a new empty line
+            move_to_vrow(v);                     // restore preferred col
+        } break;
+        case 1007: {                             // Home
+            view.cx = 0;                         // go to start of line
+            view.pref_cx = 0;                    // update preferred col
+        } break;
+        case 1008: {                             // End
+            view.cx = buf.len[view.cy];          // go to end of line
+            view.pref_cx = line_col_of(&buf, view.cy, view.cx); // update preferred col
+        } break;
+        case KEY_CTRL | 1007: {                  // Ctrl-Home: start of file
+            view.cy = view.cx = view.pref_cx = 0;
+        } break;
+        case KEY_CTRL | 1008: {                  // Ctrl-End: end of file
+            view.cy = buf.count - 1;
+            view.cx = buf.len[view.cy];
+            view.pref_cx = line_col_of(&buf, view.cy, view.cx);
+        } break;
+    }
+}
+
+/* Is byte c part of a word (for Ctrl-Left/Right)? UTF-8 bytes count as letters. */
+static bool is_word_byte(unsigned char c) {
+    return isalnum(c) || c == '_' || c >= 0x80;
+}
+
+/* Ctrl-Left/Right: jump to the previous word start or past the next word end */
+static void editor_move_word(int key) {
+    const char *s = buf.lines[view.cy];          // current line
+    int L = buf.len[view.cy];                    // its length
+    if (key == 1003) {                           // Right
+        if (view.cx == L && view.cy + 1 < buf.count) { // at line end: continue on the next line
+            view.cy++;
+            view.cx = 0;
+            s = buf.lines[view.cy];
+            L = buf.len[view.cy];
+        }
+        while (view.cx < L && !is_word_byte(s[view.cx])) view.cx++; // skip gap
+        while (view.cx < L && is_word_byte(s[view.cx])) view.cx++;  // then the word
+    } else {                                     // Left
+        if (view.cx == 0 && view.cy > 0) {       // at line start: continue on the previous line
+            view.cy--;
+            view.cx = buf.len[view.cy];
+            s = buf.lines[view.cy];
+        }
+        while (view.cx > 0 && !is_word_byte(s[view.cx - 1])) view.cx--; // skip gap
+        while (view.cx > 0 && is_word_byte(s[view.cx - 1])) view.cx--;  // then the word
+    }
+    view.pref_cx = line_col_of(&buf, view.cy, view.cx); // update preferred col
+}
+
+/* Turn soft wrap on or off, keeping the same line at the top of the screen */
+static void editor_toggle_wrap(void) {
+    int top, seg;                                // line currently at the top
+    vrow_locate(view.rowoff < vrow_total() ? view.rowoff : vrow_total() - 1, &top, &seg);
+    soft_wrap = !soft_wrap;                      // flip the mode
+    wrap.valid = false;                          // counts are recomputed on first use
+    wrap.n = 0;
+    view.coloff = 0;                             // wrapped text starts at column 0
+    view.rowoff = vrow_of_line(top);             // same text stays on top
+    screen.valid = false;                        // every row changes
+    editor_set_status("Soft wrap %s", soft_wrap ? "on" : "off");
+}
+
+/* Insert printable char at cursor */
+static void editor_insert_char(int c) {
+    undo_command(UNDO_CMD_TYPE);            // consecutive typing is one record
+    buffer_insert_char(&buf, view.cy, view.cx, (char)c); // insert char into buffer
+    view.cx++;                              // move cursor right
+    view.pref_cx = line_col_of(&buf, view.cy, view.cx); // update preferred col
+    hl_row = hl_col = hl_len = -1;         // clear search highlight
+}
+
+/* Insert newline at cursor */
+static void editor_insert_newline(void) {
+    buffer_split_line(&buf, view.cy, view.cx); // split line at cursor
+    view.cy++;                                 // move cursor to new line
+    view.cx = 0;                               // at start of new line
+    view.pref_cx = 0;                          // update preferred col
+    hl_row = hl_col = hl_len = -1;             // clear highlight
+}
+
+/* Insert a bracketed paste as one buffer operation */
+static void editor_paste(void) {
+    size_t n;                                    // payload length
+    char *text = paste_take(&n);                 // normalized payload
+    if (!text) return;                           // nothing pasted
+    buffer_insert_text(&buf, view.cy, view.cx, text, n, &view.cy, &view.cx); // cursor ends after it
+    free(text);
+    view.pref_cx = line_col_of(&buf, view.cy, view.cx); // update preferred col
+    hl_row = hl_col = hl_len = -1;               // clear search highlight
+}
+
+/* Delete char before cursor or join lines */
+static void editor_backspace(void) {
+    undo_command(UNDO_CMD_ERASE);              // consecutive Backspaces are one record
+    if (view.cx > 0) {                         // if not at start of line
+        int start = line_seek(&buf, view.cy, view.cx - 1, false).byte; // start of previous code point
+        buffer_delete_range(&buf, view.cy, start, view.cy, view.cx); // delete all of its bytes
+        view.cx = start;                        // move cursor left
+    } else if (view.cy > 0) {                   // at start but not first line
+        int prev_len = buf.len[view.cy - 1];    // length of previous line
+        buffer_join_with_prev(&buf, view.cy);   // merge current into previous
+        view.cy--;                              // move cursor to previous line
+        view.cx = prev_len;                     // at the join point
+    }
+    view.pref_cx = line_col_of(&buf, view.cy, view.cx); // update
+    hl_row = hl_col = hl_len = -1;             // clear highlight
+}
+
+/* ----------------------- Search kernel ----------------------- */
+/*
+ * Substring search works on a flat copy of the buffer (lines joined by '\n'),
+ * rebuilt only when the text generation changed, so one kernel call scans the
+ * whole file and embedded NULs are just bytes. The kernel is the first/last
+ * byte filter: compare a vector of haystack bytes against one needle byte and,
+ * shifted, against another; only positions where both match are verified with
+ * memcmp. AVX2 is used when the CPU has it (checked once at run time), SSE2
+ * otherwise on x86-64, and a memchr loop elsewhere.
+ *
+ * A query is compiled once into a plan: short queries filter on their two
+ * rarest bytes (by a fixed frequency ranking of text and code) instead of the
+ * first and last; long ones use Boyer-Moore-Horspool, which skips up to m bytes
+ * per step and so reads only a fraction of the text.
+ *
+ * Ignoring case costs no copy of the text: the needle is kept in lower case
+ * and the haystack is folded in the vector registers, where one OR with 0x20
+ * before each compare maps 'A'..'Z' onto 'a'..'z' (and nothing else onto a
+ * letter). Candidates are verified by a folding compare. A needle with
+ * non-ASCII letters filters on its ASCII bytes the same way and is verified
+ * one character at a time with cp_fold, the slower but exact path.
+ */
+
+/* 0x20 where needle byte c (stored folded) is a letter: OR'ed into the haystack bytes it is compared with */
+static char fold_bit(char c, FoldKind fold) {
+    return fold != FOLD_NONE && c >= 'a' && c <= 'z' ? 0x20 : 0;
+}
+
+/* s[0..m) against the folded needle, one UTF-8 character at a time; malformed bytes compare as they are */
+static bool utf8_fold_eq(const char *s, const char *needle, size_t m) {
+    for (size_t i = 0; i < m; ) {
+        unsigned char c = (unsigned char)s[i];
+        if (c < 0x80) {                          // ASCII: fold by hand
+            if (((unsigned)(c - 'A') < 26 ? c | 0x20 : c) != (unsigned char)needle[i]) return false;
+            i++;
+            continue;
+        }
+        int cp, ncp;                             // haystack / needle code point
+        int len = utf8_decode(s + i, (int)(m - i), &cp);
+        int nlen = utf8_decode(needle + i, (int)(m - i), &ncp);
+        if (len != nlen || (len == 1 ? c != (unsigned char)needle[i] : cp_fold(cp) != ncp))
+            return false;
+        i += len;
+    }
+    return true;
+}
+
+/* Verify a candidate: s[0..m) against needle, ignoring case as 'fold' says */
+static bool fold_eq(const char *s, const char *needle, size_t m, FoldKind fold) {
+    if (fold == FOLD_NONE) return memcmp(s, needle, m) == 0;
+    if (fold == FOLD_UTF8) return utf8_fold_eq(s, needle, m);
+    for (size_t i = 0; i < m; i++) {             // ASCII letters to lower case
+        unsigned char c = (unsigned char)s[i];
+        if ((unsigned)(c - 'A') < 26) c |= 0x20;
+        if (c != (unsigned char)needle[i]) return false;
+    }
+    return true;
+}
+
+/* Scalar version (m >= 1): memchr to each candidate's byte i1, then check byte i2 and the rest */
+static const char *find_pair_scalar(const char *hay, size_t n, const char *needle, size_t m, size_t i1, size_t i2,
+                                    FoldKind fold) {
+    if (fold != FOLD_NONE) {                     // byte i1 comes in two cases: no memchr
+        char f1 = fold_bit(needle[i1], fold), f2 = fold_bit(needle[i2], fold);
+        for (size_t s = 0; s + m <= n; s++)
+            if ((hay[s + i1] | f1) == needle[i1] && (hay[s + i2] | f2) == needle[i2] && fold_eq(hay + s, needle, m, fold))
+                return hay + s;
+        return NULL;
+    }
+    const char *p = hay + i1, *end = hay + n - m + 1 + i1; // byte i1 of candidates starting in [hay, n-m]
+    while (p < end && (p = (const char*)memchr(p, needle[i1], end - p)) != NULL) {
+        const char *s = p - i1;                  // candidate start
+        if (s[i2] == needle[i2] && memcmp(s, needle, m) == 0)
+            return s;                            // verified
+        p++;                                     // next candidate
+    }
+    return NULL;
+}
+
+/* Scalar version of the backward scan (m >= 1): candidates from the last one down */
+static const char *find_last_pair_scalar(const char *hay, size_t n, const char *needle, size_t m, size_t i1, size_t i2,
+                                         FoldKind fold) {
+    if (m > n) return NULL;                      // cannot fit
+    char f1 = fold_bit(needle[i1], fold), f2 = fold_bit(needle[i2], fold);
+    for (size_t s = n - m + 1; s-- > 0; )        // candidate starts [0, n-m], highest first
+        if ((hay[s + i1] | f1) == needle[i1] && (hay[s + i2] | f2) == needle[i2] && fold_eq(hay + s, needle, m, fold))
+            return hay + s;                      // verified
+    return NULL;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>                         // SSE2 / AVX2 intrinsics
+
+static const char *find_pair_sse2(const char *hay, size_t n, const char *needle, size_t m, size_t i1, size_t i2,
+                                  FoldKind fold) {
+    const __m128i b1 = _mm_set1_epi8(needle[i1]); // needle byte i1 in every lane
+    const __m128i b2 = _mm_set1_epi8(needle[i2]); // and byte i2
+    const __m128i f1 = _mm_set1_epi8(fold_bit(needle[i1], fold)); // case bit OR'ed into haystack bytes first
+    const __m128i f2 = _mm_set1_epi8(fold_bit(needle[i2], fold));
+    size_t i = 0;                                // block of candidate starts
+    for (; i + m - 1 + 16 <= n; i += 16) {       // candidates can be verified without running off
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i*)(hay + i + i1)), f1); // byte i1 of 16 candidates
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i*)(hay + i + i2)), f2); // byte i2 of the same
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, b1),
+                                                                  _mm_cmpeq_epi8(b, b2)));
+        while (mask) {                           // each candidate, lowest first
+            int bit = __builtin_ctz(mask);
+            if (fold_eq(hay + i + bit, needle, m, fold))
+                return hay + i + bit;            // verified
+            mask &= mask - 1;                    // drop this candidate
+        }
+    }
+    return find_pair_scalar(hay + i, n - i, needle, m, i1, i2, fold); // tail shorter than a vector
+}
+
+__attribute__((target("avx2")))
+static const char *find_pair_avx2(const char *hay, size_t n, const char *needle, size_t m, size_t i1, size_t i2,
+                                  FoldKind fold) {
+    const __m256i b1 = _mm256_set1_epi8(needle[i1]); // needle byte i1 in every lane
+    const __m256i b2 = _mm256_set1_epi8(needle[i2]); // and byte i2
+    const __m256i f1 = _mm256_set1_epi8(fold_bit(needle[i1], fold)); // case bit OR'ed into haystack bytes first
+    const __m256i f2 = _mm256_set1_epi8(fold_bit(needle[i2], fold));
+    size_t i = 0;                                // block of candidate starts
+    for (; i + m - 1 + 64 <= n; i += 64) {       // two vectors per step; candidates stay verifiable
+        const char *h = hay + i;
+        __m256i eq0 = _mm256_and_si256(          // candidates 0..31
+            _mm256_cmpeq_epi8(_mm256_or_si256(_mm256_loadu_si256((const __m256i*)(h + i1)), f1), b1),
+            _mm256_cmpeq_epi8(_mm256_or_si256(_mm256_loadu_si256((const __m256i*)(h + i2)), f2), b2));
+        __m256i eq1 = _mm256_and_si256(          // candidates 32..63
+            _mm256_cmpeq_epi8(_mm256_or_si256(_mm256_loadu_si256((const __m256i*)(h + 32 + i1)), f1), b1),
+            _mm256_cmpeq_epi8(_mm256_or_si256(_mm256_loadu_si256((const __m256i*)(h + 32 + i2)), f2), b2));
+        __m256i any = _mm256_or_si256(eq0, eq1);
+        if (_mm256_testz_si256(any, any))
+            continue;                            // common case: no candidate at all
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(eq0)
+                      | (uint64_t)(uint32_t)_mm256_movemask_epi8(eq1) << 32;
+        while (mask) {                           // each candidate, lowest first
+            int bit = __builtin_ctzll(mask);
+            if (fold_eq(h + bit, needle, m, fold))
+                return h + bit;                  // verified
+            mask &= mask - 1;                    // drop this candidate
+        }
+    }
+    return find_pair_sse2(hay + i, n - i, needle, m, i1, i2, fold); // tail shorter than a vector
+}
+
+/* Backward scans: the same filter, blocks taken from the end down, highest candidate first */
+static const char *find_last_pair_sse2(const char *hay, size_t n, const char *needle, size_t m, size_t i1, size_t i2,
+                                       FoldKind fold) {
+    const __m128i b1 = _mm_set1_epi8(needle[i1]); // needle byte i1 in every lane
+    const __m128i b2 = _mm_set1_epi8(needle[i2]); // and byte i2
+    const __m128i f1 = _mm_set1_epi8(fold_bit(needle[i1], fold)); // case bit OR'ed into haystack bytes first
+    const __m128i f2 = _mm_set1_epi8(fold_bit(needle[i2], fold));
+    size_t cand = n - m + 1;                     // candidate starts [0, cand) not yet checked
+    for (; cand >= 16; cand -= 16) {             // the top 16 of them
+        size_t i = cand - 16;
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i*)(hay + i + i1)), f1); // byte i1 of 16 candidates
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i*)(hay + i + i2)), f2); // byte i2 of the same
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, b1),
+                                                                  _mm_cmpeq_epi8(b, b2)));
+        while (mask) {                           // each candidate, highest first
+            int bit = 31 - __builtin_clz(mask);
+            if (fold_eq(hay + i + bit, needle, m, fold))
+                return hay + i + bit;            // verified
+            mask &= ~(1u << bit);                // drop this candidate
+        }
+    }
+    return find_last_pair_scalar(hay, cand + m - 1, needle, m, i1, i2, fold); // head shorter than a vector
+}
+
+__attribute__((target("avx2")))
+static const char *find_last_pair_avx2(const char *hay, size_t n, const char *needle, size_t m, size_t i1, size_t i2,
+                                       FoldKind fold) {
+    const __m256i b1 = _mm256_set1_epi8(needle[i1]); // needle byte i1 in every lane
+    const __m256i b2 = _mm256_set1_epi8(needle[i2]); // and byte i2
+    const __m256i f1 = _mm256_set1_epi8(fold_bit(needle[i1], fold)); // case bit OR'ed into haystack bytes first
+    const __m256i f2 = _mm256_set1_epi8(fold_bit(needle[i2], fold));
+    size_t cand = n - m + 1;                     // candidate starts [0, cand) not yet checked
+    for (; cand >= 64; cand -= 64) {             // the top 64 of them, two vectors per step
+        const char *h = hay + cand - 64;
+        __m256i eq0 = _mm256_and_si256(          // candidates 0..31
+            _mm256_cmpeq_epi8(_mm256_or_si256(_mm256_loadu_si256((const __m256i*)(h + i1)), f1), b1),
+            _mm256_cmpeq_epi8(_mm256_or_si256(_mm256_loadu_si256((const __m256i*)(h + i2)), f2), b2));
+        __m256i eq1 = _mm256_and_si256(          // candidates 32..63
+            _mm256_cmpeq_epi8(_mm256_or_si256(_mm256_loadu_si256((const __m256i*)(h + 32 + i1)), f1), b1),
+            _mm256_cmpeq_epi8(_mm256_or_si256(_mm256_loadu_si256((const __m256i*)(h + 32 + i2)), f2), b2));
+        __m256i any = _mm256_or_si256(eq0, eq1);
+        if (_mm256_testz_si256(any, any))
+            continue;                            // common case: no candidate at all
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(eq0)
+                      | (uint64_t)(uint32_t)_mm256_movemask_epi8(eq1) << 32;
+        while (mask) {                           // each candidate, highest first
+            int bit = 63 - __builtin_clzll(mask);
+            if (fold_eq(h + bit, needle, m, fold))
+                return h + bit;                  // verified
+            mask &= ~(1ull << bit);              // drop this candidate
+        }
+    }
+    return find_last_pair_sse2(hay, cand + m - 1, needle, m, i1, i2, fold); // head shorter than a vector
+}
+
+/* CPU feature, checked once (search threads share it) */
+static bool cpu_has_avx2(void) {
+    static atomic_int has_avx2 = -1;
+    if (has_avx2 < 0) has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    return has_avx2 == 1;
+}
+#endif
+
+/* First occurrence of needle[0..m) (m >= 1) in hay[0..n), filtering on needle bytes i1 and i2 */
+static const char *find_pair(const char *hay, size_t n, const char *needle, size_t m, size_t i1, size_t i2,
+                             FoldKind fold) {
+    if (m > n) return NULL;                      // cannot fit
+#if defined(__x86_64__) && defined(__GNUC__)
+    return cpu_has_avx2() ? find_pair_avx2(hay, n, needle, m, i1, i2, fold)
+                          : find_pair_sse2(hay, n, needle, m, i1, i2, fold);
+#else
+    return find_pair_scalar(hay, n, needle, m, i1, i2, fold);
+#endif
+}
+
+/* Last occurrence of needle[0..m) (m >= 1) in hay[0..n); m = 1 with i1 = i2 = 0 is a vector memrchr */
+static const char *find_last_pair(const char *hay, size_t n, const char *needle, size_t m, size_t i1, size_t i2,
+                                  FoldKind fold) {
+    if (m > n) return NULL;                      // cannot fit
+#if defined(__x86_64__) && defined(__GNUC__)
+    return cpu_has_avx2() ? find_last_pair_avx2(hay, n, needle, m, i1, i2, fold)
+                          : find_last_pair_sse2(hay, n, needle, m, i1, i2, fold);
+#else
+    return find_last_pair_scalar(hay, n, needle, m, i1, i2, fold);
+#endif
+}
+
+/* First occurrence of needle[0..m) in hay[0..n), or NULL. Length-aware: NULs are ordinary bytes. */
+static const char *find_bytes(const char *hay, size_t n, const char *needle, size_t m) {
+    if (m == 0) return hay;                      // empty needle matches at once
+    if (m > n) return NULL;                      // cannot fit
+    if (m == 1) return (const char*)memchr(hay, needle[0], n); // libc is already vectorized
+    return find_pair(hay, n, needle, m, 0, m - 1, FOLD_NONE); // first/last byte filter
+}
+
+/*
+ * How common byte c is in typical text and source code; higher = more common.
+ * Only the order matters: a plan filters on the needle's two rarest bytes.
+ */
+static int byte_rank(unsigned char c) {
+    static const char common[] = " etaoinsrhldcu\n\tmpfgwyb.,_;()=v-k\"/'x0>1*<:{}2jq[]z"; // most common first
+    const char *p = memchr(common, c, sizeof(common) - 1);
+    if (p) return 255 - (int)(p - common);       // listed: by position
+    if (isupper(c)) return 150;                  // capitals: less common than lower case
+    if (isdigit(c) || ispunct(c)) return 120;    // other digits and punctuation
+    if (c >= 0x80) return 60;                    // UTF-8 bytes: rare in most files
+    return 10;                                   // control bytes: very rare
+}
+
+/*
+ * 12-bit hash of the 4 bytes at p (Horspool table key). Folding first ORs the
+ * case bit into ASCII bytes and turns every non-ASCII byte into 0x80, so all
+ * case variants of a group (which keep their byte lengths) share one key.
+ */
+static unsigned gram4_hash(const char *p, bool fold) {
+    uint32_t v;
+    memcpy(&v, p, 4);                            // unaligned load
+    if (fold) {
+        uint32_t hi = v & 0x80808080u;           // non-ASCII bytes
+        v = ((v | 0x20202020u) & ~((hi >> 7) * 0xFFu)) | hi;
+    }
+    return (v * 2654435761u) >> 20;              // multiplicative hash, top 12 bits (table stays in L1)
+}
+
+/* Compile a query into a plan (kept until the query changes); 'fold' says how it ignores case */
+static void plan_compile(SearchPlan *pl, const char *q, size_t m, FoldKind fold) {
+    if (m > sizeof(pl->needle)) m = sizeof(pl->needle); // queries are prompt-sized
+    memcpy(pl->query, q, m);
+    memcpy(pl->needle, q, m);
+    size_t multi = SIZE_MAX;                     // offset of the first multi-byte character
+    for (size_t i = 0; fold != FOLD_NONE && i < m; ) { // lower-case needle: same length as the query
+        int cp, len = utf8_decode(q + i, (int)(m - i), &cp);
+        if (len > 1) utf8_encode(cp_fold(cp), pl->needle + i);
+        else if (cp < 0x80) pl->needle[i] = (char)cp_fold(cp); // malformed bytes stay as they are
+        if (len > 1 && multi == SIZE_MAX) multi = i;
+        i += len;
+    }
+    if (fold == FOLD_UTF8 && multi == SIZE_MAX) fold = FOLD_ASCII; // only malformed non-ASCII bytes: compared as they are
+    const char *nd = pl->needle;
+    pl->m = m;
+    pl->fold = fold;
+    pl->valid = true;
+    if (m >= HORSPOOL_MIN) {                     // long: skip ahead, usually by ~m bytes
+        pl->kind = PLAN_HORSPOOL;                // keyed on 4-byte groups: single letters and pairs recur too often
+        bool f = fold != FOLD_NONE;
+        memset(pl->shift, (int)(m - 3), sizeof(pl->shift)); // group not in needle: jump past it
+        for (size_t i = 3; i + 1 < m; i++)       // later (smaller) jumps overwrite: collisions stay safe
+            pl->shift[gram4_hash(nd + i - 3, f)] = (uint8_t)(m - 1 - i);
+        memset(pl->rshift, (int)(m - 3), sizeof(pl->rshift)); // the same, mirrored, for backward scans
+        for (size_t j = m - 4; j >= 1; j--)      // group at needle offset j: move left by j
+            pl->rshift[gram4_hash(nd + j, f)] = (uint8_t)j;
+        return;
+    }
+    pl->kind = PLAN_PAIR;                        // short: vector filter on the two rarest bytes
+    size_t r1 = SIZE_MAX, r2 = SIZE_MAX;         // rarest, second rarest
+    for (size_t i = 0; i < m; i++) {
+        if (fold == FOLD_UTF8 && (unsigned char)nd[i] >= 0x80) continue; // its byte may differ between cases
+        int r = byte_rank(nd[i]);
+        if (r1 == SIZE_MAX || r < byte_rank(nd[r1])) { r2 = r1; r1 = i; }
+        else if (r2 == SIZE_MAX || r < byte_rank(nd[r2]) || nd[r2] == nd[r1]) r2 = i; // a distinct second byte filters more
+    }
+    if (r1 == SIZE_MAX) {                        // no byte to filter on: the first character's cases instead
+        pl->kind = PLAN_SCAN;
+        int cp, v[4];
+        utf8_decode(nd + multi, (int)(m - multi), &cp); // folded, and at least 2 bytes long
+        pl->lead_at = multi;
+        pl->nlead = cp_case_variants(cp, v);
+        for (int k = 0; k < pl->nlead; k++) {
+            char b[4];
+            utf8_encode(v[k], b);
+            memcpy(pl->lead[k], b, 2);
+        }
+        return;
+    }
+    if (r2 == SIZE_MAX) r2 = r1;                 // only one: filter on it twice
+    pl->i1 = r1 < r2 ? r1 : r2;                  // keep the loads in ascending order
+    pl->i2 = r1 < r2 ? r2 : r1;
+}
+
+/* Horspool on 4-byte groups: hash the group under the needle's end, jump by its table entry */
+static const char *find_horspool(const SearchPlan *pl, const char *hay, size_t n) {
+    size_t m = pl->m;                            // needle length
+    bool f = pl->fold != FOLD_NONE;              // hash groups folded
+    unsigned tail = gram4_hash(pl->needle + m - 4, f); // final group
+    for (size_t i = 0; i + m <= n; ) {
+        unsigned key = gram4_hash(hay + i + m - 4, f); // group under the needle's end
+        if (key == tail && fold_eq(hay + i, pl->needle, m, pl->fold))
+            return hay + i;                      // verified
+        i += key == tail ? 1 : pl->shift[key];   // final group: its entry may be a later collision, step one
+    }
+    return NULL;
+}
+
+/* Horspool backwards: hash the group under the needle's start, jump left by its table entry */
+static const char *find_last_horspool(const SearchPlan *pl, const char *hay, size_t n) {
+    size_t m = pl->m;                            // needle length
+    bool f = pl->fold != FOLD_NONE;              // hash groups folded
+    unsigned head = gram4_hash(pl->needle, f);   // first group
+    for (size_t i = n - m; ; ) {                 // candidate start, moving left
+        unsigned key = gram4_hash(hay + i, f);   // group under the needle's start
+        if (key == head && fold_eq(hay + i, pl->needle, m, pl->fold))
+            return hay + i;                      // verified
+        size_t step = key == head ? 1 : pl->rshift[key]; // first group: its entry may be a collision, step one
+        if (i < step) return NULL;               // ran off the front
+        i -= step;
+    }
+}
+
+/*
+ * PLAN_SCAN, the slow path: a needle made only of non-ASCII characters. Its
+ * first multi-byte character is filtered on by its first two bytes, in each
+ * of its cases, a vector at a time; candidates are verified character by
+ * character.
+ */
+static bool scan_lead_at(const SearchPlan *pl, const char *s) {
+    s += pl->lead_at;                            // where that character sits in a candidate
+    for (int k = 0; k < pl->nlead; k++)
+        if (s[0] == pl->lead[k][0] && s[1] == pl->lead[k][1]) return true;
+    return false;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+/* Bit i set where a case of the first character starts at s + i (16 positions; reads s[0..17)) */
+static unsigned scan_lead_mask(const __m128i *l0, const __m128i *l1, int nlead, const char *s) {
+    __m128i a = _mm_loadu_si128((const __m128i*)s);     // first bytes of 16 candidates
+    __m128i b = _mm_loadu_si128((const __m128i*)(s + 1)); // their second bytes
+    __m128i eq = _mm_setzero_si128();
+    for (int k = 0; k < nlead; k++)
+        eq = _mm_or_si128(eq, _mm_and_si128(_mm_cmpeq_epi8(a, l0[k]), _mm_cmpeq_epi8(b, l1[k])));
+    return (unsigned)_mm_movemask_epi8(eq);
+}
+
+/* The AVX2 scans, 32 candidates a step: forward from *at (left where they stopped), or backward down from *at */
+__attribute__((target("avx2")))
+static const char *fold_scan_avx2(const SearchPlan *pl, const char *hay, size_t n, size_t *at, bool backward) {
+    __m256i l0[4], l1[4];                        // lead bytes in every lane
+    for (int k = 0; k < pl->nlead; k++) { l0[k] = _mm256_set1_epi8(pl->lead[k][0]); l1[k] = _mm256_set1_epi8(pl->lead[k][1]); }
+    size_t m = pl->m;
+    while (backward ? *at >= 32 : *at + m - 1 + 32 <= n) {
+        size_t i = backward ? *at - 32 : *at;    // block of candidate starts
+        const char *s = hay + i + pl->lead_at;
+        __m256i a = _mm256_loadu_si256((const __m256i*)s), b = _mm256_loadu_si256((const __m256i*)(s + 1));
+        __m256i eq = _mm256_setzero_si256();
+        for (int k = 0; k < pl->nlead; k++)
+            eq = _mm256_or_si256(eq, _mm256_and_si256(_mm256_cmpeq_epi8(a, l0[k]), _mm256_cmpeq_epi8(b, l1[k])));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(eq);
+        while (mask) {                           // each candidate, in scan order
+            int bit = backward ? 31 - __builtin_clz(mask) : __builtin_ctz(mask);
+            if (utf8_fold_eq(hay + i + bit, pl->needle, m))
+                return hay + i + bit;            // verified
+            mask &= ~(1u << bit);
+        }
+        *at = backward ? i : i + 32;
+    }
+    return NULL;
+}
+#endif
+
+static const char *find_fold_scan(const SearchPlan *pl, const char *hay, size_t n) {
+    size_t m = pl->m, i = 0;                     // m >= 2
+#if defined(__x86_64__) && defined(__GNUC__)
+    const char *p = cpu_has_avx2() ? fold_scan_avx2(pl, hay, n, &i, false) : NULL;
+    if (p) return p;
+    __m128i l0[4], l1[4];                        // lead bytes in every lane
+    for (int k = 0; k < pl->nlead; k++) { l0[k] = _mm_set1_epi8(pl->lead[k][0]); l1[k] = _mm_set1_epi8(pl->lead[k][1]); }
+    for (; i + m - 1 + 16 <= n; i += 16) {       // candidates can be verified without running off
+        unsigned mask = scan_lead_mask(l0, l1, pl->nlead, hay + i + pl->lead_at);
+        while (mask) {                           // each candidate, lowest first
+            int bit = __builtin_ctz(mask);
+            if (utf8_fold_eq(hay + i + bit, pl->needle, m))
+                return hay + i + bit;            // verified
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i + m <= n; i++)                      // tail (or no vectors)
+        if (scan_lead_at(pl, hay + i) && utf8_fold_eq(hay + i, pl->needle, m))
+            return hay + i;
+    return NULL;
+}
+
+/* PLAN_SCAN backwards: blocks from the end down, highest candidate first */
+static const char *find_last_fold_scan(const SearchPlan *pl, const char *hay, size_t n) {
+    size_t m = pl->m, cand = n - m + 1;          // candidate starts [0, cand) not yet checked (caller checked m <= n)
+#if defined(__x86_64__) && defined(__GNUC__)
+    const char *p = cpu_has_avx2() ? fold_scan_avx2(pl, hay, n, &cand, true) : NULL;
+    if (p) return p;
+    __m128i l0[4], l1[4];                        // lead bytes in every lane
+    for (int k = 0; k < pl->nlead; k++) { l0[k] = _mm_set1_epi8(pl->lead[k][0]); l1[k] = _mm_set1_epi8(pl->lead[k][1]); }
+    for (; cand >= 16; cand -= 16) {             // the top 16 of them
+        size_t i = cand - 16;
+        unsigned mask = scan_lead_mask(l0, l1, pl->nlead, hay + i + pl->lead_at);
+        while (mask) {                           // each candidate, highest first
+            int bit = 31 - __builtin_clz(mask);
+            if (utf8_fold_eq(hay + i + bit, pl->needle, m))
+                return hay + i + bit;            // verified
+            mask &= ~(1u << bit);
+        }
+    }
+#endif
+    while (cand-- > 0)                           // head (or no vectors)
+        if (scan_lead_at(pl, hay + cand) && utf8_fold_eq(hay + cand, pl->needle, m))
+            return hay + cand;
+    return NULL;
+}
+
+/* Run a compiled plan over hay[0..n) */
+static const char *plan_find(const SearchPlan *pl, const char *hay, size_t n) {
+    if (pl->m > n) return NULL;                  // cannot fit
+    if (pl->m == 0 || (pl->m == 1 && pl->fold == FOLD_NONE))
+        return find_bytes(hay, n, pl->needle, pl->m); // empty or single byte: memchr
+    if (pl->kind == PLAN_HORSPOOL) return find_horspool(pl, hay, n);
+    if (pl->kind == PLAN_SCAN) return find_fold_scan(pl, hay, n);
+    return find_pair(hay, n, pl->needle, pl->m, pl->i1, pl->i2, pl->fold);
+}
+
+/* Last occurrence of a compiled plan in hay[0..n) */
+static const char *plan_find_last(const SearchPlan *pl, const char *hay, size_t n) {
+    if (pl->m > n) return NULL;                  // cannot fit
+    if (pl->m == 0) return hay + n;              // empty: matches at the end
+    if (pl->kind == PLAN_HORSPOOL) return find_last_horspool(pl, hay, n);
+    if (pl->kind == PLAN_SCAN) return find_last_fold_scan(pl, hay, n);
+    return find_last_pair(hay, n, pl->needle, pl->m, pl->i1, pl->i2, pl->fold); // m = 1: vector memrchr
+}
+
+/*
+ * How query q treats case under the current mode: smart case ignores it
+ * unless q has an upper-case letter. Ignoring case folds ASCII letters only
+ * when q is plain ASCII, and UTF-8 letters too otherwise.
+ */
+static FoldKind query_fold(const char *q, bool regex) {
+    if (search_case == CASE_SENSITIVE) return FOLD_NONE;
+    bool ascii = true;                           // no byte above 0x7F so far
+    for (const char *p = q; *p; ) {
+        if (regex && *p == '\\' && p[1]) { p += 2; continue; } // \W \S \D are classes, not letters
+        int cp, len = utf8_decode(p, (int)strlen(p), &cp);
+        if (search_case == CASE_SMART && cp_fold(cp) != cp) return FOLD_NONE; // upper case: match exactly
+        if (len > 1) ascii = false;              // malformed bytes have no case
+        p += len;
+    }
+    return ascii ? FOLD_ASCII : FOLD_UTF8;
+}
+
+/* Plan for the current query, recompiled only when the query text or its case folding changed */
+static const SearchPlan *plan_for(const char *q) {
+    size_t m = strlen(q);                        // query length
+    FoldKind fold = query_fold(q, false);        // under the current case mode
+    if (!qplan.valid || qplan.m != m || qplan.fold != fold || memcmp(qplan.query, q, m) != 0)
+        plan_compile(&qplan, q, m, fold);        // new query
+    return &qplan;
+}
+
+/* Bring the flat copy of the buffer up to date (no-op if nothing changed) */
+static void search_text_sync(void) {
+    if (stext.valid && stext.gen == text_gen) return; // still matches the buffer
+    size_t total = 0;                            // bytes needed
+    for (int r = 0; r < buf.count; r++)
+        total += (size_t)buf.len[r] + 1;         // line + '\n'
+    if (total > stext.cap) {                     // grow text storage
+        stext.cap = total * 2;
+        stext.text = (char*)realloc(stext.text, stext.cap);
+    }
+    if (buf.count + 1 > stext.lines_cap) {       // grow line table
+        stext.lines_cap = (buf.count + 1) * 2;
+        stext.line_start = (size_t*)realloc(stext.line_start, stext.lines_cap * sizeof(size_t));
+    }
+    size_t off = 0;                              // write position
+    for (int r = 0; r < buf.count; r++) {        // one memcpy per line
+        stext.line_start[r] = off;
+        memcpy(stext.text + off, buf.lines[r], buf.len[r]);
+        off += buf.len[r];
+        stext.text[off++] = '\n';                // separator (a query never contains one)
+    }
+    stext.line_start[buf.count] = off;           // end sentinel
+    stext.len = off ? off - 1 : 0;               // no separator after the last line
+    stext.gen = text_gen;
+    stext.valid = true;
+}
+
+/* Line containing flat offset 'off' */
+static int search_text_row(size_t off) {
+    int lo = 0, hi = buf.count - 1;              // binary search over line starts
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (stext.line_start[mid] <= off) lo = mid; // line 'mid' starts at or before off
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+/* Synthetic text for the benchmarks: n bytes of words and lines, the same every run */
+static char *bench_text(size_t n) {
+    char *hay = (char*)malloc(n);
+    const char *letters = "etaoinsrhldcumfpgwybvkxjqz"; // English-like: early letters more often
+    unsigned x = 12345;                          // tiny LCG, reproducible
+    for (size_t i = 0; i < n; i++) {
+        x = x * 1103515245u + 12345u;
+        unsigned r = (x >> 16) & 255;
+        unsigned li = (r * r) / 2520;            // 0..25, skewed towards 0
+        hay[i] = r < 32 ? ' ' : r == 32 ? '\n' : letters[li];
+    }
+    hay[n - 1] = '\n';                           // last line is terminated too
+    return hay;
+}
+
+/* Throughput check: editor --bench-search [MB] */
+static int search_bench(int mb) {
+    if (mb <= 0) mb = 64;                        // default haystack size
+    size_t n = (size_t)mb << 20;                 // bytes
+    char *hay = bench_text(n);                   // synthetic text: words and lines
+    char *lines = (char*)malloc(n);              // same text as NUL-terminated lines
+    for (size_t i = 0; i < n; i++)
+        lines[i] = hay[i] == '\n' ? '\0' : hay[i];
+    const char *needles[] = {                    // a digit or punctuation each: absent in every case mode, full scans
+        "X9", "the editor!", "quick jukebox?",
+        "synchronized output mode for terminal frames.",
+        "synchronized output mode for terminal frames, so that a large frame never tears halfway "
+        "down the screen while the terminal is still receiving the rest of it", // >= HORSPOOL_MIN
+
+    };
+    printf("%-46s %12s %12s %12s %12s %16s\n", "query (length)", "first/last", "plan", "ignore case", "backwards",
+           "per-line strstr");
+    for (size_t k = 0; k < sizeof(needles) / sizeof(needles[0]); k++) {
+        const char *q = needles[k];
+        size_t m = strlen(q);
+        static SearchPlan pl, fpl;               // compiled query, and the same ignoring case
+        plan_compile(&pl, q, m, FOLD_NONE);
+        plan_compile(&fpl, q, m, FOLD_ASCII);
+        long best[5] = { LONG_MAX, LONG_MAX, LONG_MAX, LONG_MAX, LONG_MAX }; // best of a few runs, in us
+        const char *res[5] = { NULL, NULL, NULL, NULL, NULL }; // results (all must agree)
+        for (int run = 0; run < 5; run++) {
+            long t0 = monotonic_us();
+            res[0] = find_bytes(hay, n, q, m);   // first/last byte filter over the whole block
+            long t1 = monotonic_us();
+            res[1] = plan_find(&pl, hay, n);     // compiled plan
+            long t2 = monotonic_us();
+            res[2] = NULL;                       // old editor: strstr line by line
+            for (const char *l = lines; l < lines + n && !res[2]; l += strlen(l) + 1)
+                res[2] = strstr(l, q);
+            long t3 = monotonic_us();
+            res[3] = plan_find_last(&pl, hay, n); // the same plan, scanning backwards
+            long t4 = monotonic_us();
+            res[4] = plan_find(&fpl, hay, n);    // folding case in the vector registers
+            long t5 = monotonic_us();
+            long t[5] = { t1 - t0, t2 - t1, t5 - t4, t4 - t3, t3 - t2 };
+            for (int j = 0; j < 5; j++)
+                if (t[j] < best[j]) best[j] = t[j];
+        }
+        bool agree = (res[0] == res[1]) && ((res[0] == NULL) == (res[2] == NULL)) && ((res[0] == NULL) == (res[3] == NULL))
+                     && ((res[0] == NULL) == (res[4] == NULL));
+        printf("%-40.40s (%3zu) %7.2f GB/s %7.2f GB/s %7.2f GB/s %7.2f GB/s %11.2f GB/s  %s\n", q, m,
+               (double)n / 1e3 / (best[0] + 1), (double)n / 1e3 / (best[1] + 1), (double)n / 1e3 / (best[2] + 1),
+               (double)n / 1e3 / (best[3] + 1), (double)n / 1e3 / (best[4] + 1), agree ? "agree" : "DISAGREE");
+    }
+    free(lines);
+    free(hay);
+    return 0;
+}
+
+/* ----------------------- Regex ----------------------- */
+/*
+ * Syntax: literal bytes, . (one UTF-8 character), classes [abc] [a-z] [^...]
+ * (with \d \w \s inside), escapes \d \D \w \W \s \S \t and \<punctuation>,
+ * groups ( ), alternation |, repetition * + ? {n} {n,} {n,m}, and the line
+ * anchors ^ $. Nothing matches a line break. Ignoring case (icase), letters
+ * match either case: ASCII ones anywhere, and UTF-8 letters that cp_fold
+ * pairs up. Classes and \w \D \S take non-ASCII characters whole: a member
+ * or range like [Ф] or [а-я] is a code point, and [^a] or \w reads a whole
+ * UTF-8 sequence, never a lone byte of one.
+ *
+ * A pattern is parsed into a tree and compiled twice into a Thompson NFA: once
+ * reading forward, once reading backward. Both run as DFAs built lazily: a DFA
+ * state is the set of NFA states the input can be in, created the first time a
+ * scan needs it and cached (at most RX_DFA_STATES per direction; the cache is
+ * flushed when full). A byte then costs one table lookup, or one NFA step when
+ * the transition is new, so scans are linear whatever the pattern: no
+ * backtracking. Bytes that no part of the pattern tells apart share a byte
+ * class, which keeps DFA rows short. Line start and end are two extra,
+ * zero-width input symbols; that is how ^ and $ work.
+ *
+ * Finding a match takes three scans: forward with an implicit leading .* to
+ * the end of the first match, backward over that line for the leftmost start,
+ * and forward anchored at that start for the longest end.
+ */
+
+static bool set_has(const uint32_t *s, int c) { return (s[c >> 5] >> (c & 31)) & 1; }
+static void set_add(uint32_t *s, int c)      { s[c >> 5] |= 1u << (c & 31); }
+static void set_add_range(uint32_t *s, int lo, int hi) { for (int c = lo; c <= hi; c++) set_add(s, c); }
+
+/* New tree node */
+static int rx_node(Regex *re, RxKind kind, int a, int b) {
+    if (re->nnode == re->node_cap) {             // grow node array
+        re->node_cap = re->node_cap ? re->node_cap * 2 : 32;
+        re->node = (RxNode*)realloc(re->node, re->node_cap * sizeof(RxNode));
+    }
+    re->node[re->nnode] = (RxNode){ kind, a, b, 0, 0, -1 };
+    return re->nnode++;
+}
+
+/* New empty byte set; returns its index */
+static int rx_set_new(Regex *re) {
+    if (re->nset == re->set_cap) {               // grow set array
+        re->set_cap = re->set_cap ? re->set_cap * 2 : 16;
+        re->set = (uint32_t(*)[8])realloc(re->set, re->set_cap * sizeof(*re->set));
+    }
+    memset(re->set[re->nset], 0, sizeof(re->set[0]));
+    return re->nset++;
+}
+
+/* Node matching one byte from set 'si' */
+static int rx_set_node(Regex *re, int si) {
+    int n = rx_node(re, RX_SET, -1, -1);
+    re->node[n].set = si;
+    return n;
+}
+
+/* Add the bytes of escape class \d \w \s (upper case = negated) to set 'si'; false if 'e' is none of them */
+static bool rx_escape_class(Regex *re, int si, char e) {
+    uint32_t tmp[8] = {0};                       // the positive class
+    switch (e) {
+        case 'd': case 'D': set_add_range(tmp, '0', '9'); break;
+        case 'w': case 'W': set_add_range(tmp, 'a', 'z'); set_add_range(tmp, 'A', 'Z');
+                            set_add_range(tmp, '0', '9'); set_add(tmp, '_');
+                            set_add_range(tmp, 0x80, 0xFF); break; // UTF-8 letters count as word bytes
+        case 's': case 'S': set_add(tmp, ' '); set_add(tmp, '\t'); set_add(tmp, '\r');
+                            set_add(tmp, '\f'); set_add(tmp, '\v'); break;
+        default: return false;
+    }
+    bool neg = isupper((unsigned char)e);        // \D \W \S
+    for (int c = 0; c < 256; c++)
+        if (set_has(tmp, c) != neg && c != '\n')
+            set_add(re->set[si], c);
+    return true;
+}
+
+/* Byte meant by escape \e outside the class letters */
+static int rx_escape_byte(char e) {
+    switch (e) {
+        case 't': return '\t';
+        case 'r': return '\r';
+        case 'f': return '\f';
+        case 'v': return '\v';
+        default:  return (unsigned char)e;       // \. \* \\ ... stand for themselves
+    }
+}
+
+/* Under icase, add the other case of every ASCII letter in set 'si' */
+static void rx_fold_set(Regex *re, int si) {
+    if (!re->icase) return;
+    for (int c = 'a'; c <= 'z'; c++)
+        if (set_has(re->set[si], c) || set_has(re->set[si], c - 32)) {
+            set_add(re->set[si], c);
+            set_add(re->set[si], c - 32);
+        }
+}
+
+/* Code point cp in any of its cases: one byte sequence per case, as alternatives */
+static int rx_char_cases(Regex *re, int cp) {
+    int v[4], nv = cp_case_variants(cp_fold(cp), v); // every case of cp
+    int alt = -1;
+    for (int k = 0; k < nv; k++) {
+        char b[4];
+        int bl = utf8_encode(v[k], b), seq = -1;
+        for (int j = 0; j < bl; j++) {           // its bytes in order
+            int si = rx_set_new(re);
+            set_add(re->set[si], (unsigned char)b[j]);
+            int n = rx_set_node(re, si);
+            seq = seq < 0 ? n : rx_node(re, RX_CAT, seq, n);
+        }
+        alt = alt < 0 ? seq : rx_node(re, RX_ALT, alt, seq);
+    }
+    return alt;
+}
+
+/* '.': any single byte but '\n', or a whole UTF-8 sequence */
+static int rx_dot(Regex *re) {
+    int any = rx_set_new(re);                    // one byte
+    set_add_range(re->set[any], 0, 255);
+    re->set[any]['\n' >> 5] &= ~(1u << ('\n' & 31));
+    int cs = rx_set_new(re);                     // continuation byte
+    set_add_range(re->set[cs], 0x80, 0xBF);
+    int l2 = rx_set_new(re), l3 = rx_set_new(re), l4 = rx_set_new(re); // lead bytes
+    set_add_range(re->set[l2], 0xC0, 0xDF);
+    set_add_range(re->set[l3], 0xE0, 0xEF);
+    set_add_range(re->set[l4], 0xF0, 0xF7);
+    int cont = rx_set_node(re, cs);              // shared subtree
+    int two   = rx_node(re, RX_CAT, rx_set_node(re, l2), cont);
+    int three = rx_node(re, RX_CAT, rx_set_node(re, l3), rx_node(re, RX_CAT, cont, cont));
+    int four  = rx_node(re, RX_CAT, rx_set_node(re, l4),
+                        rx_node(re, RX_CAT, cont, rx_node(re, RX_CAT, cont, cont)));
+    return rx_node(re, RX_ALT, rx_set_node(re, any),
+                   rx_node(re, RX_ALT, two, rx_node(re, RX_ALT, three, four)));
+}
+
+/* Code points lo..hi (0x80 <= lo <= hi) as UTF-8: alternatives of byte range sequences */
+static int rx_utf8_range(Regex *re, int lo, int hi) {
+    static const int last[2] = { 0x7FF, 0xFFFF }; // last code point with 2 and 3 bytes
+    for (int k = 0; k < 2; k++)                  // different lengths: one range per length
+        if (lo <= last[k] && hi > last[k])
+            return rx_node(re, RX_ALT, rx_utf8_range(re, lo, last[k]), rx_utf8_range(re, last[k] + 1, hi));
+    char a[4], b[4];
+    int len = utf8_encode(lo, a);
+    utf8_encode(hi, b);
+    for (int i = 1; i < len; i++) {              // split until every byte after a differing one runs 80..BF
+        int m = (1 << (6 * i)) - 1;              // bits of the last i bytes
+        if ((lo & ~m) == (hi & ~m)) continue;
+        if (lo & m)
+            return rx_node(re, RX_ALT, rx_utf8_range(re, lo, lo | m), rx_utf8_range(re, (lo | m) + 1, hi));
+        if ((hi & m) != m)
+            return rx_node(re, RX_ALT, rx_utf8_range(re, lo, (hi & ~m) - 1), rx_utf8_range(re, hi & ~m, hi));
+    }
+    int seq = -1;
+    for (int j = 0; j < len; j++) {              // byte j runs a[j]..b[j]
+        int si = rx_set_new(re);
+        set_add_range(re->set[si], (unsigned char)a[j], (unsigned char)b[j]);
+        int n = rx_set_node(re, si);
+        seq = seq < 0 ? n : rx_node(re, RX_CAT, seq, n);
+    }
+    return seq;
+}
+
+/* Add code points lo..hi to the class being parsed: ASCII ones to set 'si', the rest to re->cr */
+static void rx_class_add(Regex *re, int si, int lo, int hi) {
+    if (lo < 0x80) {
+        set_add_range(re->set[si], lo, hi < 0x80 ? hi : 0x7F);
+        if (hi < 0x80) return;
+        lo = 0x80;
+    }
+    if (re->ncr == re->cr_cap) {
+        re->cr_cap = re->cr_cap ? re->cr_cap * 2 : 16;
+        re->cr = (int(*)[2])realloc(re->cr, re->cr_cap * sizeof(*re->cr));
+    }
+    re->cr[re->ncr][0] = lo;
+    re->cr[re->ncr][1] = hi;
+    re->ncr++;
+}
+
+static int range_cmp(const void *a, const void *b) {
+    const int *x = (const int*)a, *y = (const int*)b;
+    return x[0] < y[0] ? -1 : x[0] > y[0];
+}
+
+/*
+ * Node for a class: the ASCII bytes of set 'si' (any byte 0x80 or above in it
+ * stands for every non-ASCII character, as \w puts them there) and the code
+ * point ranges in re->cr, complemented if 'neg'. Under icase both get the
+ * other case of their letters first, so [^a] excludes A and [ф] takes Ф.
+ */
+static int rx_class_node(Regex *re, int si, bool neg) {
+    uint32_t *set = re->set[si];
+    if (set[4] | set[5] | set[6] | set[7]) rx_class_add(re, si, 0x80, 0x10FFFF); // the whole non-ASCII range
+    set[4] = set[5] = set[6] = set[7] = 0;
+    rx_fold_set(re, si);
+    if (re->icase) {                             // every case pair with one side in the class gets the other
+        int had = re->ncr;                       // members as written
+        for (int i = 0; i < (int)(sizeof(case_ranges) / sizeof(case_ranges[0])); i++) {
+            const CaseRange *r = &case_ranges[i];
+            if (r->hi < 0x80) continue;          // ASCII: rx_fold_set did it
+            for (int u = r->lo; u <= r->hi; u += r->step) {
+                int l = u + r->delta;            // u's lower case
+                for (int k = 0; k < had; k++) {
+                    bool has_u = u >= re->cr[k][0] && u <= re->cr[k][1];
+                    bool has_l = l >= re->cr[k][0] && l <= re->cr[k][1];
+                    if (has_u != has_l) { rx_class_add(re, si, has_u ? l : u, has_u ? l : u); break; }
+                }
+            }
+        }
+    }
+    qsort(re->cr, re->ncr, sizeof(*re->cr), range_cmp); // sorted, then overlapping ranges merged
+    int m = 0;
+    for (int k = 0; k < re->ncr; k++) {
+        if (m && re->cr[k][0] <= re->cr[m - 1][1] + 1) {
+            if (re->cr[k][1] > re->cr[m - 1][1]) re->cr[m - 1][1] = re->cr[k][1];
+        } else {
+            re->cr[m][0] = re->cr[k][0];
+            re->cr[m][1] = re->cr[k][1];
+            m++;
+        }
+    }
+    re->ncr = 0;                                 // the scratch is free for the next class
+    if (neg) {                                   // ASCII bytes not in it, then the code point gaps
+        for (int w = 0; w < 4; w++) set[w] = ~set[w];
+        if (m == re->cr_cap) {                   // m ranges leave up to m + 1 gaps
+            re->cr_cap = re->cr_cap ? re->cr_cap * 2 : 16;
+            re->cr = (int(*)[2])realloc(re->cr, re->cr_cap * sizeof(*re->cr));
+        }
+        int next = 0x80, gaps = 0;
+        for (int k = 0; k < m; k++) {            // in place: gaps <= k, range k is read first
+            int lo = re->cr[k][0], hi = re->cr[k][1];
+            if (lo > next) { re->cr[gaps][0] = next; re->cr[gaps][1] = lo - 1; gaps++; }
+            next = hi + 1;
+        }
+        if (next <= 0x10FFFF) { re->cr[gaps][0] = next; re->cr[gaps][1] = 0x10FFFF; gaps++; }
+        m = gaps;
+    }
+    set['\n' >> 5] &= ~(1u << ('\n' & 31));      // never a line break
+    int n = rx_set_node(re, si);                 // (an empty set matches nothing, as [^\s\S] should)
+    for (int k = 0; k < m; k++)
+        n = rx_node(re, RX_ALT, n, rx_utf8_range(re, re->cr[k][0], re->cr[k][1]));
+    return n;
+}
+
+/* One character of a class at *p, as a code point; -1 (with re->err set) if it is not valid UTF-8 */
+static int rx_class_char(Regex *re, const char **p) {
+    int cp, len = utf8_decode(*p, (int)strlen(*p), &cp);
+    if (cp == 0xFFFD && len == 1 && (unsigned char)**p >= 0x80) { re->err = "bad UTF-8 in []"; return -1; }
+    *p += len;
+    return cp;
+}
+
+/* [...] class; *p is just past '[' */
+static int rx_parse_class(Regex *re, const char **p) {
+    int si = rx_set_new(re);                     // ASCII members (non-ASCII ones go to re->cr)
+    re->ncr = 0;
+    bool neg = false;
+    if (**p == '^') { neg = true; (*p)++; }      // negated class
+    bool first = true;                           // ']' right after '[' is a literal
+    while (**p && (**p != ']' || first)) {
+        first = false;
+        int lo;                                  // code point (or range start)
+        if (**p == '\\' && (*p)[1]) {            // escape inside the class
+            char e = (*p)[1];
+            if (rx_escape_class(re, si, e)) { *p += 2; continue; } // \d \w \s ...
+            if ((unsigned char)e < 0x80) { lo = rx_escape_byte(e); *p += 2; }
+            else { (*p)++; if ((lo = rx_class_char(re, p)) < 0) return -1; } // \ before a character: itself
+        } else if ((lo = rx_class_char(re, p)) < 0) {
+            return -1;
+        }
+        int hi = lo;                             // range end
+        if (**p == '-' && (*p)[1] && (*p)[1] != ']') { // a-z
+            (*p)++;
+            if (**p == '\\' && (*p)[1] && (unsigned char)(*p)[1] < 0x80) {
+                hi = rx_escape_byte((*p)[1]);
+                *p += 2;
+            } else {
+                if (**p == '\\') (*p)++;
+                if ((hi = rx_class_char(re, p)) < 0) return -1;
+            }
+            if (hi < lo) { re->err = "bad range in []"; return -1; }
+        }
+        rx_class_add(re, si, lo, hi);
+    }
+    if (**p != ']') { re->err = "missing ]"; return -1; }
+    (*p)++;
+    return rx_class_node(re, si, neg);           // icase folding before the complement, so [^a] excludes A too
+}
+
+static int rx_parse_alt(Regex *re, const char **p);
+
+/* One atom: literal, ., class, group, anchor or escape */
+static int rx_parse_atom(Regex *re, const char **p) {
+    char c = *(*p)++;
+    switch (c) {
+        case '(': {
+            int n = rx_parse_alt(re, p);         // group
+            if (n < 0) return -1;
+            if (**p != ')') { re->err = "missing )"; return -1; }
+            (*p)++;
+            return n;
+        }
+        case '[': return rx_parse_class(re, p);
+        case '.': return rx_dot(re);
+        case '^': return rx_node(re, RX_BOL, -1, -1);
+        case '$': return rx_node(re, RX_EOL, -1, -1);
+        case '*': case '+': case '?': case '{':
+            re->err = "nothing to repeat";
+            return -1;
+        case '\\': {
+            if (!**p) { re->err = "trailing \\"; return -1; }
+            char e = *(*p)++;
+            int si = rx_set_new(re);
+            re->ncr = 0;
+            if (rx_escape_class(re, si, e))      // \d \w \s ...: non-ASCII characters whole
+                return rx_class_node(re, si, false);
+            set_add(re->set[si], rx_escape_byte(e)); // one byte
+            rx_fold_set(re, si);
+            return rx_set_node(re, si);
+        }
+        default: {
+            if ((unsigned char)c >= 0xC0) {      // UTF-8 character: one atom, so 日? repeats all of it
+                int cp, len = utf8_decode(*p - 1, (int)strlen(*p - 1), &cp);
+                if (len > 1) { *p += len - 1; return re->icase ? rx_char_cases(re, cp) : rx_utf8_range(re, cp, cp); }
+            }
+            int si = rx_set_new(re);             // literal byte
+            set_add(re->set[si], (unsigned char)c);
+            rx_fold_set(re, si);
+            return rx_set_node(re, si);
+        }
+    }
+}
+
+/* Read a decimal number for {n,m}; -1 if there is none */
+static int rx_number(const char **p) {
+    if (!isdigit((unsigned char)**p)) return -1;
+    int v = 0;
+    while (isdigit((unsigned char)**p)) {
+        if (v <= RX_MAX_REPEAT) v = v * 10 + (*(*p)++ - '0');
+        else (*p)++;                             // too big anyway: reported by the caller
+    }
+    return v;
+}
+
+/* Atom followed by any number of * + ? {..} */
+static int rx_parse_repeat(Regex *re, const char **p) {
+    int n = rx_parse_atom(re, p);
+    while (n >= 0 && (**p == '*' || **p == '+' || **p == '?' || **p == '{')) {
+        int min, max;                            // repetition bounds (max -1 = unbounded)
+        char c = *(*p)++;
+        if (c == '*')      { min = 0; max = -1; }
+        else if (c == '+') { min = 1; max = -1; }
+        else if (c == '?') { min = 0; max = 1; }
+        else {                                   // {n} {n,} {n,m}
+            min = rx_number(p);
+            max = min;
+            if (**p == ',') { (*p)++; max = rx_number(p); }
+            if (min < 0 || **p != '}') { re->err = "bad {n,m}"; return -1; }
+            (*p)++;
+            if (max >= 0 && max < min) { re->err = "bad {n,m}"; return -1; }
+            if (min > RX_MAX_REPEAT || max > RX_MAX_REPEAT) { re->err = "repeat count too big"; return -1; }
+        }
+        int r = rx_node(re, RX_REPEAT, n, -1);
+        re->node[r].min = min;
+        re->node[r].max = max;
+        n = r;
+    }
+    return n;
+}
+
+/* Sequence of repeats, up to | or ) */
+static int rx_parse_cat(Regex *re, const char **p) {
+    int n = -1;                                  // nothing yet
+    while (**p && **p != '|' && **p != ')') {
+        int r = rx_parse_repeat(re, p);
+        if (r < 0) return -1;
+        n = n < 0 ? r : rx_node(re, RX_CAT, n, r);
+    }
+    return n < 0 ? rx_node(re, RX_EMPTY, -1, -1) : n;
+}
+
+/* Alternatives separated by | */
+static int rx_parse_alt(Regex *re, const char **p) {
+    int n = rx_parse_cat(re, p);
+    while (n >= 0 && **p == '|') {
+        (*p)++;
+        int r = rx_parse_cat(re, p);
+        if (r < 0) return -1;
+        n = rx_node(re, RX_ALT, n, r);
+    }
+    return n;
+}
+
+/* New NFA state in direction 'dir' */
+static int nfa_add(Regex *re, int dir, NOp op, int set, int out, int out1) {
+    if (re->nst[dir] >= RX_MAX_NFA) {            // pattern expands too much ({n,m} on big groups)
+        re->err = "pattern too large";
+        return out;
+    }
+    if (re->nst[dir] == re->st_cap[dir]) {       // grow state array
+        re->st_cap[dir] = re->st_cap[dir] ? re->st_cap[dir] * 2 : 64;
+        re->st[dir] = (NState*)realloc(re->st[dir], re->st_cap[dir] * sizeof(NState));
+    }
+    re->st[dir][re->nst[dir]] = (NState){ op, set, out, out1 };
+    return re->nst[dir]++;
+}
+
+/* Compile tree node into NFA states that continue at 'next'; returns the entry state.
+   dir 1 builds the NFA for reading backwards: sequences are reversed. */
+static int rx_compile(Regex *re, int dir, int node, int next) {
+    RxNode n = re->node[node];                   // copy: the node array does not move, but stay safe
+    switch (n.kind) {
+        case RX_SET:   return nfa_add(re, dir, N_SET, n.set, next, -1);
+        case RX_BOL:   return nfa_add(re, dir, N_BOL, -1, next, -1);
+        case RX_EOL:   return nfa_add(re, dir, N_EOL, -1, next, -1);
+        case RX_EMPTY: return next;
+        case RX_CAT:
+            if (dir == 0) return rx_compile(re, dir, n.a, rx_compile(re, dir, n.b, next));
+            return rx_compile(re, dir, n.b, rx_compile(re, dir, n.a, next));
+        case RX_ALT: {
+            int s1 = rx_compile(re, dir, n.a, next);
+            int s2 = rx_compile(re, dir, n.b, next);
+            return nfa_add(re, dir, N_SPLIT, -1, s1, s2);
+        }
+        case RX_REPEAT: {
+            int s = next;                        // built back to front
+            if (n.max < 0) {                     // unbounded tail: loop
+                int loop = nfa_add(re, dir, N_SPLIT, -1, -1, next);
+                if (re->err) return next;
+                int body = rx_compile(re, dir, n.a, loop);
+                re->st[dir][loop].out = body;
+                s = loop;
+            } else {
+                for (int i = n.min; i < n.max && !re->err; i++) // optional copies: x(x(x)?)?
+                    s = nfa_add(re, dir, N_SPLIT, -1, rx_compile(re, dir, n.a, s), next);
+            }
+            for (int i = 0; i < n.min && !re->err; i++) // required copies
+                s = rx_compile(re, dir, n.a, s);
+            return s;
+        }
+    }
+    return next;
+}
+
+/* Split the 256 byte values into classes no set tells apart */
+static void rx_byte_classes(Regex *re) {
+    memset(re->cls, 0, sizeof(re->cls));         // everything in one class
+    int k = 1;                                   // classes so far
+    for (int si = 0; si < re->nset; si++) {      // refine by each set
+        int remap[2][256];                       // (in set, old class) -> new class
+        memset(remap, -1, sizeof(remap));
+        int nk = 0;
+        for (int c = 0; c < 256; c++) {
+            int in = set_has(re->set[si], c);
+            int *slot = &remap[in][re->cls[c]];
+            if (*slot < 0) *slot = nk++;
+            re->cls[c] = (uint8_t)*slot;
+        }
+        k = nk;
+    }
+    for (int c = 255; c >= 0; c--) {             // a representative byte per class
+        re->cls_rep[re->cls[c]] = c;
+        re->cls_off[c] = re->cls[c] * (int)sizeof(int);
+    }
+    re->nbyte_cls = k;
+    re->ncls = k + 2;                            // + line start, line end
+}
+
+static void dfa_free(Dfa *d) {
+    free(d->sets); free(d->set_off); free(d->set_len);
+    free(d->trans); free(d->match); free(d->hash);
+    memset(d, 0, sizeof(*d));
+}
+
+static void rx_free(Regex *re) {
+    free(re->node); free(re->set);
+    for (int dir = 0; dir < 2; dir++) {
+        free(re->st[dir]);
+        dfa_free(&re->dfa[dir]);
+    }
+    free(re->mark); free(re->stack); free(re->seeds); free(re->tmp);
+    free(re->cr);
+    memset(re, 0, sizeof(*re));
+}
+
+/* Compile 'pat', letters matching either case if 'icase'; false (with re->err set) on a syntax error */
+static bool rx_compile_pattern(Regex *re, const char *pat, bool icase) {
+    rx_free(re);                                 // drop the previous pattern
+    re->icase = icase;
+    snprintf(re->src, sizeof(re->src), "%s", pat);
+    const char *p = pat;
+    int root = rx_parse_alt(re, &p);
+    if (root >= 0 && *p) re->err = "unmatched )"; // parse stopped early
+    if (re->err) return false;
+    int anyset = rx_set_new(re);                 // for the implicit leading .*
+    set_add_range(re->set[anyset], 0, 255);
+    for (int dir = 0; dir < 2; dir++) {
+        int match = nfa_add(re, dir, N_MATCH, -1, -1, -1);
+        re->start_anch[dir] = rx_compile(re, dir, root, match);
+        int any = nfa_add(re, dir, N_ANY, -1, -1, -1); // any byte
+        int split = nfa_add(re, dir, N_SPLIT, -1, re->start_anch[dir], any);
+        if (re->err) return false;               // too large
+        re->st[dir][any].out = split;           // loop back
+        re->start_unanch[dir] = split;
+    }
+    rx_byte_classes(re);
+    int most = re->nst[0] > re->nst[1] ? re->nst[0] : re->nst[1]; // scratch sizes
+    re->mark = (unsigned*)calloc(most, sizeof(unsigned));
+    re->stack = (int*)malloc(most * sizeof(int));
+    re->seeds = (int*)malloc(most * sizeof(int));
+    re->tmp = (int*)malloc(most * sizeof(int));
+    for (int dir = 0; dir < 2; dir++) {
+        Dfa *d = &re->dfa[dir];
+        d->trans = (int*)malloc((size_t)RX_DFA_STATES * re->ncls * sizeof(int));
+        d->match = (bool*)malloc(RX_DFA_STATES * sizeof(bool));
+        d->set_off = (int*)malloc(RX_DFA_STATES * sizeof(int));
+        d->set_len = (int*)malloc(RX_DFA_STATES * sizeof(int));
+        d->hash = (int*)calloc(RX_DFA_STATES * 2, sizeof(int));
+        d->start[0] = d->start[1] = -1;
+    }
+    re->valid = true;
+    return true;
+}
+
+/* Query q compiled into re under the current case mode, unless re already holds it; false if it does not parse */
+static bool rx_for(Regex *re, const char *q) {
+    bool icase = query_fold(q, true) != FOLD_NONE;
+    if (re->valid && re->icase == icase && strcmp(re->src, q) == 0) return true; // still current
+    return rx_compile_pattern(re, q, icase);
+}
+
+static int int_cmp(const void *a, const void *b) {
+    int x = *(const int*)a, y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Epsilon closure of seeds[0..n) in direction 'dir'; writes the states that
+ * read a byte, the unresolved anchors and the match state, sorted, to out.
+ * Anchors of kind 'pass' (N_BOL or N_EOL, or -1) hold here and are stepped over.
+ */
+static int rx_closure(Regex *re, int dir, const int *seeds, int n, int pass, int *out) {
+    NState *st = re->st[dir];
+    if (++re->stamp == 0) {                      // stamp wrapped: clear marks
+        memset(re->mark, 0, (re->nst[0] > re->nst[1] ? re->nst[0] : re->nst[1]) * sizeof(unsigned));
+        re->stamp = 1;
+    }
+    int sp = 0, cnt = 0;                         // stack depth, states written
+    for (int i = 0; i < n; i++) re->stack[sp++] = seeds[i];
+    while (sp > 0) {
+        int s = re->stack[--sp];
+        if (s < 0 || re->mark[s] == re->stamp) continue; // no state or already in
+        re->mark[s] = re->stamp;
+        if (st[s].op == N_SPLIT) {               // follow both ways
+            re->stack[sp++] = st[s].out1;
+            re->stack[sp++] = st[s].out;
+        } else if ((int)st[s].op == pass) {      // anchor that holds at this position
+            re->stack[sp++] = st[s].out;
+        } else {
+            out[cnt++] = s;                      // state that reads a symbol, or the match
+        }
+    }
+    qsort(out, cnt, sizeof(int), int_cmp);       // canonical order for the cache lookup
+    return cnt;
+}
+
+/* Forget every DFA state (cache full) */
+static void dfa_flush(Dfa *d) {
+    d->n = 0;
+    d->arena_len = 0;
+    memset(d->hash, 0, RX_DFA_STATES * 2 * sizeof(int));
+    d->start[0] = d->start[1] = -1;
+    d->flushes++;
+}
+
+/* DFA state for NFA state set set[0..n); created if new. The cache must have room. */
+static int dfa_intern(Regex *re, int dir, const int *set, int n) {
+    Dfa *d = &re->dfa[dir];
+    uint32_t h = 2166136261u;                    // FNV-1a over the state numbers
+    for (int i = 0; i < n; i++) h = (h ^ (uint32_t)set[i]) * 16777619u;
+    int mask = RX_DFA_STATES * 2 - 1;            // table size is a power of two
+    for (int slot = (int)(h & mask); ; slot = (slot + 1) & mask) {
+        int id = d->hash[slot] - 1;              // stored as index + 1
+        if (id < 0) {                            // free slot: new state
+            id = d->n++;
+            d->hash[slot] = id + 1;
+            if (d->arena_len + n > d->arena_cap) { // room for its NFA set
+                d->arena_cap = (d->arena_len + n) * 2;
+                d->sets = (int*)realloc(d->sets, d->arena_cap * sizeof(int));
+            }
+            memcpy(d->sets + d->arena_len, set, n * sizeof(int));
+            d->set_off[id] = d->arena_len;
+            d->set_len[id] = n;
+            d->arena_len += n;
+            d->match[id] = false;
+            for (int i = 0; i < n; i++)
+                if (re->st[dir][set[i]].op == N_MATCH) d->match[id] = true;
+            for (int c = 0; c < re->ncls; c++)   // no transitions known yet
+                d->trans[(size_t)id * re->ncls + c] = -1;
+            return id;
+        }
+        if (d->set_len[id] == n && memcmp(d->sets + d->set_off[id], set, n * sizeof(int)) == 0)
+            return id;                           // seen before
+    }
+}
+
+/*
+ * Scans refer to a DFA state by its code: the byte offset of its transition
+ * row, plus one if it is a match state. The hot loop then only adds the byte's
+ * class offset and loads (no multiply, no second lookup), and one bit test
+ * catches both "match" and "not built yet" (-1).
+ */
+static inline int dfa_code(Regex *re, int dir, int id) {
+    return (int)(id * re->ncls * sizeof(int)) | re->dfa[dir].match[id];
+}
+
+/* DFA state of a code */
+static inline int dfa_id(Regex *re, int e) { return (int)((e >> 2) / re->ncls); }
+
+/* Start state code: which = 0 anchored, 1 with the implicit leading .* */
+static int dfa_start(Regex *re, int dir, int which) {
+    Dfa *d = &re->dfa[dir];
+    if (d->start[which] < 0) {
+        if (d->n >= RX_DFA_STATES) dfa_flush(d); // make room
+        int seed = which ? re->start_unanch[dir] : re->start_anch[dir];
+        int n = rx_closure(re, dir, &seed, 1, -1, re->tmp);
+        d->start[which] = dfa_intern(re, dir, re->tmp, n);
+    }
+    return dfa_code(re, dir, d->start[which]);
+}
+
+/*
+ * Transition from state code e on symbol class c, computing it from the NFA
+ * the first time. A byte moves the states that accept it; a line start or end
+ * is zero-width: every state stays and the matching anchors are passed.
+ */
+static int dfa_step_slow(Regex *re, int dir, int e, int c) {
+    Dfa *d = &re->dfa[dir];
+    NState *st = re->st[dir];
+    int s = dfa_id(re, e);                       // source state
+    int ns = 0;                                  // NFA states to take the closure of
+    int pass = c == re->nbyte_cls ? N_BOL : c == re->nbyte_cls + 1 ? N_EOL : -1; // anchor symbol?
+    const int *set = d->sets + d->set_off[s];
+    for (int i = 0; i < d->set_len[s]; i++) {
+        NState *x = &st[set[i]];
+        if (pass >= 0)
+            re->seeds[ns++] = set[i];            // nothing is consumed
+        else if (x->op == N_ANY || (x->op == N_SET && set_has(re->set[x->set], re->cls_rep[c])))
+            re->seeds[ns++] = x->out;            // reads the byte
+    }
+    int n = rx_closure(re, dir, re->seeds, ns, pass, re->tmp);
+    if (d->n >= RX_DFA_STATES) {                 // cache full: start over (s is gone after this)
+        dfa_flush(d);
+        return dfa_code(re, dir, dfa_intern(re, dir, re->tmp, n)); // not recorded: its source was dropped
+    }
+    int t = dfa_code(re, dir, dfa_intern(re, dir, re->tmp, n));
+    d->trans[(size_t)s * re->ncls + c] = t;      // remember
+    return t;
+}
+
+/* Transition, cached */
+static inline int dfa_step(Regex *re, int dir, int e, int c) {
+    int t = re->dfa[dir].trans[(e >> 2) + c];
+    return t != -1 ? t : dfa_step_slow(re, dir, e, c);
+}
+
+/*
+ * Byte that is the only way out of state e (reading in direction 'dir'), or
+ * -1. Holds when every other byte leads back to e and so does a line break
+ * (line end, '\n', line start; backwards the other way round) without a
+ * match on the way; the scan can then memchr to that byte.
+ */
+static int dfa_exit_byte(Regex *re, int dir, int e) {
+    unsigned long flushes = re->dfa[dir].flushes; // the steps below may flush e away
+    int first = re->nbyte_cls + (dir ? 0 : 1), last = re->nbyte_cls + (dir ? 1 : 0); // symbols around '\n'
+    int nl = re->cls['\n'];                      // class of the line break
+    int exit_cls = -1;                           // the one class that leaves
+    for (int c = 0; c < re->nbyte_cls; c++) {
+        if (dfa_step(re, dir, e, c) == e) continue;
+        if (c == nl) {                           // fine if only '\n' itself is in it (checked below)
+            for (int b = 0; b < 256; b++)
+                if (b != '\n' && re->cls[b] == nl) return -1;
+            continue;
+        }
+        if (exit_cls >= 0) return -1;            // two ways out
+        exit_cls = c;
+    }
+    if (exit_cls < 0) return -1;                 // never leaves: nothing to skip to
+    int x = dfa_step(re, dir, e, first);         // across a line break
+    if (x & 1) return -1;                        // $ (backwards: ^) could match here
+    x = dfa_step(re, dir, dfa_step(re, dir, x, nl), last);
+    if (x != e || re->dfa[dir].flushes != flushes) return -1;
+    int byte = -1;
+    for (int b = 0; b < 256; b++) {              // the class must be a single byte
+        if (re->cls[b] != exit_cls) continue;
+        if (byte >= 0) return -1;
+        byte = b;
+    }
+    return byte;
+}
+
+/*
+ * Forward scan of t[from..n) with the implicit leading .*: returns the offset
+ * where the first match ends (-1 if none) and in *line_at an offset inside the
+ * line that match is on. Around each '\n' the scan also reads "line end" and
+ * "line start". While nothing has started to match and only one byte can
+ * change that (ERROR.* waiting for 'E'), it jumps with memchr.
+ */
+static long rx_first_end(Regex *re, const char *t, size_t n, size_t from, bool at_bol, size_t *line_at) {
+    int bol = re->nbyte_cls, eol = re->nbyte_cls + 1; // the two extra symbols
+    int rest = dfa_step(re, 0, dfa_step(re, 0, dfa_step(re, 0, dfa_start(re, 0, 1), bol), // idle state
+                                        re->cls['\n']), bol);
+    int skip = (rest & 1) ? -1 : dfa_exit_byte(re, 0, rest); // byte to memchr for while idle
+    unsigned long flushes = re->dfa[0].flushes;  // rest is only valid while this holds
+    int e = dfa_start(re, 0, 1);
+    if (at_bol) e = dfa_step(re, 0, e, bol);     // starting at a line start
+    if (e & 1) { *line_at = from; return (long)from; } // empty match right here
+    const uint8_t *cls = re->cls;
+    const int *cls_off = re->cls_off;
+    const int *trans = re->dfa[0].trans;
+    for (size_t i = from; i < n; i++) {
+        if (skip >= 0 && e == rest && re->dfa[0].flushes == flushes) {
+            const char *p = (const char*)memchr(t + i, skip, n - i); // nothing happens until this byte
+            if (!p) { i = n; break; }
+            i = (size_t)(p - t);
+        }
+        unsigned char c = (unsigned char)t[i];
+        if (c == '\n') {                         // line end, the break itself, then line start
+            e = dfa_step(re, 0, e, eol);
+            if (e & 1) { *line_at = i; return (long)i; }
+            e = dfa_step(re, 0, dfa_step(re, 0, e, cls[c]), bol);
+            if (e & 1) { *line_at = i + 1; return (long)(i + 1); }
+            continue;
+        }
+        int x = *(const int*)((const char*)trans + e + cls_off[c]); // e is even here: not a match
+        if (x & 1) {                             // match, or not built yet
+            if (x == -1) x = dfa_step_slow(re, 0, e, cls[c]);
+            if (x & 1) { *line_at = i; return (long)(i + 1); }
+        }
+        e = x;
+    }
+    e = dfa_step(re, 0, e, eol);                 // end of the last line
+    if (e & 1) { *line_at = n; return (long)n; }
+    return -1;
+}
+
+/* Leftmost start of a match inside line [ls, le) at or after 'lo' (backward scan), -1 if none */
+static long rx_leftmost_start(Regex *re, const char *t, size_t ls, size_t le, size_t lo) {
+    int bol = re->nbyte_cls, eol = re->nbyte_cls + 1;
+    int e = dfa_step(re, 1, dfa_start(re, 1, 1), eol); // read the line backwards from its end
+    long best = (e & 1) ? (long)le : -1;         // empty match at the end
+    for (size_t p = le; p > lo; ) {
+        p--;
+        e = dfa_step(re, 1, e, re->cls[(unsigned char)t[p]]);
+        if (e & 1) best = (long)p;               // a match starts here; keep going for an earlier one
+    }
+    if (lo == ls && (dfa_step(re, 1, e, bol) & 1)) best = (long)ls; // needs ^
+    return best;
+}
+
+/* End of the longest match starting at 'start' in line [ls, le) */
+static long rx_longest_end(Regex *re, const char *t, size_t ls, size_t le, size_t start) {
+    Dfa *d = &re->dfa[0];
+    int e = dfa_start(re, 0, 0);                 // anchored
+    if (start == ls) e = dfa_step(re, 0, e, re->nbyte_cls); // at line start
+    long end = (e & 1) ? (long)start : -1;
+    size_t p = start;
+    for (; p < le && d->set_len[dfa_id(re, e)] > 0; p++) { // until no NFA state is left
+        e = dfa_step(re, 0, e, re->cls[(unsigned char)t[p]]);
+        if (e & 1) end = (long)(p + 1);
+    }
+    if (p == le && d->set_len[dfa_id(re, e)] > 0 && (dfa_step(re, 0, e, re->nbyte_cls + 1) & 1))
+        end = (long)le;                          // needs $
+    return end;
+}
+
+/*
+ * Leftmost-longest match starting at flat offset 'from' or later, in the text
+ * up to 'limit' (a line end); false if none. Only reads 're' and the flat
+ * text, so threads can search different ranges with their own Regex copies.
+ */
+static bool rx_find(Regex *re, size_t from, size_t limit, size_t *mstart, size_t *mlen) {
+    const char *t = stext.text;
+    if (buf.count == 0) return false;            // no lines at all
+    while (from <= limit) {
+        size_t line_at;                          // where the first match ends up
+        bool at_bol = from == 0 || t[from - 1] == '\n';
+        long e = rx_first_end(re, t, limit, from, at_bol, &line_at);
+        if (e < 0) return false;                 // nothing further on
+        int row = search_text_row(line_at);
+        size_t ls = stext.line_start[row];       // that line
+        size_t le = stext.line_start[row + 1] - 1; // its end (the sentinel also counts a '\n')
+        size_t lo = from > ls ? from : ls;       // matches must start at or after 'from'
+        long s = rx_leftmost_start(re, t, ls, le, lo);
+        if (s >= 0) {
+            long end = rx_longest_end(re, t, ls, le, (size_t)s);
+            *mstart = (size_t)s;
+            *mlen = end > s ? (size_t)(end - s) : 0;
+            return true;
+        }
+        from = le + 1;                           // match ran across a line end: try the next line
+    }
+    return false;
+}
+
+/* Same as rx_find for one line t[0..n) on its own (not the flat text), matching at or after 'from' */
+static bool rx_find_in_line(Regex *re, const char *t, size_t n, size_t from, size_t *mstart, size_t *mlen) {
+    size_t line_at;                              // unused: there is only this line
+    if (rx_first_end(re, t, n, from, from == 0, &line_at) < 0) return false;
+    long s = rx_leftmost_start(re, t, 0, n, from);
+    if (s < 0) return false;
+    long end = rx_longest_end(re, t, 0, n, (size_t)s);
+    *mstart = (size_t)s;
+    *mlen = end > s ? (size_t)(end - s) : 0;
+    return true;
+}
+
+/* Rightmost start of a match inside line [ls, le) before 'hi' (hi <= le + 1), -1 if none */
+static long rx_rightmost_start(Regex *re, const char *t, size_t ls, size_t le, size_t hi) {
+    int e = dfa_step(re, 1, dfa_start(re, 1, 1), re->nbyte_cls + 1); // read the line backwards from its end
+    if ((e & 1) && le < hi) return (long)le;     // empty match at the end
+    for (size_t p = le; p > ls; ) {              // matches starting before hi may end after it
+        p--;
+        e = dfa_step(re, 1, e, re->cls[(unsigned char)t[p]]);
+        if ((e & 1) && p < hi) return (long)p;   // going down, the first one is the rightmost
+    }
+    return ls < hi && (dfa_step(re, 1, e, re->nbyte_cls) & 1) ? (long)ls : -1; // needs ^
+}
+
+/*
+ * Backward scan of t[lo..to), 'to' being a line end, with an implicit
+ * trailing .*: returns where the last match starts, -1 if none. The mirror of
+ * rx_first_end: around each '\n' it reads "line start", the break, then "line
+ * end", and while idle it jumps back to the one byte that matters.
+ */
+static long rx_last_start(Regex *re, const char *t, size_t lo, size_t to) {
+    int bol = re->nbyte_cls, eol = re->nbyte_cls + 1; // the two extra symbols
+    int rest = dfa_step(re, 1, dfa_step(re, 1, dfa_step(re, 1, dfa_start(re, 1, 1), eol), // idle state
+                                        re->cls['\n']), eol);
+    int skip = (rest & 1) ? -1 : dfa_exit_byte(re, 1, rest); // byte to jump back to while idle
+    char skip_byte = (char)skip;
+    unsigned long flushes = re->dfa[1].flushes;  // rest is only valid while this holds
+    int e = dfa_step(re, 1, dfa_start(re, 1, 1), eol); // 'to' ends a line
+    if (e & 1) return (long)to;                  // empty match right here
+    for (size_t i = to; i > lo; ) {
+        if (skip >= 0 && e == rest && re->dfa[1].flushes == flushes) {
+            const char *p = find_last_pair(t + lo, i - lo, &skip_byte, 1, 0, 0, FOLD_NONE); // vector memrchr
+            if (!p) { i = lo; break; }
+            i = (size_t)(p - t) + 1;             // read that byte next
+        }
+        unsigned char c = (unsigned char)t[--i];
+        if (c == '\n') {                         // line start, the break itself, then line end
+            e = dfa_step(re, 1, e, bol);
+            if (e & 1) return (long)(i + 1);
+            e = dfa_step(re, 1, dfa_step(re, 1, e, re->cls[c]), eol);
+            if (e & 1) return (long)i;
+            continue;
+        }
+        e = dfa_step(re, 1, e, re->cls[c]);
+        if (e & 1) return (long)i;
+    }
+    if ((lo == 0 || t[lo - 1] == '\n') && (dfa_step(re, 1, e, bol) & 1))
+        return (long)lo;                         // at the start of the first line
+    return -1;
+}
+
+/* Regex throughput check: editor --bench-regex [MB]. Compared with POSIX regexec run line by line. */
+static int regex_bench(int mb) {
+    if (mb <= 0) mb = 64;                        // default haystack size
+    size_t n = (size_t)mb << 20;                 // bytes
+    char *hay = bench_text(n);
+    char *lines = (char*)malloc(n);              // same text as NUL-terminated lines
+    for (size_t i = 0; i < n; i++)
+        lines[i] = hay[i] == '\n' ? '\0' : hay[i];
+    const char *patterns[] = {                   // not in the text: full scans
+        "ERROR.*timeout=[0-9]{4,}",
+        "(quick|lazy) (brown|red) fox",
+        "^[a-z]+ [0-9]+$",
+        "x[aeiou]{3}q[0-9]",
+    };
+    printf("%-32s %12s %12s\n", "pattern", "lazy DFA", "regexec");
+    for (size_t k = 0; k < sizeof(patterns) / sizeof(patterns[0]); k++) {
+        Regex re = {0};
+        regex_t posix;
+        if (!rx_compile_pattern(&re, patterns[k], false) || regcomp(&posix, patterns[k], REG_EXTENDED | REG_NOSUB) != 0) {
+            printf("%-32s does not compile\n", patterns[k]);
+            rx_free(&re);
+            continue;
+        }
+        long best[2] = { LONG_MAX, LONG_MAX };   // best of a few runs, in us
+        bool found[2] = { false, false };        // results (must agree)
+        for (int run = 0; run < 3; run++) {
+            size_t at;                           // unused: line of the match
+            long t0 = monotonic_us();
+            found[0] = rx_first_end(&re, hay, n, 0, true, &at) >= 0;
+            long t1 = monotonic_us();
+            found[1] = false;
+            for (const char *l = lines; l < lines + n && !found[1]; l += strlen(l) + 1)
+                found[1] = regexec(&posix, l, 0, NULL, 0) == 0;
+            long t2 = monotonic_us();
+            if (t1 - t0 < best[0]) best[0] = t1 - t0;
+            if (t2 - t1 < best[1]) best[1] = t2 - t1;
+        }
+        printf("%-32s %7.2f GB/s %7.2f GB/s  %s  (%d DFA states)\n", patterns[k],
+               (double)n / 1e3 / (best[0] + 1), (double)n / 1e3 / (best[1] + 1),
+               found[0] == found[1] ? "agree" : "DISAGREE", re.dfa[0].n);
+        regfree(&posix);
+        rx_free(&re);
+    }
+    free(lines);
+    free(hay);
+    return 0;
+}
+
+/* ----------------------- Trigram index ----------------------- */
+/*
+ * Scanning at GB/s still takes seconds on a file of several GB, so big
+ * buffers (TRI_MIN_MB and up) get an index: lines are grouped into blocks of
+ * about TRI_BLOCK_BYTES, and each block keeps a signature with one bit per
+ * hashed trigram that occurs in its lines. A literal query can only match in
+ * a block whose signature has the bits of all its trigrams, so a search scans
+ * just those blocks, with the normal kernel. ASCII letters are folded before
+ * hashing, so one index serves every case mode.
+ *
+ * Signatures are built while the editor is idle, a slice at a time between
+ * keys (ev.idle). The buffer hooks keep the index current: an edited line
+ * marks its block dirty, inserted or removed lines grow or shrink their block,
+ * and a dirty block is searched in full until the builder gets to it again.
+ */
+
+static uint64_t *tri_sig(int b) { return tindex.sig + ((size_t)b << TRI_SIG_LOG2) / 64; }
+
+/* Signature bit of the trigram at p */
+static unsigned tri_hash(const unsigned char *p) {
+    uint32_t k = 0;                              // the three bytes, letters in lower case
+    for (int i = 0; i < 3; i++)
+        k = k << 8 | (p[i] | ((unsigned)(p[i] - 'A') < 26) << 5);
+    return (k * 2654435761u) >> (32 - TRI_SIG_LOG2);
+}
+
+static void tri_mark(int b) {
+    if (!tindex.blk[b].dirty) { tindex.blk[b].dirty = true; tindex.ndirty++; }
+}
+
+/* New dirty block of lines [first, first + count) at position 'at' */
+static void tri_insert_block(int at, int first, int count) {
+    if (tindex.nblk == tindex.blk_cap) {         // grow blocks and signatures together
+        tindex.blk_cap = tindex.blk_cap ? tindex.blk_cap * 2 : 64;
+        tindex.blk = (TriBlock*)realloc(tindex.blk, tindex.blk_cap * sizeof(TriBlock));
+        tindex.sig = (uint64_t*)realloc(tindex.sig, ((size_t)tindex.blk_cap << TRI_SIG_LOG2) / 8);
+    }
+    memmove(&tindex.blk[at + 1], &tindex.blk[at], (tindex.nblk - at) * sizeof(TriBlock));
+    memmove(tri_sig(at + 1), tri_sig(at), ((size_t)(tindex.nblk - at) << TRI_SIG_LOG2) / 8);
+    tindex.blk[at] = (TriBlock){ first, count, true };
+    tindex.nblk++;
+    tindex.ndirty++;
+}
+
+/* Stop indexing (small buffer, or the hooks lost track) */
+static void tindex_drop(void) {
+    free(tindex.blk);
+    free(tindex.sig);
+    memset(&tindex, 0, sizeof(tindex));
+}
+
+/* After a file is loaded: index it if it is big enough; the idle builder does the work */
+static void tindex_open(void) {
+    tindex_drop();
+    long mb = TRI_MIN_MB;                        // size threshold
+    const char *env = getenv("AURIGA_INDEX_MB");
+    if (env && *env) mb = atol(env);
+    size_t total = 0;                            // bytes, separators included
+    for (int r = 0; r < buf.count; r++) total += (size_t)buf.len[r] + 1;
+    if (mb <= 0 || total < (size_t)mb << 20) return; // scanning is fast enough
+    int first = 0;                               // first line of the block being cut
+    size_t acc = 0;
+    for (int r = 0; r < buf.count; r++) {
+        acc += (size_t)buf.len[r] + 1;
+        if (acc >= TRI_BLOCK_BYTES || r == buf.count - 1) {
+            tri_insert_block(tindex.nblk, first, r + 1 - first);
+            first = r + 1;
+            acc = 0;
+        }
+    }
+    tindex.lines = buf.count;
+    tindex.on = true;
+}
+
+/* Block holding line 'row' */
+static int tri_block_of(int row) {
+    int lo = 0, hi = tindex.nblk - 1;            // binary search over first lines
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (tindex.blk[mid].first <= row) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+/* Build block b's signature from its lines (a block grown past twice the size is split first); returns bytes read */
+static size_t tri_build(int b) {
+    size_t bytes = 0;                            // the block's size
+    int cut = 0;                                 // lines up to about TRI_BLOCK_BYTES
+    for (int i = 0; i < tindex.blk[b].count; i++) {
+        bytes += (size_t)buf.len[tindex.blk[b].first + i] + 1;
+        if (!cut && bytes >= TRI_BLOCK_BYTES) cut = i + 1;
+    }
+    if (bytes > 2 * TRI_BLOCK_BYTES && cut < tindex.blk[b].count) { // edits made it big: the rest becomes a new block
+        tri_insert_block(b + 1, tindex.blk[b].first + cut, tindex.blk[b].count - cut);
+        tindex.blk[b].count = cut;
+    }
+    uint64_t *sig = tri_sig(b);
+    memset(sig, 0, ((size_t)1 << TRI_SIG_LOG2) / 8);
+    size_t done = 0;
+    for (int r = tindex.blk[b].first; r < tindex.blk[b].first + tindex.blk[b].count; r++) {
+        const unsigned char *t = (const unsigned char*)buf.lines[r];
+        for (int i = 0; i + 3 <= buf.len[r]; i++) { // trigrams inside the line (queries never span lines)
+            unsigned h = tri_hash(t + i);
+            sig[h >> 6] |= 1ull << (h & 63);
+        }
+        done += (size_t)buf.len[r] + 1;
+    }
+    tindex.blk[b].dirty = false;
+    tindex.ndirty--;
+    return done;
+}
+
+/* ev.idle: rebuild dirty blocks, about TRI_SLICE_BYTES per call; true while some are left */
+static bool tindex_idle(void) {
+    if (!tindex.on || tindex.ndirty == 0) return false;
+    size_t done = 0;                             // bytes indexed in this slice
+    int b = tindex.next < tindex.nblk ? tindex.next : 0; // carry on where the last slice stopped
+    for (int n = 0; n < tindex.nblk && done < TRI_SLICE_BYTES && tindex.ndirty > 0; n++, b = (b + 1) % tindex.nblk)
+        if (tindex.blk[b].dirty) done += tri_build(b);
+    tindex.next = b;
+    return tindex.ndirty > 0;
+}
+
+/* Buffer hook: an edited line's block must be rebuilt */
+static void tindex_line_changed(int row) {
+    if (!tindex.on || row >= tindex.lines) return;
+    tri_mark(tri_block_of(row));
+}
+
+/* Buffer hook: lines were inserted (delta > 0) or removed at 'at'; their blocks grow or shrink, later ones move */
+static void tindex_lines_shifted(int at, int delta) {
+    if (!tindex.on) return;
+    if (tindex.lines + delta != buf.count) {     // lost track
+        tindex_drop();
+        return;
+    }
+    if (delta > 0) {                             // new lines join the block they were inserted into
+        int b = tri_block_of(at < tindex.lines ? at : tindex.lines - 1);
+        tindex.blk[b].count += delta;
+        tri_mark(b);
+    } else if (delta < 0) {                      // removed lines [at, at - delta)
+        int w = 0;                               // blocks kept
+        for (int b = 0; b < tindex.nblk; b++) {
+            TriBlock k = tindex.blk[b];
+            int lo = k.first > at ? k.first : at, hi = k.first + k.count < at - delta ? k.first + k.count : at - delta;
+            if (hi > lo) {                       // lost some lines
+                k.count -= hi - lo;
+                if (!k.dirty) { k.dirty = true; tindex.ndirty++; }
+            }
+            if (k.count == 0) { tindex.ndirty--; continue; } // lost all of them
+            if (w != b) memcpy(tri_sig(w), tri_sig(b), ((size_t)1 << TRI_SIG_LOG2) / 8);
+            tindex.blk[w++] = k;
+        }
+        tindex.nblk = w;
+    }
+    int first = 0;                               // later blocks start elsewhere now
+    for (int b = 0; b < tindex.nblk; b++) {
+        tindex.blk[b].first = first;
+        first += tindex.blk[b].count;
+    }
+    tindex.lines = buf.count;
+    tindex.next = 0;
+    if (tindex.nblk == 0) tindex_drop();         // buffer freed
+}
+
+/* Signature bits of a plan's trigrams into keys[] (room for 256); how many (0: the index cannot help) */
+static int tri_query_keys(const SearchPlan *pl, unsigned *keys) {
+    const unsigned char *nd = (const unsigned char*)pl->needle;
+    int n = 0;
+    for (size_t i = 0; i + 3 <= pl->m; i++) {
+        if (pl->fold == FOLD_UTF8 && (nd[i] | nd[i + 1] | nd[i + 2]) >= 0x80) continue; // bytes vary with case
+        keys[n++] = tri_hash(nd + i);
+    }
+    return n;
+}
+
+/* Is the index ready to narrow a search for pl? (mostly built, and the flat copy shows the same lines) */
+static bool tindex_usable(const SearchPlan *pl) {
+    unsigned keys[256];
+    return tindex.on && tindex.ndirty * 8 <= tindex.nblk // not still (re)building most of it
+        && stext.valid && stext.gen == text_gen && tri_query_keys(pl, keys) > 0;
+}
+
+/*
+ * First (or, if 'last', the highest-starting) match of pl lying inside flat
+ * range [lo, hi), scanning only the blocks whose signature allows one (and
+ * dirty ones). The same result as one plan_find over the range: a match
+ * never leaves its line, so it lies inside a single block.
+ */
+static const char *tindex_find(const SearchPlan *pl, size_t lo, size_t hi, bool last) {
+    unsigned keys[256];
+    int nk = tri_query_keys(pl, keys);
+    if (hi > stext.len) hi = stext.len;
+    if (lo >= hi) return NULL;
+    int b0 = tri_block_of(search_text_row(lo)), b1 = tri_block_of(search_text_row(hi - 1));
+    for (int i = 0; i <= b1 - b0; i++) {
+        int b = last ? b1 - i : b0 + i;          // in scan order
+        if (!tindex.blk[b].dirty) {
+            const uint64_t *sig = tri_sig(b);
+            int k = 0;
+            while (k < nk && (sig[keys[k] >> 6] >> (keys[k] & 63) & 1)) k++;
+            if (k < nk) continue;                // a trigram the block does not have
+        }
+        size_t s = stext.line_start[tindex.blk[b].first];
+        size_t e = stext.line_start[tindex.blk[b].first + tindex.blk[b].count];
+        if (s < lo) s = lo;
+        if (e > hi) e = hi;
+        const char *p = last ? plan_find_last(pl, stext.text + s, e - s) : plan_find(pl, stext.text + s, e - s);
+        if (p) return p;
+    }
+    return NULL;
+}
+
+/* ----------------------- Parallel search ----------------------- */
+/*
+ * Big buffers are searched by a small thread pool. The scan order of a search
+ * (cursor to the end, then wrapping from the top back to the cursor) is cut
+ * into chunks of about SEARCH_CHUNK bytes ending at line ends, so no match can
+ * straddle two chunks. Threads take chunks in scan order from a shared
+ * counter and record the earliest chunk that has a match; chunks after it are
+ * no longer started, and the search is over once the threads still busy on
+ * earlier chunks finish. The earliest chunk with a match holds the match the
+ * sequential search finds, so the result is the same, just sooner.
+ *
+ * The calling thread searches too. Workers sleep on a condition variable
+ * between searches; the pool starts on the first big search.
+ *
+ * A search run while the user types (incremental search) is interruptible:
+ * between chunks the calling thread checks for input and, if there is some,
+ * abandons the search so the key is handled at once.
+ */
+
+/* Search one chunk with thread 'self''s tools; true with the chunk's first match */
+static bool search_chunk(int self, SearchChunk *ch) {
+    if (spool.regex) {
+        Regex *re = self ? &spool.rx[self] : &qregex; // this thread's copy
+        if (!rx_for(re, spool.query)) return false; // compiled on first use, or when the pattern changed
+        return rx_find(re, ch->from, ch->to, &ch->off, &ch->len) && ch->off < ch->before;
+    }
+    const char *p = plan_find(spool.plan, stext.text + ch->from, ch->to - ch->from);
+    if (!p) return false;
+    ch->off = (size_t)(p - stext.text);
+    ch->len = spool.plan->m;
+    return ch->off < ch->before;
+}
+
+/* Take chunks until none is left or an earlier chunk already matched. 'poll': stop for input. */
+static void search_run_chunks(int self, bool poll) {
+    int i;                                       // chunk taken
+    while ((i = atomic_fetch_add(&spool.next, 1)) < spool.nchunks) {
+        if (i > atomic_load(&spool.best)) break; // a match comes before this chunk
+        if (atomic_load(&spool.cancel)) break;   // input is waiting
+        if (search_chunk(self, &spool.chunks[i])) {
+            int b = atomic_load(&spool.best);    // lower the best chunk to i
+            while (i < b && !atomic_compare_exchange_weak(&spool.best, &b, i))
+                ;
+        }
+        if (poll && input_pending())             // typing goes first
+            atomic_store(&spool.cancel, true);
+    }
+}
+
+/* Worker thread: run each posted job once, then sleep */
+static void *search_worker(void *arg) {
+    int self = (int)(intptr_t)arg;               // index of this thread's Regex
+    unsigned long seen = 0;                      // last job run
+    pthread_mutex_lock(&spool.lock);
+    while (1) {
+        while (spool.job == seen)                // wait for a new search
+            pthread_cond_wait(&spool.wake, &spool.lock);
+        seen = spool.job;
+        pthread_mutex_unlock(&spool.lock);
+        search_run_chunks(self, false);
+        pthread_mutex_lock(&spool.lock);
+        if (--spool.busy == 0)                   // last one out tells the caller
+            pthread_cond_signal(&spool.done);
+    }
+    return NULL;
+}
+
+/* Threads to search with: one per CPU, or AURIGA_THREADS */
+static int threads_wanted(void) {
+    long want = sysconf(_SC_NPROCESSORS_ONLN);   // one per CPU
+    const char *env = getenv("AURIGA_THREADS");  // optional override from the environment
+    if (env && *env) want = atol(env);
+    if (want < 1) want = 1;
+    if (want > SEARCH_MAX_THREADS) want = SEARCH_MAX_THREADS;
+    return (int)want;
+}
+
+/* Threads a search may use (the caller included); starts the pool on first use */
+static int search_threads(void) {
+    if (spool.nthreads > 0) return spool.nthreads;
+    int want = threads_wanted();
+    pthread_mutex_init(&spool.lock, NULL);
+    pthread_cond_init(&spool.wake, NULL);
+    pthread_cond_init(&spool.done, NULL);
+    spool.nthreads = 1;                          // the caller
+    for (int i = 1; i < want; i++) {             // plus workers, as many as start
+        if (pthread_create(&spool.tid[i], NULL, search_worker, (void*)(intptr_t)i) != 0) break;
+        spool.nthreads++;
+    }
+    return spool.nthreads;
+}
+
+/* Append the chunks covering [from, to] (to = a line end); matches must start before 'before' */
+static void search_add_chunks(size_t from, size_t to, size_t before) {
+    while (1) {
+        size_t end = to;                         // chunk end: the first line end past from + SEARCH_CHUNK
+        if (to - from > SEARCH_CHUNK) {
+            int row = search_text_row(from + SEARCH_CHUNK);
+            end = stext.line_start[row + 1] - 1;
+            if (end > to) end = to;
+        }
+        if (spool.nchunks == spool.chunks_cap) { // grow chunk list
+            spool.chunks_cap = spool.chunks_cap ? spool.chunks_cap * 2 : 64;
+            spool.chunks = (SearchChunk*)realloc(spool.chunks, spool.chunks_cap * sizeof(SearchChunk));
+        }
+        spool.chunks[spool.nchunks++] = (SearchChunk){ from, end, before, 0, 0 };
+        if (end >= to) return;
+        from = end + 1;                          // next line
+    }
+}
+
+/*
+ * Search the flat text in scan order from 'start' chunk by chunk, on the pool
+ * when 'threads' > 1; same result as the plain sequential search. With
+ * 'cancelled' set, pending input stops the search and sets *cancelled.
+ */
+static bool search_chunked(size_t start, int threads, size_t *off, size_t *len, bool *cancelled) {
+    spool.nchunks = 0;
+    if (start <= stext.len)                      // cursor to the end
+        search_add_chunks(start, stext.len, SIZE_MAX);
+    int row = search_text_row(start);            // then the top down to the cursor's line end
+    size_t wrap_end = stext.line_start[row + 1] - 1;
+    search_add_chunks(0, wrap_end < stext.len ? wrap_end : stext.len, start);
+    atomic_store(&spool.next, 0);
+    atomic_store(&spool.best, spool.nchunks);    // no match yet
+    atomic_store(&spool.cancel, false);
+
+    if (threads > 1) {
+        pthread_mutex_lock(&spool.lock);         // post the job
+        spool.busy = threads - 1;
+        spool.job++;
+        pthread_cond_broadcast(&spool.wake);
+        pthread_mutex_unlock(&spool.lock);
+    }
+    search_run_chunks(0, cancelled != NULL);     // search along
+    if (threads > 1) {
+        pthread_mutex_lock(&spool.lock);         // wait for chunks still running
+        while (spool.busy > 0)
+            pthread_cond_wait(&spool.done, &spool.lock);
+        pthread_mutex_unlock(&spool.lock);
+    }
+
+    if (cancelled && (*cancelled = atomic_load(&spool.cancel)))
+        return false;                            // unfinished: earlier chunks may not have run
+    int b = atomic_load(&spool.best);
+    if (b >= spool.nchunks) return false;        // no chunk matched
+    *off = spool.chunks[b].off;
+    *len = spool.chunks[b].len;
+    return true;
+}
+
+/*
+ * Find query q in the flat text in scan order from 'start': matches at or
+ * after it, then wrapping to ones before it. Big texts go to the thread pool.
+ * 'cancelled': NULL to search to the end, else the search gives up (and sets
+ * it) as soon as input is pending.
+ */
+static bool search_from(const char *q, bool regex, size_t start, size_t *off, size_t *len, bool *cancelled) {
+    if (cancelled) *cancelled = false;
+    spool.query = q;
+    spool.regex = regex;
+    if (!regex) spool.plan = plan_for(q);        // compiled once per query
+    if (regex && !rx_for(&qregex, q)) return false; // checked by the caller; recompiled only if changed
+    if (!regex && tindex_usable(spool.plan)) {   // indexed: only a few blocks to scan
+        const SearchPlan *pl = spool.plan;
+        const char *p = tindex_find(pl, start, stext.len, false);
+        if (!p) p = tindex_find(pl, 0, start + pl->m - 1, false); // wrap to top
+        if (!p) return false;
+        *off = (size_t)(p - stext.text);
+        *len = pl->m;
+        return true;
+    }
+    if (stext.len >= SEARCH_PAR_MIN && search_threads() > 1)
+        return search_chunked(start, spool.nthreads, off, len, cancelled);
+    if (cancelled)                               // one thread, but stop between chunks for input
+        return search_chunked(start, 1, off, len, cancelled);
+    if (regex)
+        return rx_find(&qregex, start, stext.len, off, len)                // to the end
+            || (rx_find(&qregex, 0, stext.len, off, len) && *off < start); // wrap to top
+    const SearchPlan *pl = spool.plan;
+    const char *p = start <= stext.len ? plan_find(pl, stext.text + start, stext.len - start) : NULL; // to the end
+    if (!p) {                                    // wrap to top: matches that start before 'start'
+        size_t upto = start + pl->m - 1 < stext.len ? start + pl->m - 1 : stext.len;
+        p = plan_find(pl, stext.text, upto);
+    }
+    if (!p) return false;
+    *off = (size_t)(p - stext.text);             // flat offset of the match
+    *len = pl->m;
+    return true;
+}
+
+/*
+ * The match with the highest start in flat range [lo, hi) (it may run past hi
+ * inside its line), scanning backwards from hi: the cost is the distance to
+ * that match, not the size of the text before it.
+ */
+static bool search_last(const char *q, bool regex, size_t lo, size_t hi, size_t *off, size_t *len) {
+    if (hi <= lo) return false;                  // empty range
+    if (!regex) {
+        const SearchPlan *pl = plan_for(q);      // compiled once per query
+        size_t end = hi - 1 + pl->m < stext.len ? hi - 1 + pl->m : stext.len; // where the last allowed start ends
+        const char *p = end < lo ? NULL
+                      : tindex_usable(pl) ? tindex_find(pl, lo, end, true)
+                      : plan_find_last(pl, stext.text + lo, end - lo);
+        if (!p) return false;
+        *off = (size_t)(p - stext.text);
+        *len = pl->m;
+        return true;
+    }
+    if (!rx_for(&qregex, q)) return false;      // checked by the caller; recompiled only if changed
+    const char *t = stext.text;
+    int row = search_text_row(hi - 1);           // line of the highest allowed start
+    size_t top = hi;                             // starts must be below this
+    while (1) {
+        size_t ls = stext.line_start[row];
+        size_t le = stext.line_start[row + 1] - 1; // its end (the sentinel also counts a '\n')
+        long s = rx_rightmost_start(&qregex, t, ls, le, top);
+        if (s >= 0) {
+            if ((size_t)s < lo) return false;    // before the range
+            long end = rx_longest_end(&qregex, t, ls, le, (size_t)s);
+            *off = (size_t)s;
+            *len = end > s ? (size_t)(end - s) : 0;
+            return true;
+        }
+        if (ls <= lo) return false;              // earlier lines are outside the range
+        long p = rx_last_start(&qregex, t, lo, ls - 1); // jump back to the next line with a match
+        if (p < 0) return false;
+        row = search_text_row((size_t)p);
+        top = stext.line_start[row + 1];         // any start in that line
+    }
+}
+
+/* ----------------------- Match highlighting ----------------------- */
+
+/*
+ * Every match of the search query is marked, not only the current one. Only
+ * rows being drawn are searched, each on its own, and the result is kept in
+ * the row's LineCache until the row or the query changes, so the cost
+ * depends on the screen size, never on the file size.
+ */
+
+/* Mark matches of 'q' from now on ("" or a regex that does not parse: none) */
+static void hl_set_query(const char *q, bool regex) {
+    FoldKind fold = query_fold(q, regex);      // under the current case mode
+    if (strcmp(q, hl_query) == 0 && regex == hl_query_regex && fold == hl_query_fold)
+        return;                                // same query: hits stay valid
+    snprintf(hl_query, sizeof(hl_query), "%s", q);
+    hl_query_regex = regex;
+    hl_query_fold = fold;
+    hl_query_gen++;                            // every row's hits are stale now
+    if (regex && q[0] && !rx_for(&hl_regex, q))
+        hl_query[0] = '\0';                    // half-typed pattern: mark nothing
+    else if (!regex)
+        plan_compile(&hl_plan, q, strlen(q), fold);
+}
+
+/* Add the byte range [s, e) to a row's hits */
+static void line_hit_add(LineCache *lc, int s, int e) {
+    if (2 * lc->nhits + 2 > lc->hits_cap) {    // grow storage
+        lc->hits_cap = lc->hits_cap * 2 + 16;
+        lc->hits = (int*)realloc(lc->hits, lc->hits_cap * sizeof(int));
+    }
+    lc->hits[2 * lc->nhits] = s;
+    lc->hits[2 * lc->nhits + 1] = e;
+    lc->nhits++;
+}
+
+/* The row's LineCache with hits matching the current hl_query (searched if stale) */
+static LineCache *line_hits(Buffer *b, int row) {
+    LineCache *lc = &b->cache[row];
+    if (lc->hits_gen == hl_query_gen) return lc; // cached
+    lc->nhits = 0;
+    lc->hits_gen = hl_query_gen;
+    if (hl_query[0] == '\0') return lc;        // nothing to mark
+    const char *t = b->lines[row];
+    size_t n = (size_t)b->len[row];
+    for (size_t at = 0; at <= n; ) {           // matches left to right, not overlapping
+        size_t s, m;                           // match start and length
+        if (hl_query_regex) {
+            if (!rx_find_in_line(&hl_regex, t, n, at, &s, &m)) break;
+        } else {
+            const char *p = plan_find(&hl_plan, t + at, n - at);
+            if (!p) break;
+            s = (size_t)(p - t);
+            m = hl_plan.m;
+        }
+        if (m > 0) line_hit_add(lc, (int)s, (int)(s + m));
+        at = s + (m > 0 ? m : 1);              // empty matches mark nothing: step over them
+    }
+    return lc;
+}
+
+/* ----------------------- Match count ----------------------- */
+
+/*
+ * After a search the status says "match 3 of 12,408". A worker thread counts
+ * the matches of every line of a snapshot, reporting progress through a pipe
+ * so the total fills in while the user goes on. Afterwards an edit recounts
+ * only the lines it touched, and a Fenwick tree over the per-line counts
+ * gives N in O(log n). Matches are counted where Ctrl-N would stop: every
+ * start position, overlapping ones included.
+ */
+
+/* Matches starting before 'upto' in line t[0..n) (re = NULL: the literal plan) */
+static int mcount_line(const SearchPlan *pl, Regex *re, const char *t, size_t n, size_t upto) {
+    int c = 0;
+    for (size_t at = 0; at <= n && at < upto; ) {
+        size_t s, m;                           // match start and length
+        if (re) {
+            if (!rx_find_in_line(re, t, n, at, &s, &m)) break;
+        } else {
+            const char *p = plan_find(pl, t + at, n - at);
+            if (!p) break;
+            s = (size_t)(p - t);
+        }
+        if (s >= upto) break;
+        c++;
+        at = s + 1;                            // Ctrl-N goes on right after a match's start
+    }
+    return c;
+}
+
+/* Worker: count snapshot lines [a, b) into wcnt */
+static void mcount_chunk(int a, int b) {
+    const char *t = mcount.text;
+    const size_t *ls = mcount.line_start;
+    for (int r = a; r < b; r++) mcount.wcnt[r] = 0;
+    size_t end = ls[b] - 1;                    // end of the last line (its '\n' is not searched)
+    int r = a;                                 // line of the latest match
+    if (!mcount.regex) {                       // literal: one vector scan over all the lines
+        for (size_t pos = ls[a]; pos < end; ) {
+            const char *p = plan_find(&mcount.plan, t + pos, end - pos);
+            if (!p) break;
+            size_t o = (size_t)(p - t);        // a query never spans a '\n'
+            while (ls[r + 1] <= o) r++;
+            mcount.wcnt[r]++;
+            pos = o + 1;                       // overlapping matches count too
+        }
+        return;
+    }
+    for (size_t pos = ls[a]; pos <= end; ) {   // regex: jump to the next line with a match, count it
+        size_t line_at;                        // where the first match is
+        if (rx_first_end(&mcount.wre, t, end, pos, true, &line_at) < 0) break;
+        while (r + 1 < b && ls[r + 1] <= line_at) r++;
+        mcount.wcnt[r] = mcount_line(NULL, &mcount.wre, t + ls[r], ls[r + 1] - 1 - ls[r], SIZE_MAX);
+        pos = ls[r + 1];                       // next line
+    }
+}
+
+/* Worker thread: count the snapshot in line-aligned chunks, publishing progress */
+static void *mcount_worker(void *arg) {
+    (void)arg;
+    long last_note = monotonic_ms();           // when the event loop was last told
+    for (int row = 0; row < mcount.rows && !atomic_load(&mcount.cancel); ) {
+        int end = row;                         // whole lines, about SEARCH_CHUNK bytes
+        while (end < mcount.rows && mcount.line_start[end] - mcount.line_start[row] < SEARCH_CHUNK)
+            end++;
+        mcount_chunk(row, end);
+        atomic_store(&mcount.done, end);       // release: wcnt[row, end) are visible with it
+        row = end;
+        note_send(mcount.note[1], NULL, &last_note, MCOUNT_NOTE_MS, row == mcount.rows); // only this thread keeps it
+    }
+    return NULL;
+}
+
+/* Stop the worker, if any */
+static void mcount_stop(void) {
+    if (!mcount.running) return;
+    atomic_store(&mcount.cancel, true);
+    pthread_join(mcount.tid, NULL);
+    mcount.running = false;
+}
+
+/* Linear-time rebuild of the Fenwick tree over cnt */
+static void mcount_tree_build(void) {
+    for (int i = 0; i < mcount.n; i++)
+        mcount.tree[i + 1] = mcount.cnt[i] > 0 ? mcount.cnt[i] : 0;
+    for (int i = 1; i <= mcount.n; i++) {
+        int parent = i + (i & -i);             // node that also covers i
+        if (parent <= mcount.n)
+            mcount.tree[parent] += mcount.tree[i];
+    }
+    mcount.tree_valid = true;
+}
+
+/* Change the count of one line by 'delta' */
+static void mcount_tree_add(int row, int delta) {
+    mcount.total += delta;
+    if (!mcount.tree_valid) return;            // rebuilt from cnt anyway
+    for (int i = row + 1; i <= mcount.n; i += i & -i) // Fenwick point update
+        mcount.tree[i] += delta;
+}
+
+/* Known matches in lines [0, row) */
+static long mcount_prefix(int row) {
+    if (!mcount.tree_valid) mcount_tree_build();
+    long sum = 0;
+    for (int i = row; i > 0; i -= i & -i)      // Fenwick prefix query
+        sum += mcount.tree[i];
+    return sum;
+}
+
+/* Take in what the worker has counted so far */
+static void mcount_merge(void) {
+    if (!mcount.active || mcount.stale) return; // lines moved: its rows no longer match
+    int done = atomic_load(&mcount.done);      // acquire: wcnt[0, done) are complete
+    for (; mcount.merged < done; mcount.merged++) {
+        int r = mcount.merged;
+        if (mcount.cnt[r] == -1) {             // not recounted by an edit meanwhile
+            mcount.cnt[r] = mcount.wcnt[r];
+            if (mcount.wcnt[r]) mcount_tree_add(r, mcount.wcnt[r]);
+        }
+    }
+    if (mcount.merged == mcount.rows && mcount.running) { // finished
+        pthread_join(mcount.tid, NULL);
+        mcount.running = false;
+    }
+}
+
+/* Grow the per-line arrays to hold 'n' lines */
+static void mcount_reserve(int n) {
+    if (n <= mcount.cap) return;
+    mcount.cap = n * 2;
+    mcount.cnt = (int*)realloc(mcount.cnt, mcount.cap * sizeof(int));
+    mcount.tree = (int*)realloc(mcount.tree, (mcount.cap + 1) * sizeof(int));
+    mcount.wcnt = (int*)realloc(mcount.wcnt, mcount.cap * sizeof(int));
+}
+
+static void on_mcount_note(void *arg);
+
+/* Start counting 'q' over a snapshot of the buffer (again, if it was stale) */
+static void mcount_start(const char *q, bool regex) {
+    mcount_stop();
+    if (mcount.note[0] < 0)                    // first use: progress pipe into the event loop
+        note_pipe_open(mcount.note, on_mcount_note);
+    snprintf(mcount.query, sizeof(mcount.query), "%s", q);
+    mcount.regex = regex;
+    mcount.fold = query_fold(q, regex);        // the case mode at the time
+    if (regex) {
+        if (!rx_for(&mcount.re, q) || !rx_for(&mcount.wre, q)) {
+            mcount.active = false;             // callers only count valid patterns
+            return;
+        }
+    } else {
+        plan_compile(&mcount.plan, q, strlen(q), mcount.fold);
+    }
+    search_text_sync();                        // snapshot = the flat search copy
+    size_t bytes = stext.line_start[buf.count];
+    if (bytes > mcount.text_cap) {
+        mcount.text_cap = bytes;
+        mcount.text = (char*)realloc(mcount.text, bytes);
+    }
+    if (buf.count + 1 > mcount.lines_cap) {    // line tables
+        mcount.lines_cap = buf.count + 1;
+        mcount.line_start = (size_t*)realloc(mcount.line_start, mcount.lines_cap * sizeof(size_t));
+    }
+    mcount_reserve(buf.count);
+    memcpy(mcount.text, stext.text, bytes);
+    memcpy(mcount.line_start, stext.line_start, (buf.count + 1) * sizeof(size_t));
+    mcount.rows = mcount.n = buf.count;
+    for (int i = 0; i < mcount.n; i++) mcount.cnt[i] = -1; // nothing known yet
+    memset(mcount.tree, 0, (mcount.n + 1) * sizeof(int));
+    mcount.tree_valid = true;
+    mcount.total = 0;
+    mcount.merged = 0;
+    mcount.active = true;
+    mcount.stale = false;
+    atomic_store(&mcount.done, 0);
+    atomic_store(&mcount.cancel, false);
+    mcount.running = pthread_create(&mcount.tid, NULL, mcount_worker, NULL) == 0;
+    if (!mcount.running) {                     // no thread: count right here
+        mcount_worker(NULL);
+        mcount_merge();
+    }
+}
+
+/* Buffer hook: recount an edited line */
+static void mcount_line_changed(int row) {
+    if (!mcount.active || mcount.stale || row >= mcount.n || row >= buf.count) return;
+    int c = mcount_line(&mcount.plan, mcount.regex ? &mcount.re : NULL, buf.lines[row], buf.len[row], SIZE_MAX);
+    int old = mcount.cnt[row] > 0 ? mcount.cnt[row] : 0; // -1 (worker's result pending) counted as 0
+    mcount.cnt[row] = c;                       // and the worker's result is no longer taken
+    if (c != old) mcount_tree_add(row, c - old);
+}
+
+/* Buffer hook: lines were inserted (delta > 0) or removed at 'at' */
+static void mcount_lines_shifted(int at, int delta) {
+    if (!mcount.active || mcount.stale) return;
+    mcount_merge();                            // a finished worker is joined here
+    if (mcount.running || mcount.n + delta != buf.count) { // mid-count (its rows would move) or lost track
+        mcount_stop();
+        mcount.stale = true;                   // counted again when next asked
+        return;
+    }
+    mcount_reserve(buf.count);
+    int *cnt = mcount.cnt;
+    if (delta > 0) {                           // new lines: count just them
+        memmove(&cnt[at + delta], &cnt[at], (mcount.n - at) * sizeof(int));
+        for (int i = at; i < at + delta; i++) {
+            cnt[i] = mcount_line(&mcount.plan, mcount.regex ? &mcount.re : NULL, buf.lines[i], buf.len[i], SIZE_MAX);
+            mcount.total += cnt[i];
+        }
+    } else if (delta < 0) {                    // removed lines take their matches along
+        for (int i = at; i < at - delta; i++)
+            mcount.total -= cnt[i];
+        memmove(&cnt[at], &cnt[at - delta], (mcount.n - at + delta) * sizeof(int));
+    }
+    mcount.n = buf.count;
+    mcount.tree_valid = false;                 // prefix sums of later lines moved
+}
+
+/* "12408" -> "12,408" */
+static void fmt_thousands(char *out, size_t cap, long v) {
+    char digits[24];
+    int n = snprintf(digits, sizeof(digits), "%ld", v);
+    size_t o = 0;
+    for (int i = 0; i < n && o + 1 < cap; i++) {
+        if (i > 0 && digits[i - 1] != '-' && (n - i) % 3 == 0 && o + 2 < cap)
+            out[o++] = ',';                    // group separator every three digits
+        out[o++] = digits[i];
+    }
+    out[o] = '\0';
+}
+
+/* Status for the match the search just moved to (hl_row/hl_col): "Match 3 of 12,408" */
+static void mcount_report(void) {
+    if (hl_row < 0 || last_query[0] == '\0') return;
+    if (!mcount.active || mcount.stale || mcount.regex != last_query_regex
+        || strcmp(mcount.query, last_query) != 0 || mcount.fold != query_fold(last_query, last_query_regex))
+        mcount_start(last_query, last_query_regex); // new query, or the counts lost track
+    if (!mcount.active) return;
+    mcount_merge();
+    char nth[32] = "?", total[32];             // N is unknown until the lines above it are counted
+    long n = 0, m = mcount.total;
+    if (!mcount.running || mcount.merged >= hl_row) {
+        n = mcount_prefix(hl_row) + 1
+            + mcount_line(&mcount.plan, mcount.regex ? &mcount.re : NULL,
+                          buf.lines[hl_row], buf.len[hl_row], (size_t)hl_col);
+        fmt_thousands(nth, sizeof(nth), n);
+    }
+    if (mcount.running && n > m) m = n;        // this line may not be counted yet: at least N so far
+    fmt_thousands(total, sizeof(total), m);
+    if (mcount.running)
+        editor_set_status("Match %s of %s+ (counting): %s", nth, total, last_query);
+    else
+        editor_set_status("Match %s of %s: %s  (Ctrl-N for next)", nth, total, last_query);
+    snprintf(mcount.msg, sizeof(mcount.msg), "%s", statusmsg);
+}
+
+/* Worker progress: take it in, and refresh the status while it still shows the count */
+static void on_mcount_note(void *arg) {
+    (void)arg;
+    note_drain(mcount.note[0]);
+    mcount_merge();
+    if (mcount.active && statusmsg[0] && strcmp(statusmsg, mcount.msg) == 0) {
+        mcount_report();
+        key_push(1012);                        // match count progressed: redraw
+    }
+}
+
+/* ----------------------- Prompt & Search ----------------------- */
+
+/*
+ * Simple prompt at bottom that returns a string (like "/" in vim). on_idle
+ * (optional) runs whenever no key is waiting, after the input is on screen;
+ * the text it returns is shown after the input. Enter on empty input only
+ * counts with allow_empty.
+ */
+static bool editor_prompt(const char *prompt, char *out, size_t outlen, bool allow_empty,
+                          const char *(*on_idle)(const char *input)) {
+    size_t n = 0;                              // current length of user input
+    char hint[80] = "";                        // on_idle's last answer
+    out[0] = '\0';                             // start empty
+    while (1) {                                // loop until user confirms or cancels
+        if (!input_pending()) {                // typed-ahead keys: apply them before drawing
+            editor_set_status("%s%s%s", prompt, out, hint); // show prompt + current input
+            editor_draw_screen();              // redraw: the key shows up at once
+            if (on_idle) {                     // e.g. incremental search, possibly slow
+                snprintf(hint, sizeof(hint), "%s", on_idle(out));
+                if (!input_pending()) {        // not interrupted: show its result
+                    editor_set_status("%s%s%s", prompt, out, hint);
+                    editor_draw_screen();
+                }
+            }
+        }
+        int c = editor_read_key();             // read key
+        if (c == '\x1b') {                     // ESC -> cancel
+            editor_set_status("Canceled");     // say canceled
+            return false;                      // signal cancel
+        }
+        if (c == '\r' || c == '\n') {          // Enter
+            if (n > 0 || allow_empty) {        // only accept if user typed something
+                editor_set_status("");         // clear status
+                return true;                   // success
+            }
+        } else if (c == 1011) {                // paste: first line of it
+            size_t len;                        // payload length
+            char *text = paste_take(&len);
+            for (size_t i = 0; text && i < len && text[i] != '\n' && n + 1 < outlen; i++)
+                out[n++] = text[i];            // append as if typed
+            out[n] = '\0';                     // keep NUL
+            free(text);
+        } else if (c == 127) {                 // Backspace inside prompt
+            while (n > 0) {                    // if we have chars
+                unsigned char dropped = (unsigned char)out[--n]; // last byte
+                out[n] = '\0';                 // drop it
+                if ((dropped & 0xC0) != 0x80) break; // stop once a whole code point is gone
+            }
+        } else if ((c < 0x80 && isprint(c)) || (c >= 0x80 && c <= 0xFF)) { // printable or UTF-8 byte
+            if (n + 1 < outlen) {              // if we have room
+                out[n++] = (char)c;            // append char
+                out[n] = '\0';                 // keep NUL
+            }
+        }
+    }
+}
+
+/* Put cursor and highlight on the match at flat offset 'off' */
+static void editor_goto_match(size_t off, size_t m) {
+    int r = search_text_row(off);              // its line
+    last_match_row = r;                        // remember match row
+    last_match_col = (int)(off - stext.line_start[r]); // remember match col
+    hl_row = r; hl_col = last_match_col; hl_len = (int)m; // set highlight
+    view.cy = r;                               // move cursor to match
+    view.cx = last_match_col;                  // set col
+    view.pref_cx = line_col_of(&buf, r, view.cx); // keep that column on up/down
+}
+
+/* Find next occurrence of last_query; from_current = search from current cursor */
+static bool editor_find_next(bool from_current) {
+    if (last_query[0] == '\0') return false;   // nothing to search
+
+    int r = from_current ? view.cy : last_match_row;             // start row
+    int c = from_current ? view.cx : (last_match_col + 1);       // start col
+    if (r < 0) r = 0;                          // clamp: the text may have changed since
+    if (r >= buf.count) r = buf.count - 1;
+    if (c < 0) c = 0;
+    if (c > buf.len[r]) c = buf.len[r];
+
+    search_text_sync();                        // flat copy of the buffer
+    size_t start = stext.line_start[r] + c;    // where to start in the flat text
+    if (last_query_regex && !from_current && last_match_col + 1 > buf.len[r])
+        start = stext.line_start[r + 1];       // empty match at a line end: go on from the next line
+    size_t off, m;                             // match offset and length
+    if (!search_from(last_query, last_query_regex, start, &off, &m, NULL)) return false; // not found
+    editor_goto_match(off, m);
+    return true;                               // success
+}
+
+/* Find the match before the last one (wrapping to the bottom), scanning backwards */
+static bool editor_find_prev(void) {
+    if (last_query[0] == '\0') return false;   // nothing to search
+
+    int r = last_match_row >= 0 ? last_match_row : view.cy; // the last match, or the cursor
+    int c = last_match_row >= 0 ? last_match_col : view.cx;
+    if (r >= buf.count) r = buf.count - 1;     // clamp: the text may have changed since
+    if (c < 0) c = 0;
+    if (c > buf.len[r]) c = buf.len[r];
+
+    search_text_sync();                        // flat copy of the buffer
+    size_t start = stext.line_start[r] + c;    // matches must start before this
+    size_t off, m;                             // match offset and length
+    if (!search_last(last_query, last_query_regex, 0, start, &off, &m)                // up to the top
+        && !search_last(last_query, last_query_regex, start, stext.len + 1, &off, &m)) // wrap to bottom
+        return false;                          // not found
+    editor_goto_match(off, m);
+    return true;
+}
+
+/* Alt-C: next case mode for searches; the marks on screen and the match count follow */
+static void editor_cycle_case(void) {
+    static const char *names[] = { "match case", "ignore case", "smart case (ignore case unless the query has capitals)" };
+    search_case = (CaseMode)((search_case + 1) % 3);
+    hl_set_query(last_query, last_query_regex); // marks under the new mode
+    editor_set_status("Search: %s", names[search_case]);
+}
+
+/* Put the view back where it was when the search prompt opened */
+static void isearch_restore(void) {
+    view.cy = isearch.saved.cy;
+    view.cx = isearch.saved.cx;
+    view.rowoff = isearch.saved.rowoff;
+    view.coloff = isearch.saved.coloff;
+    view.pref_cx = isearch.saved.pref_cx;
+    hl_row = hl_col = hl_len = -1;             // clear highlight
+}
+
+/* Move to the known result for the query's first n bytes; returns the prompt hint */
+static const char *isearch_show(size_t n) {
+    if (isearch.at[n] == SIZE_MAX) {           // no match: stay where the search began
+        isearch_restore();
+        return "  [no match]";
+    }
+    int r = search_text_row(isearch.at[n]);    // the match's line
+    view.cy = r;
+    view.cx = (int)(isearch.at[n] - stext.line_start[r]);
+    view.pref_cx = line_col_of(&buf, r, view.cx); // keep that column on up/down
+    hl_row = r; hl_col = view.cx; hl_len = (int)isearch.len[n]; // highlight it
+    return "";
+}
+
+/* Prompt hint for a regex that does not parse (yet) */
+static const char *isearch_error(void) {
+    static char hint[64];                      // "  [missing )]"
+    snprintf(hint, sizeof(hint), "  [%s]", qregex.err ? qregex.err : "bad regex");
+    return hint;
+}
+
+/*
+ * Search-as-you-type (prompt idle callback). A literal query that grows can
+ * only match where its shorter prefix matched or later in scan order, so the
+ * search continues from the last known prefix match instead of the cursor;
+ * Backspace goes back to results already known. Input arriving mid-scan
+ * interrupts the search; it runs again once the prompt is idle.
+ */
+static const char *editor_isearch(const char *q) {
+    size_t n = strlen(q);                      // query length
+    size_t keep = 0;                           // bytes shared with the query the entries are for
+    while (keep < n && isearch.query[keep] == q[keep]) keep++;
+    if (keep == n && isearch.query[n] == '\0' && !isearch.stale) // nothing changed
+        return n == 0 ? "" : isearch.known[n] ? isearch_show(n) : isearch_error();
+    for (size_t k = keep + 1; k < sizeof(isearch.known); k++)
+        isearch.known[k] = false;              // entries for the longer, different query
+    snprintf(isearch.query, sizeof(isearch.query), "%s", q);
+    isearch.stale = false;
+    hl_set_query(q, isearch.regex);            // mark the query's matches on screen as it is typed
+    if (n == 0) {                              // empty: back to the start
+        isearch_restore();
+        return "";
+    }
+    if (!isearch.known[n]) {
+        size_t start = isearch.origin;         // scan from the cursor...
+        if (isearch.regex) {
+            if (!rx_for(&qregex, q))           // half-typed pattern
+                return isearch_error();        // shown after the input until it parses
+        } else {
+            for (size_t k = n - 1; k >= 1; k--) { // ...or from the longest known prefix's match
+                if (!isearch.known[k]) continue;
+                start = isearch.at[k];
+                break;
+            }
+        }
+        size_t off = 0, len = 0;               // match found
+        bool cancelled;                        // input arrived first
+        bool found = start != SIZE_MAX         // a prefix without matches: none for this either
+                     && search_from(q, isearch.regex, start, &off, &len, &cancelled);
+        if (start != SIZE_MAX && cancelled) {  // try again when the keys are handled
+            isearch.stale = true;
+            return "  [searching]";
+        }
+        isearch.at[n] = found ? off : SIZE_MAX;
+        isearch.len[n] = len;
+        isearch.known[n] = true;
+    }
+    return isearch_show(n);
+}
+
+/* Ask user for query (a regex if 'regex'), searching as it is typed */
+static void editor_find(bool regex) {
+    search_text_sync();                        // flat copy of the buffer
+    memset(&isearch, 0, sizeof(isearch));      // fresh search
+    isearch.regex = regex;
+    isearch.origin = stext.line_start[view.cy] + view.cx;
+    isearch.saved = view;
+    char query[256] = "";                      // buffer for query
+    if (!editor_prompt(regex ? "re/" : "/", query, sizeof(query), false, editor_isearch)) { // if user cancels
+        isearch_restore();                     // back where we were
+        hl_set_query(last_query, last_query_regex); // mark the previous query's matches again
+        return;                                // done
+    }
+    if (regex && !rx_for(&qregex, query)) {    // syntax error: keep the previous search
+        editor_set_status("Bad regex: %s", qregex.err);
+        isearch_restore();
+        hl_set_query(last_query, last_query_regex);
+        return;
+    }
+    snprintf(last_query, sizeof(last_query), "%s", query); // store last query
+    last_query_regex = regex;                  // Ctrl-N repeats the same kind
+    hl_set_query(query, regex);                // its matches stay marked
+    size_t n = strlen(query);
+    bool found;                                // did the search find something
+    if (isearch.known[n] && !isearch.stale && strcmp(isearch.query, query) == 0) {
+        found = isearch.at[n] != SIZE_MAX;     // already searched while typing
+        isearch_show(n);                       // cursor and highlight on it
+        last_match_row = view.cy;              // Ctrl-N continues from here
+        last_match_col = view.cx;
+    } else {                                   // Enter came before the search finished
+        isearch_restore();
+        last_match_row = view.cy;              // start from current
+        last_match_col = view.cx - 1;          // will be incremented by search
+        found = editor_find_next(true);        // try to find
+    }
+    if (!found) {
+        editor_set_status("Not found: %s", last_query); // message
+        hl_row = hl_col = hl_len = -1;         // clear highlight
+    } else {
+        mcount_report();                       // "Match 3 of 12,408", filled in as it is counted
+    }
+}
+
+/* ----------------------- Replace ----------------------- */
+
+/*
+ * Replace all runs as one pass: the flat search text is scanned once with the
+ * query's plan, matches are collected per line, and each line that has any
+ * is rebuilt once into an allocation of its exact new size (length plus
+ * matches times the size difference). No memmove per match, and lines
+ * without a match are not touched.
+ */
+
+/* Rebuild line 'row' with its matches (columns at[0..n), each m bytes long) replaced by w[0..wl) */
+static void replace_line(int row, const size_t *at, int n, size_t m, const char *w, size_t wl) {
+    const char *old = buf.lines[row];
+    size_t len = (size_t)buf.len[row];
+    size_t out_len = len + n * wl - n * m;       // exact size: no growing while copying
+    char *out = (char*)malloc(out_len + 1);
+    size_t from = 0, o = 0;                      // read position in old, write position in out
+    for (int k = 0; k < n; k++) {
+        memcpy(out + o, old + from, at[k] - from); // text before the match
+        o += at[k] - from;
+        memcpy(out + o, w, wl);                  // the replacement
+        o += wl;
+        from = at[k] + m;
+    }
+    memcpy(out + o, old + from, len - from);     // the rest of the line
+    out[out_len] = '\0';
+    buffer_set_line(&buf, row, out, (int)out_len);
+}
+
+/* Replace every occurrence of q (literal, non-overlapping) with w; returns how many, and in *lines the lines changed */
+static long replace_all(const char *q, const char *w, int *lines) {
+    search_text_sync();                          // flat copy: one kernel call covers many lines
+    const SearchPlan *pl = plan_for(q);
+    size_t m = pl->m, wl = strlen(w);
+    const char *t = stext.text;
+    static size_t *at = NULL;                    // match columns in the line being collected (reused)
+    static int at_cap = 0;
+    int nat = 0, at_row = -1;                    // how many, and their line
+    long total = 0;
+    *lines = 0;
+    int row = 0;                                 // line of the latest match
+    for (size_t pos = 0; ; ) {
+        const char *p = pos <= stext.len ? plan_find(pl, t + pos, stext.len - pos) : NULL;
+        size_t off = p ? (size_t)(p - t) : 0;
+        if (p)                                   // lines only grow: walk forward to it
+            while (stext.line_start[row + 1] <= off) row++;
+        if (nat > 0 && (!p || row != at_row)) {  // that line is complete: rebuild it once
+            replace_line(at_row, at, nat, m, w, wl);
+            total += nat;
+            (*lines)++;
+            nat = 0;
+        }
+        if (!p) break;
+        if (nat == at_cap) {
+            at_cap = at_cap * 2 + 64;
+            at = (size_t*)realloc(at, at_cap * sizeof(size_t));
+        }
+        at[nat++] = off - stext.line_start[row];
+        at_row = row;
+        pos = off + m;                           // matches do not overlap
+    }
+    return total;                                // the flat copy is rebuilt on the next search
+}
+
+/* Replace the match under the highlight with w */
+static void replace_current(const char *w) {
+    int er, ec;                                  // end of the inserted text (unused)
+    buffer_delete_range(&buf, hl_row, hl_col, hl_row, hl_col + hl_len);
+    buffer_insert_text(&buf, hl_row, hl_col, w, strlen(w), &er, &ec);
+}
+
+/*
+ * Ctrl-E: ask for a query and its replacement, then go from match to match
+ * (from the cursor, wrapping once to where it started): y replaces this one,
+ * n skips it, a replaces all of them in the whole buffer, q or Escape stops.
+ */
+static void editor_replace(void) {
+    char q[256] = "", w[256] = "";               // query and replacement
+    if (!editor_prompt("Replace: ", q, sizeof(q), false, NULL)) return;
+    if (!editor_prompt("Replace with: ", w, sizeof(w), true, NULL)) return;
+    snprintf(last_query, sizeof(last_query), "%s", q); // Ctrl-N / Ctrl-B and the marks follow it
+    last_query_regex = false;
+    hl_set_query(q, false);
+    size_t wl = strlen(w);
+    undo_group_begin();                          // the whole command is one undo step
+    long done = 0;                               // replaced one by one
+    int origin_row = view.cy, origin_col = view.cx; // stop when the search comes back here
+    int pr = origin_row, pc = origin_col - 1;    // previous stop, to notice the wrap to the top
+    bool wrapped = false;
+    last_match_row = view.cy;
+    last_match_col = view.cx - 1;                // the first match may be right at the cursor
+    while (editor_find_next(false)) {
+        int r = last_match_row, c = last_match_col;
+        if (!wrapped && (r < pr || (r == pr && c <= pc)))
+            wrapped = true;                      // came around the end of the buffer
+        if (wrapped && (r > origin_row || (r == origin_row && c >= origin_col)))
+            break;                               // back where we started
+        pr = r;
+        pc = c;
+        editor_set_status("Replace with \"%s\"? y = this one, n = skip, a = all, q = stop", w);
+        editor_draw_screen();
+        int k;
+        do {
+            k = editor_read_key();
+            if (k == 1011) {                     // a paste is no answer: drop it
+                size_t len;
+                free(paste_take(&len));
+            } else if (k == 1009) {              // resized: show the question at the new size
+                editor_draw_screen();
+            }
+        } while (k != 'y' && k != 'n' && k != 'a' && k != 'q' && k != '\x1b');
+        if (k == 'q' || k == '\x1b') break;
+        if (k == 'a') {                          // everything, in one pass
+            long t0 = monotonic_us();
+            int lines;
+            long n = replace_all(q, w, &lines);
+            long us = monotonic_us() - t0;
+            char ns[32], ls[32];
+            fmt_thousands(ns, sizeof(ns), n + done);
+            fmt_thousands(ls, sizeof(ls), lines);
+            if (view.cy >= buf.count) view.cy = buf.count - 1;
+            view.cx = line_byte_at(&buf, view.cy, view.pref_cx); // same place on screen, on a glyph boundary
+            hl_row = hl_col = hl_len = -1;
+            editor_set_status("Replaced %s occurrences on %s lines in %.1f ms", ns, ls, us / 1000.0);
+            undo_group_end();
+            return;
+        }
+        if (k == 'y') {
+            replace_current(w);
+            done++;
+            if (r == origin_row && c < origin_col)
+                origin_col += (int)wl - (int)strlen(q); // the start point moved with the text
+            last_match_col = c + (int)wl - 1;    // go on after the replacement
+            pc = last_match_col;
+        }
+    }
+    char ns[32];
+    fmt_thousands(ns, sizeof(ns), done);
+    hl_row = hl_col = hl_len = -1;
+    editor_set_status("Replaced %s occurrence%s", ns, done == 1 ? "" : "s");
+    undo_group_end();
+}
+
+/* ----------------------- Tree walk ----------------------- */
+
+/*
+ * Project search and the file picker walk the tree under the working
+ * directory with a pool of threads (one per CPU, or AURIGA_THREADS). The
+ * threads share a stack of directories: each takes one, hands it to the
+ * walk's visit function, which reads it and queues the subdirectories, and
+ * the walk is over once no directory is queued or being visited. .git,
+ * symlinks and whatever the .gitignore files of the walked directories
+ * exclude are left out.
+ */
+
+/* gitignore-style glob: '*' and '?' stop at '/', "**" does not, "[a-z]" and "[!x]" are classes */
+static bool glob_match(const char *p, const char *s) {
+    for (; *p; p++, s++) {
+        if (*p == '*' && p[1] == '*') {          // any run of characters, '/' included
+            p += 2;
+            if (*p == '/') {                     // "**/": zero or more whole directories
+                for (p++;; s++) {
+                    if (glob_match(p, s)) return true;
+                    if (!(s = strchr(s, '/'))) return false;
+                }
+            }
+            for (;; s++) {
+                if (glob_match(p, s)) return true;
+                if (!*s) return false;
+            }
+        }
+        if (*p == '*') {                         // any run inside one path component
+            for (p++;; s++) {
+                if (glob_match(p, s)) return true;
+                if (!*s || *s == '/') return false;
+            }
+        }
+        if (!*s) return false;
+        if (*p == '?') {
+            if (*s == '/') return false;
+            continue;
+        }
+        if (*p == '[' && strchr(p + 2, ']')) {   // a class (an unclosed '[' is literal)
+            const char *q = p + 1;
+            bool neg = *q == '!' || *q == '^', in = false;
+            if (neg) q++;
+            for (bool first = true; *q && (first || *q != ']'); q++, first = false) {
+                if (q[1] == '-' && q[2] && q[2] != ']') { // range
+                    if ((unsigned char)*s >= (unsigned char)q[0] && (unsigned char)*s <= (unsigned char)q[2]) in = true;
+                    q += 2;
+                } else if (*q == *s) {
+                    in = true;
+                }
+            }
+            if (!*q || in == neg || *s == '/') return false; // "[!]": no closing ']' left
+            p = q;                               // the closing ']'
+            continue;
+        }
+        if (*p == '\\' && p[1]) p++;             // escaped character
+        if (*p != *s) return false;
+    }
+    return *s == '\0';
+}
+
+/* Rules of the .gitignore in directory 'path' (open as dfd), on top of 'parent'; NULL if it has none */
+static WalkIgnore *walk_read_ignore(int dfd, const char *path, WalkIgnore *parent) {
+    int fd = openat(dfd, ".gitignore", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    char *t = NULL;
+    size_t n = 0, cap = 0;
+    ssize_t r;
+    do {                                         // the whole file (it is small)
+        if (n + 4096 > cap) t = (char*)realloc(t, cap = cap * 2 + 4096);
+        r = read(fd, t + n, cap - n - 1);
+        if (r > 0) n += (size_t)r;
+    } while (r > 0);
+    close(fd);
+    t[n] = '\0';
+    WalkIgnore *ig = (WalkIgnore*)calloc(1, sizeof(WalkIgnore));
+    ig->parent = parent;
+    ig->base = strdup(path);
+    ig->base_len = (int)strlen(path);
+    for (char *line = t, *nl; line; line = nl) {
+        if ((nl = strchr(line, '\n'))) *nl++ = '\0';
+        size_t len = strlen(line);
+        while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\r' || line[len - 1] == '\t'))
+            line[--len] = '\0';                  // trailing blanks do not count
+        if (len == 0 || line[0] == '#') continue; // blank line, comment
+        WalkRule ru = {0};
+        if (line[0] == '!') { ru.neg = true; line++; len--; }
+        else if (line[0] == '\\') { line++; len--; } // "\#", "\!": literal first character
+        if (len > 0 && line[len - 1] == '/') { ru.dir_only = true; line[--len] = '\0'; }
+        ru.anchored = strchr(line, '/') != NULL;
+        if (line[0] == '/') line++;              // "/x": only directly under base
+        if (!*line) continue;
+        ig->rule = (WalkRule*)realloc(ig->rule, (ig->n + 1) * sizeof(WalkRule));
+        ru.pat = strdup(line);
+        ig->rule[ig->n++] = ru;
+    }
+    free(t);
+    return ig;
+}
+
+/* Free a list of rule sets (linked by 'next') */
+static void walk_free_ignores(WalkIgnore *ig) {
+    for (WalkIgnore *next; ig; ig = next) {
+        next = ig->next;
+        for (int i = 0; i < ig->n; i++) free(ig->rule[i].pat);
+        free(ig->rule);
+        free(ig->base);
+        free(ig);
+    }
+}
+
+/* Do the rules in force exclude 'path' (relative to the root)? */
+static bool walk_ignored(const WalkIgnore *ig, const char *path, bool is_dir) {
+    for (; ig; ig = ig->parent) {                // deepest .gitignore first
+        const char *rel = ig->base_len ? path + ig->base_len + 1 : path; // path below its directory
+        const char *name = strrchr(rel, '/');
+        name = name ? name + 1 : rel;
+        for (int i = ig->n - 1; i >= 0; i--) {   // the last matching rule decides
+            const WalkRule *ru = &ig->rule[i];
+            if (ru->dir_only && !is_dir) continue;
+            if (glob_match(ru->pat, ru->anchored ? rel : name))
+                return !ru->neg;
+        }
+    }
+    return false;
+}
+
+/* Type of entry 'de' of directory dfd: DT_DIR, DT_REG, or something the walks skip */
+static unsigned char walk_type(int dfd, const struct dirent *de) {
+    const char *name = de->d_name;
+    if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) return DT_UNKNOWN; // "." and ".."
+    if (strcmp(name, ".git") == 0) return DT_UNKNOWN; // repository metadata
+    unsigned char type = de->d_type;
+    if (type == DT_UNKNOWN) {                    // some file systems leave it to stat
+        struct stat st;
+        if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) return DT_UNKNOWN;
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+    }
+    return type == DT_DIR || type == DT_REG ? type : DT_UNKNOWN; // not symlinks, devices, sockets
+}
+
+/* "dir/name" into out (cap bytes); false if it does not fit */
+static bool walk_join(char *out, size_t cap, const char *dir, const char *name) {
+    return snprintf(out, cap, "%s%s%s", dir, dir[0] ? "/" : "", name) < (int)cap;
+}
+
+/* Queue directory 'path' (copied) for whichever worker is free */
+static void walk_push(Walk *w, const char *path, WalkIgnore *ign, void *data) {
+    pthread_mutex_lock(&w->lock);
+    if (w->ndirs == w->dirs_cap) {
+        w->dirs_cap = w->dirs_cap ? w->dirs_cap * 2 : 64;
+        w->dirs = (WalkDir*)realloc(w->dirs, w->dirs_cap * sizeof(WalkDir));
+    }
+    w->dirs[w->ndirs++] = (WalkDir){ strdup(path), ign, data };
+    w->pending++;
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* Worker thread: visit queued directories until the walk is over */
+static void *walk_worker(void *arg) {
+    Walk *w = (Walk*)arg;
+    char *rbuf = NULL;                           // the visit function's per-thread buffer
+    size_t rcap = 0;
+    pthread_mutex_lock(&w->lock);
+    while (1) {
+        while (w->ndirs == 0 && w->pending > 0 && !atomic_load(&w->cancel))
+            pthread_cond_wait(&w->wake, &w->lock); // others may still queue some
+        if (w->ndirs == 0 || atomic_load(&w->cancel)) break;
+        WalkDir d = w->dirs[--w->ndirs];         // depth first: the stack stays small
+        pthread_mutex_unlock(&w->lock);
+        w->visit(&d, &rbuf, &rcap);
+        free(d.path);
+        pthread_mutex_lock(&w->lock);
+        if (--w->pending == 0)                   // walk over: wake the others to leave
+            pthread_cond_broadcast(&w->wake);
+    }
+    pthread_cond_broadcast(&w->wake);            // cancelled: the others leave too
+    bool last = --w->running == 0;
+    pthread_mutex_unlock(&w->lock);
+    free(rbuf);
+    if (last && w->finished) w->finished();
+    return NULL;
+}
+
+/* Stop the walk (if one runs) and drop what it had queued */
+static void walk_stop(Walk *w) {
+    if (!w->init) return;
+    atomic_store(&w->cancel, true);
+    pthread_mutex_lock(&w->lock);
+    pthread_cond_broadcast(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+    for (int i = 0; i < w->nthreads; i++) pthread_join(w->tid[i], NULL);
+    w->nthreads = 0;
+    for (int i = 0; i < w->ndirs; i++) free(w->dirs[i].path); // never visited
+    w->ndirs = w->pending = w->running = 0;
+}
+
+/* Walk from the working directory (root data 'data'), in the background */
+static void walk_start(Walk *w, void *data) {
+    walk_stop(w);
+    if (!w->init) {
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->wake, NULL);
+        w->init = true;
+    }
+    atomic_store(&w->cancel, false);
+    int want = threads_wanted();
+    w->running = want;                           // counted down as they finish
+    walk_push(w, "", NULL, data);                // the root
+    for (int i = 0; i < want; i++) {
+        if (pthread_create(&w->tid[i], NULL, walk_worker, w) != 0) break;
+        w->nthreads++;
+    }
+    if (w->nthreads == 0) {                      // no thread: walk right here
+        w->running = 1;
+        walk_worker(w);
+    } else if (w->nthreads < want) {
+        pthread_mutex_lock(&w->lock);
+        w->running -= want - w->nthreads;        // those that did not start
+        bool over = w->running == 0;             // the others finished first
+        pthread_mutex_unlock(&w->lock);
+        if (over && w->finished) w->finished();
+    }
+}
+
+/* Is a walk still going? */
+static bool walk_busy(Walk *w) {
+    if (!w->init) return false;
+    pthread_mutex_lock(&w->lock);
+    bool busy = w->running > 0;
+    pthread_mutex_unlock(&w->lock);
+    return busy;
+}
+
+/* ----------------------- Project search ----------------------- */
+
+/*
+ * Ctrl-G searches every file under the working directory for a literal query
+ * (in the current case mode) with the same kernel as in-buffer search, on a
+ * tree walk. Small files are read into the thread's buffer and big ones are
+ * mapped, since mapping costs more than copying a few pages. Files with a
+ * NUL byte near the start are taken as binary and skipped. Results go to a
+ * shared list that the Ctrl-G screen shows while it grows; Enter opens the
+ * file at the line.
+ */
+
+/* Record a matching line of 'path' (registered on its first hit, *file = -1 before) */
+static void grep_add_hit(const char *path, int *file, int line, int col, const char *ls, size_t len) {
+    int skip = 0;                                // long line: keep some context before the match
+    if (col > GREP_TEXT_MAX / 2) {
+        skip = col - GREP_TEXT_MAX / 4;
+        while (skip < col && ((unsigned char)ls[skip] & 0xC0) == 0x80) skip++; // on a character boundary
+    }
+    size_t n = len - skip < GREP_TEXT_MAX ? len - skip : GREP_TEXT_MAX;
+    pthread_mutex_lock(&grep.lock);
+    if (grep.nhits >= GREP_MAX_HITS) {           // enough: stop the walk
+        grep.truncated = true;
+        atomic_store(&grep.walk.cancel, true);
+        pthread_mutex_unlock(&grep.lock);
+        return;
+    }
+    if (*file < 0) {
+        if (grep.nfiles == grep.files_cap) {
+            grep.files_cap = grep.files_cap ? grep.files_cap * 2 : 64;
+            grep.files = (char**)realloc(grep.files, grep.files_cap * sizeof(char*));
+        }
+        grep.files[grep.nfiles] = strdup(path);
+        *file = grep.nfiles++;
+    }
+    if (grep.nhits == grep.hits_cap) {
+        grep.hits_cap = grep.hits_cap ? grep.hits_cap * 2 : 256;
+        grep.hits = (GrepHit*)realloc(grep.hits, grep.hits_cap * sizeof(GrepHit));
+    }
+    if (grep.text_len + n > grep.text_cap) {
+        grep.text_cap = (grep.text_len + n) * 2;
+        grep.text = (char*)realloc(grep.text, grep.text_cap);
+    }
+    char *t = grep.text + grep.text_len;         // the list shows one byte per byte: tabs and controls blanked
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = (unsigned char)ls[skip + i];
+        t[i] = c < 0x20 || c == 0x7f ? ' ' : (char)c;
+    }
+    grep.hits[grep.nhits++] = (GrepHit){ *file, line, col, skip, grep.text_len, (int)n };
+    grep.text_len += n;
+    pthread_mutex_unlock(&grep.lock);
+}
+
+/* Search file 'name' of directory dfd ('path' from the root); 'rbuf' is the thread's read buffer */
+static void grep_file(int dfd, const char *name, const char *path, char **rbuf, size_t *rcap) {
+    int fd = openat(dfd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+    if (fd < 0) return;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) { close(fd); return; }
+    size_t n = (size_t)st.st_size;
+    const char *t;                               // the file's bytes
+    bool mapped = n >= GREP_MMAP_MIN;
+    if (mapped) {
+        void *m = mmap(NULL, n, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (m == MAP_FAILED) return;
+        t = (const char*)m;
+    } else {
+        if (n > *rcap) *rbuf = (char*)realloc(*rbuf, *rcap = n * 2);
+        size_t got = 0;
+        ssize_t r;
+        while (got < n && (r = read(fd, *rbuf + got, n - got)) > 0) got += (size_t)r;
+        close(fd);
+        n = got;                                 // it may have shrunk meanwhile
+        t = *rbuf;
+    }
+    atomic_fetch_add(&grep.scanned, 1);
+    if (!memchr(t, '\0', n < GREP_BINARY_PROBE ? n : GREP_BINARY_PROBE)) { // text
+        int file = -1, line = 1;                 // registered on the first hit; line of 'ls'
+        size_t ls = 0, counted = 0;              // start of that line; newlines before 'counted' are in 'line'
+        for (size_t pos = 0; pos < n && !atomic_load(&grep.walk.cancel); ) {
+            const char *p = plan_find(&grep.plan, t + pos, n - pos);
+            if (!p) break;
+            size_t o = (size_t)(p - t);
+            for (const char *q; (q = (const char*)memchr(t + counted, '\n', o - counted)); ) {
+                line++;                          // newlines up to the match
+                counted = ls = (size_t)(q - t) + 1;
+            }
+            counted = o;
+            const char *e = (const char*)memchr(t + o, '\n', n - o);
+            size_t le = e ? (size_t)(e - t) : n; // end of the matching line
+            size_t len = le > ls && t[le - 1] == '\r' ? le - ls - 1 : le - ls;
+            grep_add_hit(path, &file, line, (int)(o - ls), t + ls, len);
+            pos = le + 1;                        // one hit per line
+        }
+        if (file >= 0) note_send(grep.note[1], &grep.lock, &grep.last_note, GREP_NOTE_MS, false);
+    }
+    if (mapped) munmap((void*)t, (size_t)st.st_size);
+}
+
+/* Walk visit: search the files of a directory, queue its subdirectories */
+static void grep_dir(const WalkDir *d, char **rbuf, size_t *rcap) {
+    DIR *dir = opendir(d->path[0] ? d->path : ".");
+    if (!dir) return;
+    int dfd = dirfd(dir);
+    WalkIgnore *ign = walk_read_ignore(dfd, d->path, d->ign);
+    if (ign) {                                   // freed with the results
+        pthread_mutex_lock(&grep.lock);
+        ign->next = grep.ignores;
+        grep.ignores = ign;
+        pthread_mutex_unlock(&grep.lock);
+    } else {
+        ign = d->ign;                            // the same rules as above
+    }
+    char path[PATH_MAX];
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL && !atomic_load(&grep.walk.cancel)) {
+        unsigned char type = walk_type(dfd, de);
+        if (type == DT_UNKNOWN || !walk_join(path, sizeof(path), d->path, de->d_name)) continue;
+        if (walk_ignored(ign, path, type == DT_DIR)) continue;
+        if (type == DT_REG)
+            grep_file(dfd, de->d_name, path, rbuf, rcap);
+        else
+            walk_push(&grep.walk, path, ign, NULL);
+    }
+    closedir(dir);
+}
+
+/* Walk over: the final count */
+static void grep_finished(void) {
+    note_send(grep.note[1], &grep.lock, &grep.last_note, GREP_NOTE_MS, true);
+}
+
+/* Stop the walk and drop the results */
+static void grep_stop(void) {
+    walk_stop(&grep.walk);
+    walk_free_ignores(grep.ignores);
+    grep.ignores = NULL;
+    for (int i = 0; i < grep.nfiles; i++) free(grep.files[i]);
+    grep.nfiles = grep.nhits = 0;
+    grep.text_len = 0;
+    grep.active = false;
+}
+
+static void on_grep_note(void *arg);
+
+/* Start searching the tree for 'q' */
+static void grep_start(const char *q) {
+    grep_stop();
+    if (grep.note[0] < 0) {                      // first use: results pipe into the event loop
+        note_pipe_open(grep.note, on_grep_note);
+        pthread_mutex_init(&grep.lock, NULL);
+        grep.walk.visit = grep_dir;
+        grep.walk.finished = grep_finished;
+    }
+    snprintf(grep.query, sizeof(grep.query), "%s", q);
+    plan_compile(&grep.plan, q, strlen(q), query_fold(q, false));
+    atomic_store(&grep.scanned, 0);
+    grep.truncated = false;
+    grep.last_note = 0;
+    grep.sel = grep.top = 0;
+    grep.active = true;
+    walk_start(&grep.walk, NULL);
+}
+
+/* New results: the list redraws */
+static void on_grep_note(void *arg) {
+    (void)arg;
+    note_drain(grep.note[0]);
+    key_push(1013);                              // project search progressed: redraw
+}
+
+/* Draw the results list over the text area, with its own status and message lines */
+static void grep_draw(void) {
+    if (sync_output) ob_append("\x1b[?2026h", 8);
+    ob_append("\x1b[?25l", 6);                   // no cursor in the list
+    pthread_mutex_lock(&grep.lock);              // workers append meanwhile
+    if (grep.sel >= grep.nhits) grep.sel = grep.nhits ? grep.nhits - 1 : 0;
+    if (grep.sel < grep.top) grep.top = grep.sel;
+    if (grep.sel >= grep.top + view.screenrows) grep.top = grep.sel - view.screenrows + 1;
+    for (int y = 0; y < view.screenrows; y++) {
+        ob_printf("\x1b[%d;1H\x1b[2K", y + 1);
+        int i = grep.top + y;
+        if (i >= grep.nhits) continue;
+        const GrepHit *h = &grep.hits[i];
+        char row[PATH_MAX + GREP_TEXT_MAX + 32];
+        int pn = snprintf(row, sizeof(row), "%s:%d: %s", grep.files[h->file], h->line, h->skip ? "..." : "");
+        if (pn >= (int)sizeof(row) - GREP_TEXT_MAX) pn = (int)sizeof(row) - GREP_TEXT_MAX - 1;
+        memcpy(row + pn, grep.text + h->text, h->text_len);
+        int pw = text_width(row, pn);            // the "file:line: " part
+        int mcol = h->col - h->skip;             // match inside the kept text
+        int span[2] = { pw, pw };
+        if (mcol < h->text_len) {
+            int mlen = (int)grep.plan.m < h->text_len - mcol ? (int)grep.plan.m : h->text_len - mcol;
+            span[0] = pw + text_width(row + pn, mcol);
+            span[1] = span[0] + text_width(row + pn + mcol, mlen);
+        }
+        LineHl hl = { i == grep.sel ? 0 : -1, i == grep.sel ? pw : -1, span, 1, 0 }; // selection: the prefix inverted
+        draw_render(row, pn + h->text_len, 0, 0, view.screencols, &hl, false);
+    }
+    char left[200], right[80], n1[32], n2[32], n3[32];
+    fmt_thousands(n1, sizeof(n1), grep.nhits);
+    fmt_thousands(n2, sizeof(n2), grep.nfiles);
+    fmt_thousands(n3, sizeof(n3), atomic_load(&grep.scanned));
+    snprintf(left, sizeof(left), " grep: %.60s  %s lines in %s files%s", grep.query, n1, n2,
+             grep.truncated ? " (stopped at the limit)" : "");
+    int sel = grep.nhits ? grep.sel + 1 : 0;
+    pthread_mutex_unlock(&grep.lock);
+    snprintf(right, sizeof(right), " %s %s files searched ", walk_busy(&grep.walk) ? "searching," : "done,", n3);
+    draw_bar(left, right);
+    ob_printf("\x1b[%d;1H\x1b[2K", view.screenrows + 2); // message line
+    char msg[128];
+    int mlen = snprintf(msg, sizeof(msg), "%d: Enter open | Up/Down/PgUp/PgDn move | Esc back", sel);
+    ob_append(msg, mlen < view.screencols ? mlen : view.screencols);
+    if (sync_output) ob_append("\x1b[?2026l", 8);
+    ob_flush();
+    screen.valid = false;                        // the editor repaints everything afterwards
+}
+
+/* Open the file of hit i at its line; false if it cannot be opened */
+static bool grep_open_hit(int i) {
+    char path[PATH_MAX];
+    pthread_mutex_lock(&grep.lock);
+    GrepHit h = grep.hits[i];
+    snprintf(path, sizeof(path), "%s", grep.files[h.file]);
+    pthread_mutex_unlock(&grep.lock);
+    if (!editor_open_other(path)) return false;
+    view.cy = h.line - 1 < buf.count ? h.line - 1 : buf.count - 1;
+    view.cx = h.col < buf.len[view.cy] ? h.col : buf.len[view.cy];
+    view.pref_cx = line_col_of(&buf, view.cy, view.cx);
+    view.rowoff = vrow_of_line(view.cy) - view.screenrows / 2; // the line mid-screen
+    if (view.rowoff < 0) view.rowoff = 0;
+    snprintf(last_query, sizeof(last_query), "%s", grep.query); // Ctrl-N / Ctrl-B go on in this file
+    last_query_regex = false;
+    hl_set_query(last_query, false);
+    last_match_row = hl_row = view.cy;
+    last_match_col = hl_col = view.cx;
+    hl_len = (int)grep.plan.m;
+    mcount_report();                             // "Match 3 of 12"
+    return true;
+}
+
+/* Ctrl-G: search the tree under the working directory, then pick a result */
+static void editor_grep(void) {
+    char query[256];
+    if (!editor_prompt("grep/", query, sizeof(query), true, NULL)) return;
+    if (query[0]) grep_start(query);
+    else if (!grep.active) {                     // Enter alone: the last results
+        editor_set_status("No earlier project search");
+        return;
+    }
+    while (1) {
+        grep_draw();
+        int c = editor_read_key();
+        int page = view.screenrows > 1 ? view.screenrows - 1 : 1;
+        pthread_mutex_lock(&grep.lock);
+        int n = grep.nhits;
+        pthread_mutex_unlock(&grep.lock);
+        if (c == '\x1b' || c == CTRL_KEY('g') || c == CTRL_KEY('q')) { // back to the buffer (the walk goes on)
+            editor_set_status("");
+            return;
+        }
+        if (c == '\r' || c == '\n') {
+            if (n == 0) continue;
+            if (dirty) {                         // opening would drop the changes
+                editor_set_status("Unsaved changes: Ctrl-S first (Ctrl-G, Enter shows these results again)");
+                return;
+            }
+            if (grep_open_hit(grep.sel)) return;
+        }
+        else if (c == 1011) {                    // paste: nothing here takes text, drop it
+            size_t len;
+            free(paste_take(&len));
+        }
+        else if (c == 1001) grep.sel--;          // Up
+        else if (c == 1002) grep.sel++;          // Down
+        else if (c == 1005) grep.sel -= page;    // PageUp
+        else if (c == 1006) grep.sel += page;    // PageDown
+        else if (c == 1007 || c == (KEY_CTRL | 1007)) grep.sel = 0; // Home
+        else if (c == 1008 || c == (KEY_CTRL | 1008)) grep.sel = n - 1; // End
+        if (grep.sel >= n) grep.sel = n - 1;
+        if (grep.sel < 0) grep.sel = 0;
+    }
+}
+
+/* ----------------------- File picker ----------------------- */
+
+/*
+ * Ctrl-O lists the files under the working directory (walked like project
+ * search, with the same ignore rules) and narrows them as a query is typed:
+ * a path matches when the query's characters appear in it in order, and the
+ * list ranks matches by how tight they are, with bonuses for runs, word
+ * starts and hits inside the file name. Directory listings stay cached
+ * between openings and are read again only when a directory's mtime moved,
+ * so reopening the picker on a big tree mostly walks memory. Every path
+ * carries a mask of the character classes in it, tested for a whole vector
+ * of paths at a time before the subsequence check; typing one more character
+ * only narrows the previous matches.
+ */
+
+/* Bit of byte c in the candidate masks: letters (either case), digits, 27 buckets of other ASCII, non-ASCII */
+static int pick_class(unsigned char c) {
+    if (c >= 'a' && c <= 'z') return c - 'a';
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= '0' && c <= '9') return 26 + (c - '0');
+    if (c >= 0x80) return 63;
+    return 36 + c % 27;
+}
+
+/* Classes of the bytes s[0..n) */
+static uint64_t pick_mask(const char *s, size_t n) {
+    uint64_t m = 0;
+    for (size_t i = 0; i < n; i++) m |= 1ull << pick_class((unsigned char)s[i]);
+    return m;
+}
+
+/* Does path byte h match query byte q (lowercase when folding)? */
+static bool pick_eq(char h, char q, bool fold) {
+    return (fold && h >= 'A' && h <= 'Z' ? (char)(h | 0x20) : h) == q;
+}
+
+/* Is q[0..m) a subsequence of s[0..n)? */
+static bool pick_subseq_scalar(const char *s, int n, const char *q, int m, bool fold) {
+    int k = 0;
+    for (int i = 0; i < n && k < m; i++)
+        if (pick_eq(s[i], q[k], fold)) k++;
+    return k == m;
+}
+
+/* Candidates in [from, to) whose masks hold all the classes in q, into out; how many */
+static int pick_filter_scalar(const uint64_t *mask, int from, int to, uint64_t q, int *out) {
+    int n = 0;
+    for (int i = from; i < to; i++)
+        if ((mask[i] & q) == q) out[n++] = i;
+    return n;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+static int pick_filter_sse2(const uint64_t *mask, int from, int to, uint64_t q, int *out) {
+    const __m128i qv = _mm_set1_epi64x((long long)q);
+    int n = 0, i = from;
+    for (; i + 2 <= to; i += 2) {                // two masks per step, compared as 32-bit halves
+        __m128i v = _mm_loadu_si128((const __m128i*)(mask + i));
+        unsigned eq = (unsigned)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(v, qv), qv)));
+        if ((eq & 3) == 3) out[n++] = i;         // both halves of mask i hold q's
+        if ((eq & 12) == 12) out[n++] = i + 1;
+    }
+    return n + pick_filter_scalar(mask, i, to, q, out + n);
+}
+
+__attribute__((target("avx2")))
+static int pick_filter_avx2(const uint64_t *mask, int from, int to, uint64_t q, int *out) {
+    const __m256i qv = _mm256_set1_epi64x((long long)q);
+    int n = 0, i = from;
+    for (; i + 8 <= to; i += 8) {                // eight masks per step
+        __m256i a = _mm256_loadu_si256((const __m256i*)(mask + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(mask + i + 4));
+        unsigned eq = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(a, qv), qv)))
+                    | (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(b, qv), qv))) << 4;
+        while (eq) {                             // each passing candidate, in order
+            out[n++] = i + __builtin_ctz(eq);
+            eq &= eq - 1;
+        }
+    }
+    return n + pick_filter_scalar(mask, i, to, q, out + n);
+}
+
+/* Subsequence test a vector at a time; reads up to 15 bytes past s + n */
+static bool pick_subseq_sse2(const char *s, int n, const char *q, int m, bool fold) {
+    int pos = 0;                                 // where the next query byte is looked for
+    for (int k = 0; k < m; k++) {
+        const __m128i b = _mm_set1_epi8(q[k]);
+        const __m128i f = _mm_set1_epi8(fold && q[k] >= 'a' && q[k] <= 'z' ? 0x20 : 0); // case bit OR'ed in
+        for (;; pos += 16) {
+            if (pos >= n) return false;
+            __m128i v = _mm_or_si128(_mm_loadu_si128((const __m128i*)(s + pos)), f);
+            unsigned eq = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, b));
+            if (n - pos < 16) eq &= (1u << (n - pos)) - 1; // not past the path
+            if (eq) {
+                pos += __builtin_ctz(eq) + 1;
+                break;
+            }
+        }
+    }
+    return true;
+}
+#endif
+
+/* Candidates in [from, to) whose masks hold all the classes in q, into out; how many */
+static int pick_filter(const uint64_t *mask, int from, int to, uint64_t q, int *out) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    return cpu_has_avx2() ? pick_filter_avx2(mask, from, to, q, out) : pick_filter_sse2(mask, from, to, q, out);
+#else
+    return pick_filter_scalar(mask, from, to, q, out);
+#endif
+}
+
+/* Is q[0..m) a subsequence of path s[0..n) (in pick.text, which has spare bytes at the end)? */
+static bool pick_subseq(const char *s, int n, const char *q, int m, bool fold) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    return pick_subseq_sse2(s, n, q, m, fold);
+#else
+    return pick_subseq_scalar(s, n, q, m, fold);
+#endif
+}
+
+/* Bonus for a match at s[i]: word starts count */
+static int pick_bonus(const char *s, int i) {
+    if (i == 0) return 8;
+    char p = s[i - 1], c = s[i];
+    if (p == '/') return 10;                     // a path component
+    if (p == '_' || p == '-' || p == '.' || p == ' ') return 8; // a word
+    if (p >= 'a' && p <= 'z' && c >= 'A' && c <= 'Z') return 7; // camelCase
+    return 0;
+}
+
+/*
+ * Score of q[0..m) as a subsequence of path s[0..n) whose file name starts
+ * at 'base' (0 when the path has no directory part): within the file name
+ * if it is there, the shortest window ending at the first complete match,
+ * then runs, word starts and gaps inside it. Positions of the matched bytes
+ * go to pos (if not NULL).
+ */
+static int pick_score(const char *s, int n, int base, const char *q, int m, bool fold, int *pos) {
+    int from = pick_subseq_scalar(s + base, n - base, q, m, fold) ? base : 0;
+    int e = from, k = 0;                         // forward: end of the first match
+    for (; k < m; e++)
+        if (e == n) return -1;
+        else if (pick_eq(s[e], q[k], fold)) k++;
+    int b = e;                                   // backward: the latest start for that end
+    for (k = m; k > 0; )
+        if (pick_eq(s[--b], q[k - 1], fold)) k--;
+    int score = from == base ? 24 : 0, run = 0;
+    bool gap = false;
+    for (int i = b; k < m; i++) {
+        if (pick_eq(s[i], q[k], fold)) {
+            int bonus = pick_bonus(s, i);
+            score += 16 + (k == 0 ? 2 * bonus : bonus) + (run ? 8 : 0); // first character and runs count more
+            if (pos) pos[k] = i;
+            k++;
+            run++;
+            gap = false;
+        } else {
+            score -= gap ? 1 : 3;                // opening a gap costs more than widening it
+            run = 0;
+            gap = true;
+        }
+    }
+    return score;
+}
+
+/* Free a cached directory and everything below it */
+static void pick_dir_free(PickDir *pd) {
+    for (int i = 0; i < pd->nsub; i++) pick_dir_free(pd->sub[i]);
+    free(pd->sub);
+    free(pd->names);
+    free(pd->path);
+    walk_free_ignores(pd->ign);
+    free(pd);
+}
+
+/* Order of cached directories by name */
+static int pick_dir_cmp(const void *a, const void *b) {
+    const char *pa = (*(PickDir* const*)a)->path, *pb = (*(PickDir* const*)b)->path;
+    const char *na = strrchr(pa, '/'), *nb = strrchr(pb, '/');
+    return strcmp(na ? na + 1 : pa, nb ? nb + 1 : pb);
+}
+
+/* List directory pd (open as dfd, stat st) again, keeping the nodes of subdirectories still there */
+static void pick_list(PickDir *pd, int dfd, const struct stat *st) {
+    int fd = dup(dfd);                           // closedir closes it
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0) close(fd);
+        return;
+    }
+    PickDir **old = pd->sub;                     // by name, to find them again
+    int nold = pd->nsub;
+    if (nold) qsort(old, nold, sizeof(PickDir*), pick_dir_cmp);
+    bool *kept = (bool*)calloc(nold ? nold : 1, sizeof(bool));
+    char *names = NULL, path[PATH_MAX];
+    size_t len = 0, cap = 0;
+    PickDir **sub = NULL;
+    int nsub = 0, sub_cap = 0;
+    bool has_ignore = false;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        unsigned char type = walk_type(dfd, de);
+        if (type == DT_UNKNOWN || !walk_join(path, sizeof(path), pd->path, de->d_name)) continue;
+        size_t nl = strlen(de->d_name);
+        if (len + nl + 2 > cap) names = (char*)realloc(names, cap = (len + nl + 2) * 2);
+        names[len] = type == DT_DIR ? 'd' : 'f';
+        memcpy(names + len + 1, de->d_name, nl + 1);
+        len += nl + 2;
+        if (type == DT_REG && strcmp(de->d_name, ".gitignore") == 0) has_ignore = true;
+        if (type != DT_DIR) continue;
+        PickDir key = { .path = de->d_name }, *kp = &key, *child;
+        PickDir **hit = nold ? (PickDir**)bsearch(&kp, old, nold, sizeof(PickDir*), pick_dir_cmp) : NULL;
+        if (hit) {                               // listed before: keep what is known below it
+            child = *hit;
+            kept[hit - old] = true;
+        } else {
+            child = (PickDir*)calloc(1, sizeof(PickDir));
+            child->path = strdup(path);
+        }
+        if (nsub == sub_cap) sub = (PickDir**)realloc(sub, (sub_cap = sub_cap ? sub_cap * 2 : 8) * sizeof(PickDir*));
+        sub[nsub++] = child;
+    }
+    closedir(dir);
+    for (int i = 0; i < nold; i++)               // gone (or no longer a directory)
+        if (!kept[i]) pick_dir_free(old[i]);
+    free(kept);
+    free(old);
+    free(pd->names);
+    pd->names = names;
+    pd->names_len = len;
+    pd->sub = sub;
+    pd->nsub = nsub;
+    pd->has_ignore = has_ignore;
+    pd->mtime = st->st_mtim;
+    pd->racy = st->st_mtim.tv_sec >= time(NULL) - 1; // a change later in the same tick would not move mtime
+    pd->listed = true;
+}
+
+/* Add the paths t[0..len) (NUL-terminated, back to back, n of them) to the candidates */
+static void pick_add(const char *t, size_t len, int n) {
+    pthread_mutex_lock(&pick.lock);
+    if (pick.ncand + n > pick.cand_cap) {
+        pick.cand_cap = (pick.ncand + n) * 2;
+        pick.cand = (PickCand*)realloc(pick.cand, pick.cand_cap * sizeof(PickCand));
+        pick.mask = (uint64_t*)realloc(pick.mask, pick.cand_cap * sizeof(uint64_t));
+    }
+    if (pick.text_len + len + 16 > pick.text_cap) { // 16 spare bytes: vector loads may run over the last path
+        pick.text_cap = (pick.text_len + len + 16) * 2;
+        pick.text = (char*)realloc(pick.text, pick.text_cap);
+    }
+    memcpy(pick.text + pick.text_len, t, len);
+    for (const char *p = t; p < t + len; ) {
+        size_t pl = strlen(p);
+        const char *slash = strrchr(p, '/');
+        pick.cand[pick.ncand] = (PickCand){ pick.text_len + (size_t)(p - t), (uint16_t)pl,
+                                            (uint16_t)(slash ? slash - p + 1 : 0) };
+        pick.mask[pick.ncand++] = pick_mask(p, pl);
+        p += pl + 1;
+    }
+    pick.text_len += len;
+    pthread_mutex_unlock(&pick.lock);
+}
+
+/* Walk visit: bring directory d's cache entry up to date, offer its files, queue its subdirectories */
+static void pick_dir(const WalkDir *d, char **rbuf, size_t *rcap) {
+    PickDir *pd = (PickDir*)d->data;
+    int dfd = open(d->path[0] ? d->path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) return;
+    struct stat st;
+    if (fstat(dfd, &st) == 0 && (!pd->listed || pd->racy || st.st_mtim.tv_sec != pd->mtime.tv_sec
+                                 || st.st_mtim.tv_nsec != pd->mtime.tv_nsec))
+        pick_list(pd, dfd, &st);                 // changed since last time
+    if (!pd->has_ignore || fstatat(dfd, ".gitignore", &st, 0) < 0) {
+        walk_free_ignores(pd->ign);
+        pd->ign = NULL;
+    } else if (!pd->ign || st.st_mtim.tv_sec != pd->ign_mtime.tv_sec || st.st_mtim.tv_nsec != pd->ign_mtime.tv_nsec
+               || st.st_size != pd->ign_size) {  // edited (the directory's mtime does not show that)
+        walk_free_ignores(pd->ign);
+        pd->ign = walk_read_ignore(dfd, d->path, NULL);
+        pd->ign_mtime = st.st_mtim;
+        pd->ign_size = st.st_size;
+    }
+    close(dfd);
+    WalkIgnore *ign = d->ign;                    // the rules in force here
+    if (pd->ign) {
+        pd->ign->parent = d->ign;                // on top of this walk's rules above
+        ign = pd->ign;
+    }
+    char path[PATH_MAX];
+    size_t len = 0;                              // files to offer, gathered in the thread's buffer
+    int n = 0, k = 0;                            // how many; next of pd->sub
+    for (size_t o = 0; o < pd->names_len && !atomic_load(&pick.walk.cancel); ) {
+        bool is_dir = pd->names[o] == 'd';
+        const char *name = pd->names + o + 1;
+        o += strlen(name) + 2;
+        PickDir *child = is_dir ? pd->sub[k++] : NULL;
+        if (!walk_join(path, sizeof(path), d->path, name) || walk_ignored(ign, path, is_dir)) continue;
+        if (is_dir) {
+            walk_push(&pick.walk, path, ign, child);
+            continue;
+        }
+        size_t pl = strlen(path) + 1;
+        if (len + pl > *rcap) *rbuf = (char*)realloc(*rbuf, *rcap = (len + pl) * 2 + 4096);
+        memcpy(*rbuf + len, path, pl);
+        len += pl;
+        n++;
+    }
+    if (n) {
+        pick_add(*rbuf, len, n);
+        note_send(pick.note[1], &pick.lock, &pick.last_note, PICK_NOTE_MS, false);
+    }
+}
+
+/* Walk over: the final count */
+static void pick_finished(void) {
+    note_send(pick.note[1], &pick.lock, &pick.last_note, PICK_NOTE_MS, true);
+}
+
+static void on_pick_note(void *arg);
+
+/* Start listing the tree afresh (from the cache where it still holds) */
+static void pick_start(void) {
+    walk_stop(&pick.walk);                       // an unfinished walk: its directories are visited again
+    if (!pick.root) {                            // first use: notes pipe into the event loop
+        note_pipe_open(pick.note, on_pick_note);
+        pthread_mutex_init(&pick.lock, NULL);
+        pick.walk.visit = pick_dir;
+        pick.walk.finished = pick_finished;
+        pick.root = (PickDir*)calloc(1, sizeof(PickDir));
+        pick.root->path = strdup("");
+    }
+    pick.ncand = 0;
+    pick.text_len = 0;
+    pick.last_note = 0;
+    pick.valid = false;
+    pick.sel = pick.top = 0;
+    walk_start(&pick.walk, pick.root);
+}
+
+/* New files: the list redraws */
+static void on_pick_note(void *arg) {
+    (void)arg;
+    note_drain(pick.note[0]);
+    key_push(1014);                              // file list grew: redraw
+}
+
+/* Does survivor a rank above survivor b? Higher score, then shorter path, then found first */
+static bool pick_above(int a, int b) {
+    if (pick.score[a] != pick.score[b]) return pick.score[a] > pick.score[b];
+    int la = pick.cand[pick.surv[a]].len, lb = pick.cand[pick.surv[b]].len;
+    if (la != lb) return la < lb;
+    return pick.surv[a] < pick.surv[b];
+}
+
+/* Restore the heap pick.best[0..n) (the worst on top) below position i */
+static void pick_sift(int i, int n) {
+    while (1) {
+        int w = i;                               // worst of i and its children
+        for (int c = 2 * i + 1; c <= 2 * i + 2 && c < n; c++)
+            if (pick_above(pick.best[w], pick.best[c])) w = c;
+        if (w == i) return;
+        int t = pick.best[i]; pick.best[i] = pick.best[w]; pick.best[w] = t;
+        i = w;
+    }
+}
+
+/* The PICK_SHOW best survivors into pick.best, best first (candidates locked) */
+static void pick_rank(void) {
+    int n = 0;
+    for (int s = 0; s < pick.nsurv; s++) {
+        if (n < PICK_SHOW) {                     // not full: sift up
+            int i = n++;
+            pick.best[i] = s;
+            while (i > 0 && pick_above(pick.best[(i - 1) / 2], pick.best[i])) {
+                int p = (i - 1) / 2, t = pick.best[i];
+                pick.best[i] = pick.best[p];
+                pick.best[p] = t;
+                i = p;
+            }
+        } else if (pick_above(s, pick.best[0])) { // better than the worst kept
+            pick.best[0] = s;
+            pick_sift(0, n);
+        }
+    }
+    for (int i = n - 1; i > 0; i--) {            // take the worst to the back, one by one
+        int t = pick.best[0]; pick.best[0] = pick.best[i]; pick.best[i] = t;
+        pick_sift(0, i);
+    }
+    pick.nbest = n;
+    pick.ranked = true;
+}
+
+/* Bring the matches up to date with query q: narrow or restart, then candidates not yet looked at (stops for keys) */
+static void pick_update(const char *q) {
+    int m = (int)strlen(q);
+    bool fold = true;
+    for (int i = 0; i < m; i++)
+        if (q[i] >= 'A' && q[i] <= 'Z') fold = false; // smart case
+    uint64_t qm = pick_mask(q, m);
+    pthread_mutex_lock(&pick.lock);              // workers append meanwhile
+    if (!pick.valid || strcmp(q, pick.query) != 0 || fold != pick.fold) {
+        size_t old = strlen(pick.query);
+        if (pick.valid && fold == pick.fold && strncmp(q, pick.query, old) == 0) {
+            int w = 0;                           // longer query: only the matches so far can match
+            for (int r = 0; r < pick.nsurv; r++) {
+                int i = pick.surv[r];
+                const PickCand *c = &pick.cand[i];
+                const char *s = pick.text + c->off;
+                if ((pick.mask[i] & qm) != qm || !pick_subseq(s, c->len, q, m, fold)) continue;
+                pick.surv[w] = i;
+                pick.score[w++] = pick_score(s, c->len, c->base, q, m, fold, NULL);
+            }
+            pick.nsurv = w;
+        } else {
+            pick.nsurv = pick.upto = 0;          // from the start
+        }
+        snprintf(pick.query, sizeof(pick.query), "%s", q);
+        pick.fold = fold;
+        pick.valid = true;
+        pick.ranked = false;
+        pick.sel = pick.top = 0;
+    }
+    while (pick.upto < pick.ncand) {             // candidates found since: a chunk at a time
+        int to = pick.ncand - pick.upto > PICK_CHUNK ? pick.upto + PICK_CHUNK : pick.ncand;
+        if (pick.nsurv + (to - pick.upto) > pick.surv_cap) {
+            pick.surv_cap = (pick.nsurv + (to - pick.upto)) * 2;
+            pick.surv = (int*)realloc(pick.surv, pick.surv_cap * sizeof(int));
+            pick.score = (int*)realloc(pick.score, pick.surv_cap * sizeof(int));
+        }
+        int from = pick.nsurv, n = pick_filter(pick.mask, pick.upto, to, qm, pick.surv + from);
+        for (int j = 0; j < n; j++) {            // compacted in place: writes trail reads
+            int i = pick.surv[from + j];
+            const PickCand *c = &pick.cand[i];
+            const char *s = pick.text + c->off;
+            if (!pick_subseq(s, c->len, q, m, fold)) continue;
+            pick.surv[pick.nsurv] = i;
+            pick.score[pick.nsurv++] = m ? pick_score(s, c->len, c->base, q, m, fold, NULL) : 0;
+        }
+        pick.upto = to;
+        pick.ranked = false;
+        if (input_pending()) break;              // typing goes first
+    }
+    if (!pick.ranked) pick_rank();
+    pthread_mutex_unlock(&pick.lock);
+}
+
+/* Draw the list over the text area, with its own status line and the query on the message line */
+static void pick_draw(const char *q) {
+    int m = (int)strlen(q);
+    if (sync_output) ob_append("\x1b[?2026h", 8);
+    ob_append("\x1b[?25l", 6);                   // cursor off while drawing
+    pthread_mutex_lock(&pick.lock);
+    if (pick.sel >= pick.nbest) pick.sel = pick.nbest ? pick.nbest - 1 : 0;
+    if (pick.sel < pick.top) pick.top = pick.sel;
+    if (pick.sel >= pick.top + view.screenrows) pick.top = pick.sel - view.screenrows + 1;
+    for (int y = 0; y < view.screenrows; y++) {
+        ob_printf("\x1b[%d;1H\x1b[2K", y + 1);
+        int i = pick.top + y;
+        if (i >= pick.nbest) continue;
+        const PickCand *c = &pick.cand[pick.surv[pick.best[i]]];
+        const char *p = pick.text + c->off;
+        char row[PATH_MAX + 2];
+        int rn = snprintf(row, sizeof(row), "%s %s", i == pick.sel ? ">" : " ", p);
+        int pos[256], span[512], nspans = 0;     // matched bytes, as column ranges
+        if (m && pick_score(p, c->len, c->base, q, m, pick.fold, pos) >= 0) {
+            for (int k = 0; k < m; ) {
+                int a = 2 + pos[k], b = a + 1;   // a run of matched bytes in row
+                for (k++; k < m && 2 + pos[k] == b; k++) b++;
+                while (a > 2 && ((unsigned char)row[a] & 0xC0) == 0x80) a--; // whole characters
+                while (b < rn && ((unsigned char)row[b] & 0xC0) == 0x80) b++;
+                span[2 * nspans] = text_width(row, a);
+                span[2 * nspans + 1] = text_width(row, b);
+                if (nspans && span[2 * nspans] <= span[2 * nspans - 1]) span[2 * nspans - 1] = span[2 * nspans + 1];
+                else nspans++;
+            }
+        }
+        LineHl hl = { i == pick.sel ? 0 : -1, i == pick.sel ? 1 : -1, span, nspans, 0 }; // selection: the marker inverted
+        draw_render(row, rn, 0, 0, view.screencols, &hl, false);
+    }
+    char left[200], right[80], n1[32], n2[32];
+    fmt_thousands(n1, sizeof(n1), pick.nsurv);
+    fmt_thousands(n2, sizeof(n2), pick.ncand);
+    snprintf(left, sizeof(left), " open: %s of %s files", n1, n2);
+    pthread_mutex_unlock(&pick.lock);
+    snprintf(right, sizeof(right), " %s Enter open | Up/Down move | Esc back ",
+             walk_busy(&pick.walk) ? "listing... |" : "");
+    draw_bar(left, right);
+    ob_printf("\x1b[%d;1H\x1b[2K", view.screenrows + 2); // message line: the query, cursor after it
+    int qw = text_width(q, m), shown = 0;
+    if (6 + qw >= view.screencols) {             // too long: its end
+        while (shown < m && 6 + text_width(q + shown, m - shown) >= view.screencols) shown++;
+        while (shown < m && ((unsigned char)q[shown] & 0xC0) == 0x80) shown++;
+    }
+    ob_append("open/ ", 6 < view.screencols ? 6 : view.screencols);
+    ob_append(q + shown, m - shown);
+    ob_printf("\x1b[%d;%dH\x1b[?25h", view.screenrows + 2, 7 + text_width(q + shown, m - shown));
+    if (sync_output) ob_append("\x1b[?2026l", 8);
+    ob_flush();
+    screen.valid = false;                        // the editor repaints everything afterwards
+}
+
+/* Ctrl-O: pick a file under the working directory by typing parts of its path */
+static void editor_pick(void) {
+    if (dirty) {                                 // opening would drop the changes
+        editor_set_status("Unsaved changes: Ctrl-S first");
+        return;
+    }
+    pick_start();
+    char q[256] = "";
+    size_t n = 0;
+    while (1) {
+        if (!input_pending()) {                  // typed-ahead keys: apply them first
+            pick_update(q);
+            pick_draw(q);
+        }
+        int c = editor_read_key();
+        int page = view.screenrows > 1 ? view.screenrows - 1 : 1;
+        if (c == '\x1b' || c == CTRL_KEY('o') || c == CTRL_KEY('q')) { // back to the buffer
+            editor_set_status("");
+            return;
+        }
+        if (c == '\r' || c == '\n') {
+            char path[PATH_MAX] = "";
+            pthread_mutex_lock(&pick.lock);
+            if (pick.sel < pick.nbest)
+                snprintf(path, sizeof(path), "%s", pick.text + pick.cand[pick.surv[pick.best[pick.sel]]].off);
+            pthread_mutex_unlock(&pick.lock);
+            if (path[0] && editor_open_other(path)) {
+                editor_set_status("Opened %s", path);
+                return;
+            }
+        }
+        else if (c == 1011) {                    // paste: first line of it
+            size_t len;
+            char *text = paste_take(&len);
+            for (size_t i = 0; text && i < len && text[i] != '\n' && n + 1 < sizeof(q); i++) q[n++] = text[i];
+            q[n] = '\0';
+            free(text);
+        }
+        else if (c == 127) {                     // Backspace: a whole code point
+            while (n > 0) {
+                unsigned char dropped = (unsigned char)q[--n];
+                q[n] = '\0';
+                if ((dropped & 0xC0) != 0x80) break;
+            }
+        }
+        else if ((c < 0x80 && isprint(c)) || (c >= 0x80 && c <= 0xFF)) { // printable or UTF-8 byte
+            if (n + 1 < sizeof(q)) {
+                q[n++] = (char)c;
+                q[n] = '\0';
+            }
+        }
+        else if (c == 1001) pick.sel--;          // Up
+        else if (c == 1002) pick.sel++;          // Down
+        else if (c == 1005) pick.sel -= page;    // PageUp
+        else if (c == 1006) pick.sel += page;    // PageDown
+        if (pick.sel < 0) pick.sel = 0;          // the top end (pick_draw clamps the other)
+    }
+}
+
+/* ----------------------- Main loop ----------------------- */
+
+/* Apply one key to the editor state. Returns true when the editor should exit. */
+static bool editor_process_key(int c, bool *request_redraw) {
+    *request_redraw = true;                    // by default we redraw
+    c &= ~KEY_SHIFT;                           // no selections: Shift+move is a plain move
+    bool typing = c == 127 || (c < 0x80 && isprint(c)) || (c >= 0x80 && c <= 0xFF);
+    bool wakeup = c == 1009 || c == 1010 || c == 1012 || c == 1013 || c == 1014; // nothing but a redraw
+    if (!typing && !wakeup) undo_seal();       // any other key ends a run of typing or erasing
+
+    if (c == CTRL_KEY('q')) {                  // Ctrl-Q
+        if (dirty && quit_times_needed > 0) {  // if unsaved changes and still need confirmation
+            editor_set_status("Unsaved changes — press Ctrl-Q again to quit"); // warn
+            quit_times_needed--;               // decrease counter
+        } else {
+            xwrite(STDOUT_FILENO, "\x1b[2J\x1b[H", 7); // clear screen on exit
+            *request_redraw = false;           // no need to redraw
+            return true;                       // exit loop
+        }
+    } else if (c == CTRL_KEY('s')) {           // Ctrl-S save
+        if (editor_save_atomic())              // try to save
+            editor_set_status("Saved: %s", filename); // success
+        else
+            editor_set_status("Save failed: %s", strerror(errno)); // error
+        quit_times_needed = 1;                 // reset quit counter
+    } else if (c == CTRL_KEY('f')) {           // Ctrl-F search
+        editor_find(false);                    // run search
+        quit_times_needed = 1;                 // reset quit counter
+    } else if (c == CTRL_KEY('r')) {           // Ctrl-R regex search
+        editor_find(true);                     // run search
+        quit_times_needed = 1;                 // reset quit counter
+    } else if (c == CTRL_KEY('n')) {           // Ctrl-N next match
+        if (!editor_find_next(false))          // find next after last match
+            editor_set_status("No more matches for: %s", last_query); // message
+        else
+            mcount_report();                   // "Match 4 of 12,408"
+        quit_times_needed = 1;                 // reset
+    } else if (c == CTRL_KEY('g')) {           // Ctrl-G search the project
+        editor_grep();                         // prompt, then the results list
+        quit_times_needed = 1;                 // reset
+    } else if (c == CTRL_KEY('o')) {           // Ctrl-O open a file of the project
+        editor_pick();                         // query, then the ranked list
+        quit_times_needed = 1;                 // reset
+    } else if (c == CTRL_KEY('z')) {           // Ctrl-Z undo
+        editor_undo();                         // the last step, back to the cursor it had
+        quit_times_needed = 1;                 // reset
+    } else if (c == CTRL_KEY('y')) {           // Ctrl-Y redo
+        editor_redo();                         // the step undone last
+        quit_times_needed = 1;                 // reset
+    } else if (c == CTRL_KEY('e')) {           // Ctrl-E replace
+        editor_replace();                      // prompts, then y/n/a/q per match
+        quit_times_needed = 1;                 // reset
+    } else if (c == CTRL_KEY('b')) {           // Ctrl-B previous match
+        if (!editor_find_prev())               // scan backwards from the last match
+            editor_set_status("No more matches for: %s", last_query); // message
+        else
+            mcount_report();                   // "Match 3 of 12,408"
+        quit_times_needed = 1;                 // reset
+    } else if (c == (KEY_ALT | 'c')) {         // Alt-C search case mode
+        editor_cycle_case();                   // sensitive -> ignore -> smart
+    } else if (c == 1011) {                    // bracketed paste
+        editor_paste();                        // one bulk insert
+        quit_times_needed = 1;                 // reset
+    } else if (c == 1009 || c == 1010 || c == 1012) { // resized / message expired / match count grew
+        /* nothing to apply: just redraw */
+    } else if (c == CTRL_KEY('p')) {           // Ctrl-P toggle profiling overlay
+        prof.on = !prof.on;                    // show or hide frame statistics
+    } else if (c == CTRL_KEY('w')) {           // Ctrl-W toggle soft wrap
+        editor_toggle_wrap();                  // switch modes
+    } else if (c == 1005 || c == 1006) {       // PageUp / PageDown
+        editor_move_cursor_vert(c);            // move by page
+        quit_times_needed = 1;                 // reset
+        hl_row = hl_col = hl_len = -1;         // clear highlight
+    } else if (c == (KEY_CTRL | 1003) || c == (KEY_CTRL | 1004)) { // Ctrl-Right / Ctrl-Left
+        editor_move_word(c & ~KEY_CTRL);       // move by word
+        quit_times_needed = 1;                 // reset
+        hl_row = hl_col = hl_len = -1;         // clear highlight
+    } else if (c == 1001 || c == 1002 || c == 1003 || c == 1004 || c == 1007 || c == 1008
+               || c == (KEY_CTRL | 1007) || c == (KEY_CTRL | 1008)) {
+        editor_move_cursor(c);                 // move cursor
+        quit_times_needed = 1;                 // reset
+        hl_row = hl_col = hl_len = -1;         // clear highlight
+    } else if (c == '\r' || c == '\n') {       // Enter
+        editor_insert_newline();               // split line
+        quit_times_needed = 1;                 // reset
+    } else if (c == 127) {                     // Backspace / Delete
+        editor_backspace();                    // delete char
+        quit_times_needed = 1;                 // reset
+    } else if ((c < 0x80 && isprint(c)) || (c >= 0x80 && c <= 0xFF)) { // printable char or UTF-8 byte
+        editor_insert_char(c);                 // insert
+        quit_times_needed = 1;                 // reset
+    } else {
+        *request_redraw = false;               // unknown key: no need to redraw
+    }
+    return false;                              // keep running
+}
+
+static void on_winch(void *arg) {
+    int fd = *(int*)arg;                         // the signalfd
+    struct signalfd_siginfo si;                  // drain the pending signal
+    while (read(fd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {}
+    int top = 0, top_col = 0;                    // soft wrap: the text at the top, by line and column
+    if (soft_wrap) {                             // (visual rows are renumbered for the new width)
+        int seg;
+        vrow_locate(view.rowoff < vrow_total() ? view.rowoff : vrow_total() - 1, &top, &seg);
+        top_col = wrap_seg_start(top, seg);
+    }
+    if (editor_update_dimensions()) {            // one ioctl per resize, not per key
+        if (soft_wrap)                           // the same text stays on top
+            view.rowoff = vrow_of_line(top) + wrap_seg_of_col(top, top_col);
+        key_push(1009);                          // window resized: redraw
+    }
+}
+
+/* Register the editor's own event sources: terminal input, resizes, message expiry */
+static void events_init(void) {
+    static int winch_fd;                         // handed to on_winch
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    sigprocmask(SIG_BLOCK, &mask, NULL);         // deliver SIGWINCH through the fd only
+    winch_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    status_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (winch_fd < 0 || status_timer_fd < 0) die("signalfd/timerfd");
+
+    ev_add(STDIN_FILENO, on_stdin, NULL);        // keys
+    ev_add(winch_fd, on_winch, &winch_fd);       // window size changes
+    ev_add(status_timer_fd, on_status_timer, NULL); // status message expiry
+    ev.idle = tindex_idle;                       // the trigram index builds between keys
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 2 && strcmp(argv[1], "--bench-search") == 0) // search throughput check, no UI
+        return search_bench(argc >= 3 ? atoi(argv[2]) : 0);
+    if (argc >= 2 && strcmp(argv[1], "--bench-regex") == 0) // regex throughput check, no UI
+        return regex_bench(argc >= 3 ? atoi(argv[2]) : 0);
+
+    atexit(disable_raw_mode);                  // make sure raw mode is off at exit
+    enable_raw_mode();                         // enter raw mode
+    terminal_probe_sync();                     // can frames be shown atomically?
+    events_init();                             // everything main waits on
+
+    buffer_init(&buf);                         // initialize buffer with 1 empty line
+    if (argc >= 2) {                           // if file provided
+        snprintf(filename, sizeof(filename), "%s", argv[1]); // remember name
+        editor_open(argv[1]);                  // load file
+    }
+
+    int fps_cap = FRAME_RATE_CAP;              // frame-rate cap from the config
+    const char *fps_env = getenv("AURIGA_FPS"); // optional override from the environment
+    if (fps_env && *fps_env)                   // set and not empty
+        fps_cap = atoi(fps_env);               // parse it (0 or garbage = no cap)
+    long frame_ms = fps_cap > 0 ? 1000 / fps_cap : 0; // minimum time between two frames
+
+    view.cx = view.cy = 0;                     // cursor at start
+    view.pref_cx = 0;                          // preferred col 0
+    view.rowoff = view.coloff = 0;             // no scroll yet
+    editor_update_dimensions();                // get terminal size
+    editor_set_status("HELP: type | Enter | Backspace | Ctrl-S save | Ctrl-F find | Ctrl-R regex | Ctrl-N next | Ctrl-B prev | Alt-C case | Ctrl-E replace | Ctrl-Z undo | Ctrl-Y redo | Ctrl-G grep | Ctrl-O open | Ctrl-W wrap | Ctrl-P stats | Ctrl-Q quit"); // initial help
+    editor_draw_screen();                      // first draw
+    long last_frame = monotonic_ms();          // when the last frame went out
+
+    bool pending_redraw = false;               // some applied key still waits to be shown
+    while (1) {                                // main loop
+        int c = editor_read_key();             // read key
+
+        bool request_redraw;                   // does this key change what is shown?
+        if (editor_process_key(c, &request_redraw)) // apply the key
+            break;                             // break main loop
+        if (pending_redraw && request_redraw)  // this change will share a frame with an earlier one
+            prof.skipped++;                    // one frame fewer than keys (profiling overlay)
+        pending_redraw = pending_redraw || request_redraw; // remember until the next frame
+
+        /* Typeahead: while more keys are already waiting, apply them first and draw once. */
+        long since = monotonic_ms() - last_frame; // time since last frame
+        if (input_pending() && since < MAX_FRAME_GAP_MS) // but never starve the screen
+            continue;                          // keep consuming input
+        if (frame_ms > since && ev_ready(frame_ms - since)) // frame cap: wait out the slot
+            continue;                          // an event arrived inside the slot: batch it too
+
+        if (pending_redraw) {                  // if something changed since last frame
+            editor_draw_screen();              // draw once for the whole batch
+            last_frame = monotonic_ms();       // start a new frame slot
+            pending_redraw = false;            // everything is on screen now
+        }
+    }
+
+    buffer_free(&buf);                         // free buffer
+    return 0;                                  // done
+}